@@ -0,0 +1,370 @@
+// benchmarks of the interpreter core, prints a table or with --json a document for regression tracking
+#include "tinyLisp.h"
+#include "module.h"
+#include "output.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#ifndef TINYLISP_ROOT
+#define TINYLISP_ROOT "."
+#endif
+
+using namespace lsp;
+
+// peak resident set of the process so far, in KiB
+static uint64_t peak_rss_kb()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize / 1024;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024; // bytes there
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+struct Result
+{
+	std::string name;
+	std::string unit; // what items counts
+	uint64_t items;	  // per run
+	double best;	  // seconds
+	double median;
+	uint64_t allocations; // per run, the fewest seen
+	uint64_t peak_rss_kb; // of the process once the benchmark ran
+};
+
+struct Options
+{
+	std::string root = TINYLISP_ROOT;
+	std::string filter;
+	int repeat = 5;
+	int opt_level = 0; // of the interpreters running lisp code
+	bool jit = false;
+	bool quick = false;
+	bool json = false;
+	bool list = false;
+};
+
+class Bench
+{
+public:
+	explicit Bench(Options const& options) : options(options) {}
+
+	bool enabled(char const* name) const
+	{
+		return options.filter.empty() || strstr(name, options.filter.c_str()) != nullptr;
+	}
+
+	// runs fn once to warm up then repeat times, fn does items of work per run
+	void measure(char const* name, char const* unit, uint64_t items, std::function<void()> const& fn)
+	{
+		fn();
+		std::vector<double> times;
+		uint64_t allocations = UINT64_MAX;
+		for (int i = 0; i < options.repeat; i++)
+		{
+			uint64_t const alloc_start = allocation_count();
+			auto const start = std::chrono::steady_clock::now();
+			fn();
+			auto const end = std::chrono::steady_clock::now();
+			allocations = std::min(allocations, allocation_count() - alloc_start);
+			times.push_back(std::chrono::duration<double>(end - start).count());
+		}
+		std::sort(times.begin(), times.end());
+
+		Result r{ name, unit, items, times.front(), times[times.size() / 2], allocations, peak_rss_kb() };
+		if (!options.json)
+			printf("%-16s %10.3f %10.3f %14.0f %-12s %10llu %10llu\n", r.name.c_str(), r.best * 1e3, r.median * 1e3, r.items / r.best,
+				r.unit.c_str(), (unsigned long long)r.allocations, (unsigned long long)r.peak_rss_kb);
+		fflush(stdout);
+		results.push_back(std::move(r));
+	}
+
+	void print_json() const
+	{
+		printf("{\n\t\"repeat\": %d,\n\t\"quick\": %s,\n\t\"opt_level\": %d,\n\t\"peak_rss_kb\": %llu,\n\t\"benchmarks\": [\n",
+			options.repeat, options.quick ? "true" : "false", options.opt_level, (unsigned long long)peak_rss_kb());
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			Result const& r = results[i];
+			printf("\t\t{ \"name\": \"%s\", \"unit\": \"%s\", \"items\": %llu, \"best_s\": %.9f, \"median_s\": %.9f, "
+				"\"items_per_s\": %.3f, \"allocations\": %llu, \"peak_rss_kb\": %llu }%s\n",
+				r.name.c_str(), r.unit.c_str(), (unsigned long long)r.items, r.best, r.median, r.items / r.best,
+				(unsigned long long)r.allocations, (unsigned long long)r.peak_rss_kb, i + 1 < results.size() ? "," : "");
+		}
+		printf("\t]\n}\n");
+	}
+
+	Options const& options;
+	std::vector<Result> results;
+};
+
+// a large program of defuns, calls, numbers and strings that reads without errors
+static std::string generate_source(size_t functions)
+{
+	std::string source;
+	char line[256];
+	for (size_t i = 0; i < functions; i++)
+	{
+		snprintf(line, sizeof(line),
+			"(defun gen_%zu (x y)\n\t(if (< x %zu)\n\t\t(+ x y 1.5 -%zu)\n\t\t(strcat \"gen %zu \" (list x y (* x %zu.25)))))\n", i, i, i, i, i);
+		source += line;
+	}
+	return source;
+}
+
+static void import_std(Interpreter& interp, Options const& options)
+{
+	interp.evalS("(import \"" + options.root + "/stdLib.lsp\")");
+}
+
+static uint64_t fib_calls(int n)
+{
+	return n < 2 ? 1 : 1 + fib_calls(n - 1) + fib_calls(n - 2);
+}
+
+static void bench_reader(Bench& bench)
+{
+	if (!bench.enabled("lex") && !bench.enabled("read") && !bench.enabled("parse_module"))
+		return;
+	std::string const source = generate_source(bench.options.quick ? 5000 : 50000);
+
+	if (bench.enabled("lex"))
+	{
+		bench.measure("lex", "byte", source.size(), [&] {
+			Lexer lexer(source);
+			while (lexer.next().type != TokenType::End)
+				;
+		});
+	}
+	if (bench.enabled("read"))
+	{
+		Interpreter interp;
+		bench.measure("read", "byte", source.size(), [&] { interp.read_forms(source); });
+	}
+	if (bench.enabled("parse_module"))
+		bench.measure("parse_module", "byte", source.size(), [&] { parse_module(source); });
+}
+
+static void bench_eval(Bench& bench)
+{
+	Options const& options = bench.options;
+
+	if (bench.enabled("fib"))
+	{
+		int const n = options.quick ? 20 : 25;
+		Interpreter interp;
+		interp.opt_level = options.opt_level;
+		interp.jit = options.jit;
+		interp.evalS("(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+		std::string const call = "(fib " + std::to_string(n) + ")";
+		bench.measure("fib", "call", fib_calls(n), [&] { interp.evalS(call); });
+	}
+
+	// loops are written in lisp so the loop itself is part of what is measured
+	auto loop = [&](char const* name, int count, char const* body) {
+		if (!bench.enabled(name))
+			return;
+		Interpreter interp;
+		interp.opt_level = options.opt_level;
+		interp.jit = options.jit;
+		import_std(interp, options);
+		std::string const program = "(set i 0) (while (< i " + std::to_string(count) + ") " + body + " (set i (+ i 1)))";
+		bench.measure(name, "iteration", count, [&] { interp.evalS(program); });
+	};
+	loop("std_pow", options.quick ? 10000 : 100000, "(std_pow 3 10)");
+	loop("std_sqrt", options.quick ? 200 : 2000, "(std_sqrt 1234.5)");
+	loop("std_random", options.quick ? 10000 : 100000, "(set r (std_random i))");
+
+	auto list = [&](char const* name, char const* program) {
+		if (!bench.enabled(name))
+			return;
+		int const n = options.quick ? 10000 : 100000;
+		Interpreter interp;
+		interp.opt_level = options.opt_level;
+		interp.jit = options.jit;
+		import_std(interp, options);
+		interp.evalS("(set l (to_list (range 0 " + std::to_string(n) + ")))");
+		bench.measure(name, "item", n, [&] { interp.evalS(program); });
+	};
+	list("std_transform", "(set r (std_transform l std_sqr))");
+	list("std_filter", "(set r (std_filter l std_is_even))");
+
+	if (bench.enabled("map_lookup"))
+	{
+		int const n = options.quick ? 10000 : 100000;
+		Interpreter interp;
+		interp.opt_level = options.opt_level;
+		interp.jit = options.jit;
+		// string keys looked up in a table of a thousand routes
+		interp.evalS("(set routes (map)) (set keys (list)) (set i 0)"
+			"(while (< i 1000) (set k (strcat \"/route/\" i)) (map_set routes k i) (set keys (append keys k)) (set i (+ i 1)))");
+		std::string const program = "(set i 0) (while (< i " + std::to_string(n) + ") (map_get routes (get keys (% i 1000))) (set i (+ i 1)))";
+		bench.measure("map_lookup", "lookup", n, [&] { interp.evalS(program); });
+	}
+
+	if (bench.enabled("closure_cycles"))
+	{
+		int const n = options.quick ? 10000 : 100000;
+		Interpreter interp;
+		interp.opt_level = options.opt_level;
+		interp.jit = options.jit;
+		// each closure is kept by a slot of the frame it captures, only the collections free them
+		interp.evalS("(defun make_adder (n) (defun add (x) (+ x n)) add)");
+		std::string const program = "(set i 0) (while (< i " + std::to_string(n) + ") (set a (make_adder i)) (set i (+ i 1)))";
+		bench.measure("closure_cycles", "closure", n, [&] { interp.evalS(program); });
+	}
+
+	if (bench.enabled("println"))
+	{
+		int const n = options.quick ? 10000 : 100000;
+		Interpreter interp;
+		interp.opt_level = options.opt_level;
+		interp.jit = options.jit;
+		// captured in memory, what is measured is the formatting and the buffering
+		auto const sink = std::make_shared<StringSink>();
+		interp.output().set_sink(sink);
+		std::string const program = "(set i 0) (while (< i " + std::to_string(n) + ") (println i (* i 1.5) (list i \"row\")) (set i (+ i 1)))";
+		bench.measure("println", "line", n, [&] {
+			interp.evalS(program);
+			interp.output().flush();
+			sink->take();
+		});
+	}
+}
+
+static void bench_startup(Bench& bench)
+{
+	Options const& options = bench.options;
+	int const count = options.quick ? 10 : 100;
+
+	// what a new process pays before running anything, the module cache starts empty there
+	if (bench.enabled("startup_import"))
+	{
+		bench.measure("startup_import", "interpreter", count, [&] {
+			for (int i = 0; i < count; i++)
+			{
+				ModuleCache::instance().clear();
+				Interpreter interp;
+				import_std(interp, options);
+			}
+		});
+	}
+
+	if (bench.enabled("startup_isolate"))
+	{
+		auto const base = std::make_shared<BaseEnvironement const>([&](Interpreter& interp) { import_std(interp, options); });
+		bench.measure("startup_isolate", "interpreter", count * 10, [&] {
+			for (int i = 0; i < count * 10; i++)
+				Interpreter interp(base);
+		});
+	}
+
+	if (bench.enabled("startup_image"))
+	{
+		std::string const image = "tinyLisp_bench.img";
+		{
+			Interpreter interp;
+			import_std(interp, options);
+			if (!interp.save_image(image))
+			{
+				fprintf(stderr, "cannot write %s, skipping startup_image\n", image.c_str());
+				return;
+			}
+		}
+		bench.measure("startup_image", "interpreter", count, [&] {
+			for (int i = 0; i < count; i++)
+			{
+				Interpreter interp;
+				interp.load_image(image);
+			}
+		});
+		remove(image.c_str());
+	}
+}
+
+static void usage()
+{
+	puts("usage : tinyLisp_bench [options]\n"
+		"  --json           prints the results as json once every benchmark ran\n"
+		"  --filter text    runs the benchmarks whose name contains text\n"
+		"  --repeat n       measured runs of each benchmark, 5 by default\n"
+		"  --quick          smaller workloads, to check the benchmarks still run\n"
+		"  --opt n          optimization level of the interpreters running lisp code\n"
+		"  --jit            runs lisp code with the jit\n"
+		"  --root dir       directory of stdLib.lsp\n"
+		"  --list           prints the names of the benchmarks");
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		char const* arg = argv[i];
+		bool const has_value = i + 1 < argc;
+		if (!strcmp(arg, "--json"))
+			options.json = true;
+		else if (!strcmp(arg, "--quick"))
+			options.quick = true;
+		else if (!strcmp(arg, "--list"))
+			options.list = true;
+		else if (!strcmp(arg, "--filter") && has_value)
+			options.filter = argv[++i];
+		else if (!strcmp(arg, "--repeat") && has_value)
+			options.repeat = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(arg, "--opt") && has_value)
+			options.opt_level = atoi(argv[++i]);
+		else if (!strcmp(arg, "--jit"))
+			options.jit = true;
+		else if (!strcmp(arg, "--root") && has_value)
+			options.root = argv[++i];
+		else
+		{
+			usage();
+			return !strcmp(arg, "--help") ? 0 : 2;
+		}
+	}
+
+	if (options.list)
+	{
+		for (char const* name : { "lex", "read", "parse_module", "fib", "std_pow", "std_sqrt", "std_random", "std_transform", "std_filter", "map_lookup", "closure_cycles", "println",
+				 "startup_import", "startup_isolate", "startup_image" })
+			puts(name);
+		return 0;
+	}
+
+	Bench bench(options);
+	if (!options.json)
+		printf("%-16s %10s %10s %14s %-12s %10s %10s\n", "benchmark", "best ms", "median ms", "per second", "of", "allocs/run", "peak KiB");
+	bench_reader(bench);
+	bench_eval(bench);
+	bench_startup(bench);
+	if (options.json)
+		bench.print_json();
+	return 0;
+}
@@ -0,0 +1,20 @@
+; call heavy micro benchmark, run from the repository root
+(import "stdLib.lsp")
+
+(set n 1000000)
+(set i 0)
+(set start (clock))
+(while (< i n)
+	(std_sqr i)
+	(set i (+ i 1))
+	)
+(println (strcat "std_sqr x" n " : " (- (clock) start) " s"))
+
+; tail calls reuse the caller's frame, a million of them run in constant stack on the vm
+(defun count_down (n acc)
+	(if (= n 0)
+		acc
+		(count_down (- n 1) (+ acc 1))))
+(set start (clock))
+(set r (count_down n 0))
+(println (strcat "tail calls x" r " : " (- (clock) start) " s"))
@@ -0,0 +1,28 @@
+; numeric loop micro benchmark, run from the repository root
+(import "stdLib.lsp")
+
+(set n 100000)
+(set i 0)
+(set start (clock))
+(while (< i n)
+	(std_pow 3 10)
+	(set i (+ i 1))
+	)
+(println (strcat "std_pow x" n " : " (- (clock) start) " s"))
+
+(set i 0)
+(set start (clock))
+(while (< i 2000)
+	(std_sqrt 1234.5)
+	(set i (+ i 1))
+	)
+(println (strcat "std_sqrt x2000 : " (- (clock) start) " s"))
+
+(set i 0)
+(set r 1)
+(set start (clock))
+(while (< i n)
+	(set r (% (std_random r) 4294967296))
+	(set i (+ i 1))
+	)
+(println (strcat "std_random x" n " : " (- (clock) start) " s, last " r))
@@ -0,0 +1,25 @@
+; pmap scaling from 1 thread to every core on a cpu heavy mapper, run from the repository root
+(import "stdLib.lsp")
+
+(set n 4000)
+(set l (list))
+(set i 0)
+(while (< i n)
+	(set l (append l (+ i 1000.5)))
+	(set i (+ i 1))
+	)
+
+(set start (clock))
+(std_transform l std_sqrt)
+(set base (- (clock) start))
+(println (strcat "std_transform std_sqrt x" n " : " base " s"))
+
+(set threads 1)
+(while (<= threads (cpu_count))
+	(set_threads threads)
+	(set start (clock))
+	(pmap l std_sqrt)
+	(set t (- (clock) start))
+	(println (strcat "pmap std_sqrt x" n " on " threads " threads : " t " s, speedup " (/ base t)))
+	(set threads (* threads 2))
+	)
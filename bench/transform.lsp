@@ -0,0 +1,21 @@
+; list building micro benchmark on 100k elements, run from the repository root
+(import "stdLib.lsp")
+
+(set n 100000)
+(set i 0)
+(set l null)
+(set start (clock))
+(while (< i n)
+	(set l (append l i))
+	(set i (+ i 1))
+	)
+(println (strcat "append x" n " : " (- (clock) start) " s"))
+
+(set start (clock))
+(set squares (std_transform l std_sqr))
+(println (strcat "std_transform x" n " : " (- (clock) start) " s"))
+
+(set start (clock))
+(set evens (std_filter l std_is_even))
+(println (strcat "std_filter x" n " : " (- (clock) start) " s"))
+(println (strcat "last square : " (get squares (- n 1)) ", evens : " (length evens)))
@@ -0,0 +1,44 @@
+; packed vectors against a loop over a list, run from the repository root
+; TINYLISP_SIMD=scalar|sse2|avx2 caps the kernels used
+(set n 1000000)
+(set l (list))
+(set i 0)
+(while (< i n)
+	(set l (append l (* i 0.5)))
+	(set i (+ i 1))
+	)
+
+(set i 0)
+(set s 0.0)
+(set start (clock))
+(while (< i n)
+	(set s (+ s (get l i)))
+	(set i (+ i 1))
+	)
+(println (strcat "list loop sum x" n " : " (- (clock) start) " s, " s))
+
+(set v (to_vector l))
+(set start (clock))
+(set r 0)
+(set i 0)
+(while (< i 100)
+	(set r (sum v))
+	(set i (+ i 1))
+	)
+(println (strcat "vector sum x" n " x100 : " (- (clock) start) " s, " r))
+
+(set start (clock))
+(set i 0)
+(while (< i 100)
+	(set r (dot v v))
+	(set i (+ i 1))
+	)
+(println (strcat "vector dot x" n " x100 : " (- (clock) start) " s, " r))
+
+(set start (clock))
+(set i 0)
+(while (< i 100)
+	(set r (sum (v* (v+ v 1.0) (v< v 1000.0))))
+	(set i (+ i 1))
+	)
+(println (strcat "vector masked sum x" n " x100 : " (- (clock) start) " s, " r))
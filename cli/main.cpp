@@ -0,0 +1,195 @@
+#include "tinyLisp.h"
+#include "profiler.h"
+#include "output.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static void usage()
+{
+	puts("usage : tinyLisp [options] [file.lsp...]\n"
+		"  -e expr              evaluates expr, may be repeated\n"
+		"  -                    reads the program from stdin, the default without files nor -e\n"
+		"  --tree               evaluates with the tree walker instead of the bytecode vm\n"
+		"  -O0 -O1 -O2          optimization level, -O1 folds constants and literal branches, -O2 also inlines small procs\n"
+		"  --dump-opt           prints the forms the optimizer changed, before and after\n"
+		"  --jit                compiles hot numeric loops and procs to native code, on x86-64 Linux\n"
+		"  --threads n          threads of the parallel builtins\n"
+		"  --check              only reads the sources and prints how many forms they have\n"
+		"  --output file        writes what the sources print to file instead of stdout\n"
+		"  --flush policy       full, line or manual, when the printed text is written, full by default\n"
+		"  --image file         loads an image before running the sources\n"
+		"  --save-image file    saves the globals to an image once the sources ran\n"
+		"  --profile file       profiles the sources, prints the calls to stderr and writes collapsed stacks to file\n"
+		"  --interval us        sampling interval of --profile in microseconds, 1000 by default\n"
+		"  --help               prints this");
+}
+
+static bool read_source(std::string const& name, std::string& out)
+{
+	std::stringstream ss;
+	if (name == "-")
+	{
+		ss << std::cin.rdbuf();
+	}
+	else
+	{
+		std::ifstream file(name, std::ios::binary);
+		if (!file)
+			return false;
+		ss << file.rdbuf();
+	}
+	out = ss.str();
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	struct Source
+	{
+		bool is_file;
+		std::string text; // file name or expression
+	};
+
+	std::vector<Source> sources;
+	lsp::EvalMode mode = lsp::EvalMode::Bytecode;
+	size_t threads = 0;
+	bool check = false;
+	int opt_level = 0;
+	bool dump_optimized = false;
+	bool jit = false;
+	std::string image, save_image, profile, output;
+	lsp::FlushPolicy flush = lsp::FlushPolicy::Full;
+	long interval = 1000;
+
+	for (int i = 1; i < argc; i++)
+	{
+		char const* arg = argv[i];
+		bool const has_value = i + 1 < argc;
+		if (!strcmp(arg, "--help") || !strcmp(arg, "-h"))
+		{
+			usage();
+			return 0;
+		}
+		else if (!strcmp(arg, "--tree"))
+			mode = lsp::EvalMode::Tree;
+		else if (!strcmp(arg, "--check"))
+			check = true;
+		else if (!strcmp(arg, "-O0") || !strcmp(arg, "-O1") || !strcmp(arg, "-O2"))
+			opt_level = arg[2] - '0';
+		else if (!strcmp(arg, "--dump-opt"))
+			dump_optimized = true;
+		else if (!strcmp(arg, "--jit"))
+			jit = true;
+		else if (!strcmp(arg, "-e") && has_value)
+			sources.push_back({ false, argv[++i] });
+		else if (!strcmp(arg, "--threads") && has_value)
+			threads = strtoul(argv[++i], nullptr, 10);
+		else if (!strcmp(arg, "--image") && has_value)
+			image = argv[++i];
+		else if (!strcmp(arg, "--save-image") && has_value)
+			save_image = argv[++i];
+		else if (!strcmp(arg, "--output") && has_value)
+			output = argv[++i];
+		else if (!strcmp(arg, "--flush") && has_value && (!strcmp(argv[i + 1], "full") || !strcmp(argv[i + 1], "line") || !strcmp(argv[i + 1], "manual")))
+		{
+			char const* policy = argv[++i];
+			flush = policy[0] == 'f' ? lsp::FlushPolicy::Full : policy[0] == 'l' ? lsp::FlushPolicy::Line : lsp::FlushPolicy::Manual;
+		}
+		else if (!strcmp(arg, "--profile") && has_value)
+			profile = argv[++i];
+		else if (!strcmp(arg, "--interval") && has_value)
+			interval = std::max(strtol(argv[++i], nullptr, 10), 1L);
+		else if (arg[0] == '-' && arg[1] != '\0')
+		{
+			fprintf(stderr, "unknown option or missing value : %s\n", arg);
+			usage();
+			return 2;
+		}
+		else
+			sources.push_back({ true, arg });
+	}
+	if (sources.empty())
+		sources.push_back({ true, "-" });
+
+	lsp::Interpreter interp;
+	interp.mode = mode;
+	interp.opt_level = opt_level;
+	interp.dump_optimized = dump_optimized;
+	interp.jit = jit;
+	if (threads)
+		interp.set_threads(threads);
+	interp.output().policy = flush;
+	if (!output.empty())
+	{
+		auto sink = lsp::FileSink::open(output);
+		if (!sink)
+		{
+			fprintf(stderr, "cannot write %s\n", output.c_str());
+			return 1;
+		}
+		interp.output().set_sink(std::move(sink));
+	}
+	// what the sources printed is not lost when they crash the runner, e.g. with a stack overflow
+	lsp::Output::install_crash_handlers(interp.output());
+	if (!image.empty() && !interp.load_image(image))
+	{
+		fprintf(stderr, "cannot load image %s\n", image.c_str());
+		return 1;
+	}
+
+	std::unique_ptr<lsp::Profiler> profiler;
+	if (!profile.empty())
+	{
+		profiler = std::make_unique<lsp::Profiler>(std::chrono::microseconds(interval));
+		interp.set_profiler(profiler.get());
+	}
+
+	for (auto const& source : sources)
+	{
+		std::string text;
+		if (!source.is_file)
+			text = source.text;
+		else if (!read_source(source.text, text))
+		{
+			fprintf(stderr, "cannot read %s\n", source.text.c_str());
+			return 1;
+		}
+
+		if (check)
+			interp.output().printf("%s : %zu forms\n", source.is_file ? source.text.c_str() : "-e", interp.read_forms(text));
+		else
+			interp.evalS(text);
+	}
+
+	if (profiler)
+	{
+		interp.set_profiler(nullptr);
+		profiler->finish();
+		profiler->write_report(stderr);
+		FILE* out = fopen(profile.c_str(), "w");
+		if (!out)
+		{
+			fprintf(stderr, "cannot write %s\n", profile.c_str());
+			return 1;
+		}
+		profiler->write_collapsed(out);
+		fclose(out);
+	}
+
+	if (!save_image.empty() && !interp.save_image(save_image))
+	{
+		fprintf(stderr, "cannot save image %s\n", save_image.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,280 @@
+#include "heap.h"
+#include "memo.h"
+
+#include <algorithm>
+#include <utility>
+
+using namespace lsp;
+
+static thread_local Heap* current_heap = nullptr;
+
+Container::~Container()
+{
+	if (heap)
+		heap->untrack(this);
+}
+
+void ListObj::references(HeapVisitor& visitor) const
+{
+	for (uint32_t i = 0; i < size; i++)
+		visitor.visit(items()[i]);
+}
+
+void ListObj::clear() noexcept
+{
+	for (uint32_t i = 0; i < size; i++)
+		items()[i] = Cell();
+}
+
+void ProcObj::references(HeapVisitor& visitor) const
+{
+	visitor.visit(env);
+	// a cache shared by two procs would be counted twice
+	if (memo && memo.use_count() == 1)
+		memo->references(visitor);
+}
+
+void ProcObj::clear() noexcept
+{
+	if (env)
+		std::exchange(env, nullptr)->release();
+	memo.reset();
+}
+
+void MapObj::references(HeapVisitor& visitor) const
+{
+	each([&](Cell const& key, Cell const& value) {
+		visitor.visit(key);
+		visitor.visit(value);
+	});
+}
+
+void MapObj::clear() noexcept
+{
+	entries.clear();
+	index.clear();
+	count = 0;
+}
+
+// frames are only followed from the objects, a frame no closure keeps is held by its call
+template<typename Visitor>
+static void frame_references(Environement* frame, Visitor& visitor)
+{
+	for (auto const& c : frame->slots)
+		visitor.visit(c);
+	visitor.visit(frame->parent);
+}
+
+// takes the references between the nodes out of their counts
+struct Heap::Subtract final : HeapVisitor
+{
+	Heap& heap;
+
+	explicit Subtract(Heap& heap) : heap(heap) {}
+
+	void visit(Cell const& cell) override
+	{
+		if (Container* obj = heap.node(cell))
+			heap.refs[obj->heap_slot]--;
+	}
+
+	void visit(Environement* frame) override
+	{
+		// the global environement and the frames of a base environement are never garbage
+		if (!frame || !frame->pool || frame->refcount.load(std::memory_order_relaxed) >= detail::immortal)
+			return;
+		if (frame->heap_epoch != heap.epoch)
+		{
+			frame->heap_epoch = heap.epoch;
+			frame->heap_refs = frame->refcount.load(std::memory_order_relaxed);
+			heap.frames.push_back(frame);
+		}
+		frame->heap_refs--;
+	}
+};
+
+// marks what the nodes referenced from outside reach
+struct Heap::Mark final : HeapVisitor
+{
+	Heap& heap;
+
+	explicit Mark(Heap& heap) : heap(heap) {}
+
+	void visit(Cell const& cell) override
+	{
+		if (Container* obj = heap.node(cell))
+			heap.mark(obj);
+	}
+
+	void visit(Environement* frame) override
+	{
+		if (frame)
+			heap.mark(frame);
+	}
+};
+
+Heap::~Heap()
+{
+	// objects still alive, held by the host, are freed without a heap
+	for (Container* obj : tracked)
+		obj->heap = nullptr;
+}
+
+void Heap::track(Container* obj)
+{
+	std::unique_lock<std::mutex> guard(lock, std::defer_lock);
+	if (detail::concurrent())
+		guard.lock();
+	obj->heap = this;
+	obj->heap_slot = (uint32_t)tracked.size();
+	tracked.push_back(obj);
+	made.fetch_add(1, std::memory_order_relaxed);
+	counters.tracked++;
+}
+
+void Heap::untrack(Container* obj) noexcept
+{
+	std::unique_lock<std::mutex> guard(lock, std::defer_lock);
+	if (detail::concurrent())
+		guard.lock();
+	Container* const last = tracked.back();
+	tracked[obj->heap_slot] = last;
+	last->heap_slot = obj->heap_slot;
+	tracked.pop_back();
+	obj->heap = nullptr;
+}
+
+Container* Heap::node(Cell const& cell) const noexcept
+{
+	if (cell.type != CellType::List && cell.type != CellType::Map && cell.type != CellType::Proc)
+		return nullptr;
+	auto const obj = static_cast<Container*>(cell.object);
+	return obj->heap == this ? obj : nullptr;
+}
+
+void Heap::mark(Container* obj)
+{
+	if (refs[obj->heap_slot] == reachable)
+		return;
+	refs[obj->heap_slot] = reachable;
+	pending.push_back(obj);
+}
+
+void Heap::mark(Environement* frame)
+{
+	if (frame->heap_epoch != epoch || frame->heap_refs == reachable)
+		return;
+	frame->heap_refs = reachable;
+	pending_frames.push_back(frame);
+}
+
+size_t Heap::collect()
+{
+	if (detail::concurrent())
+		return 0;
+	auto const start = std::chrono::steady_clock::now();
+	if (++epoch == 0)
+		epoch = 1;
+
+	refs.resize(tracked.size());
+	for (size_t i = 0; i < tracked.size(); i++)
+		refs[i] = tracked[i]->refcount.load(std::memory_order_relaxed);
+
+	Subtract subtract(*this);
+	for (Container* obj : tracked)
+		obj->references(subtract);
+	// frames found while going through the others are added after them
+	for (size_t i = 0; i < frames.size(); i++)
+		frame_references(frames[i], subtract);
+
+	// immortal objects keep their huge counts and are always reachable
+	for (size_t i = 0; i < tracked.size(); i++)
+	{
+		if (refs[i] > 0)
+			mark(tracked[i]);
+	}
+	for (Environement* frame : frames)
+	{
+		if (frame->heap_refs > 0)
+			mark(frame);
+	}
+
+	Mark marker(*this);
+	while (!pending.empty() || !pending_frames.empty())
+	{
+		if (!pending.empty())
+		{
+			Container* const obj = pending.back();
+			pending.pop_back();
+			obj->references(marker);
+		}
+		else
+		{
+			Environement* const frame = pending_frames.back();
+			pending_frames.pop_back();
+			frame_references(frame, marker);
+		}
+	}
+
+	for (size_t i = 0; i < tracked.size(); i++)
+	{
+		if (refs[i] != reachable)
+			garbage.push_back(tracked[i]);
+	}
+	for (Environement* frame : frames)
+	{
+		if (frame->heap_refs != reachable)
+			garbage_frames.push_back(frame);
+	}
+
+	// every one of them is held while the references between them are dropped, none is freed half cleared
+	for (Container* obj : garbage)
+		detail::add_ref(obj->refcount);
+	for (Environement* frame : garbage_frames)
+		frame->retain();
+	for (Container* obj : garbage)
+		obj->clear();
+	for (Environement* frame : garbage_frames)
+	{
+		for (auto& c : frame->slots)
+			c = Cell();
+		if (frame->parent)
+			std::exchange(frame->parent, nullptr)->release();
+	}
+	for (Container* obj : garbage)
+	{
+		if (detail::drop_ref(obj->refcount))
+			delete obj;
+	}
+	for (Environement* frame : garbage_frames)
+		frame->release();
+
+	size_t const freed = garbage.size() + garbage_frames.size();
+	garbage.clear();
+	garbage_frames.clear();
+	frames.clear();
+
+	made.store(0, std::memory_order_relaxed);
+	threshold = std::max(min_threshold, tracked.size());
+	auto const pause = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+	counters.collections++;
+	counters.freed += freed;
+	counters.pause_total += pause;
+	counters.pause_max = std::max(counters.pause_max, pause);
+	return freed;
+}
+
+Heap* Heap::current() noexcept
+{
+	return current_heap;
+}
+
+Heap::Scope::Scope(Heap& heap) noexcept : previous(current_heap)
+{
+	current_heap = &heap;
+}
+
+Heap::Scope::~Scope()
+{
+	current_heap = previous;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include "tinyLisp.h"
+
+#include <chrono>
+
+namespace lsp {
+
+	// what the collections of a heap did so far
+	struct HeapStats
+	{
+		uint64_t collections = 0;
+		uint64_t tracked = 0; // lists, maps and procs made, the work the collections are amortized over
+		uint64_t freed = 0;	  // objects and frames of the garbage cycles
+		std::chrono::nanoseconds pause_total{ 0 };
+		std::chrono::nanoseconds pause_max{ 0 };
+	};
+
+	// reference counting frees an object with its last reference, the heap frees the cycles it cannot:
+	// a closure kept by a slot of the frame it captures, a list or map holding itself
+	// a collection takes the references each tracked object and each frame they keep gets from the others
+	// out of its count, what is left is referenced from outside, the stack or the globals, and keeps what it reaches alive
+	// the rest only keep each other alive, their references are dropped and they are freed
+	// every interpreter has its own, objects made outside of one are never tracked
+	class Heap
+	{
+	public:
+		// objects made before a collection is due, at least as many as the previous one left so the work stays
+		// proportional to what is made
+		static constexpr size_t min_threshold = 4096;
+
+		Heap() = default;
+		~Heap();
+		Heap(Heap const&) = delete;
+		Heap& operator=(Heap const&) = delete;
+
+		void track(Container* obj);
+		void untrack(Container* obj) noexcept;
+
+		bool due() const noexcept { return made.load(std::memory_order_relaxed) >= threshold; }
+		// collects once due, called where every cell in use is held by a reference, parallel tasks never collect
+		void poll()
+		{
+			if (!detail::concurrent() && due())
+				collect();
+		}
+		// returns the objects and frames freed
+		size_t collect();
+
+		size_t size() const noexcept { return tracked.size(); }
+		HeapStats const& stats() const noexcept { return counters; }
+
+		// the heap the objects made on the calling thread go to, null outside of an interpreter
+		static Heap* current() noexcept;
+
+		// makes heap the current heap of the thread for its lifetime
+		class Scope
+		{
+		public:
+			explicit Scope(Heap& heap) noexcept;
+			~Scope();
+			Scope(Scope const&) = delete;
+			Scope& operator=(Scope const&) = delete;
+
+		private:
+			Heap* previous;
+		};
+
+	private:
+		struct Subtract;
+		struct Mark;
+
+		// the node of what cell references, null when it is not tracked here
+		Container* node(Cell const& cell) const noexcept;
+		void mark(Container* obj);
+		void mark(Environement* frame);
+
+		static constexpr uint32_t reachable = UINT32_MAX;
+
+		std::vector<Container*> tracked;
+		std::atomic<size_t> made{ 0 }; // since the last collection, counted by the tasks of a parallel job too
+		size_t threshold = min_threshold;
+		std::mutex lock; // tasks of a parallel job make and free objects at once
+		HeapStats counters;
+
+		// state of a collection, kept to reuse the memory
+		uint32_t epoch = 0;
+		std::vector<uint32_t> refs; // by slot, references from outside or reachable
+		std::vector<Environement*> frames; // kept by the tracked objects, their counts are in the frames
+		std::vector<Container*> pending;
+		std::vector<Environement*> pending_frames;
+		std::vector<Container*> garbage;
+		std::vector<Environement*> garbage_frames;
+	};
+}
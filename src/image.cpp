@@ -0,0 +1,780 @@
+#include "tinyLisp.h"
+#include "mapped_file.h"
+#include "memo.h"
+#include "output.h"
+#include "heap.h"
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+using namespace lsp;
+
+// an image holds, in the byte order of the machine that wrote it:
+//   the header
+//   the symbol names then the imported files, as u32 length + bytes
+//   the offset of every entity, u64 each
+//   the entities: strings, lists, vectors, procs, frames, lambdas and scopes, referencing each other by index
+//   the globals, u32 symbol + cell, from the offset in the header
+// cells take 16 bytes: type, kind, depth, form, u32 symbol or count, u64 immediate value or entity index
+namespace {
+
+	constexpr char image_magic[8] = { 't', 'i', 'n', 'y', 'L', 'i', 's', 'p' };
+	constexpr uint32_t image_version = 2;
+	constexpr uint32_t byte_order = 0x01020304;
+	constexpr uint32_t no_entity = UINT32_MAX;
+	constexpr size_t cell_bytes = 16;
+
+	struct ImageHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order;
+		uint32_t symbols;
+		uint32_t imports;
+		uint32_t entities;
+		uint32_t globals;
+		uint64_t globals_offset;
+	};
+
+	enum class Entity : uint8_t
+	{
+		String,
+		List,
+		Form, // list of an arena, loaded in the arena of the image
+		Vector,
+		Native, // referenced by registration id
+		Proc,
+		Frame,
+		Lambda,
+		Scope,
+		Memo, // proc made by memoize, saved without its cached results
+		Map,
+	};
+
+	class ImageWriter
+	{
+	public:
+		explicit ImageWriter(std::vector<Cell> const& natives)
+		{
+			// the first registration of a native gives its id
+			for (size_t i = natives.size(); i-- > 0;)
+				native_ids[&natives[i].as_proc()] = (uint32_t)i;
+		}
+
+		// gives an index to what the cell reaches, false when it reaches a native that was not registered
+		bool visit(Cell const& cell)
+		{
+			if (!cell.is_object())
+				return true;
+
+			if (cell.type == CellType::Proc && cell.as_proc().fn)
+			{
+				if (native_ids.count(&cell.as_proc()) == 0)
+				{
+					runtime_error("cannot save the native %s, it was not set as a global !", cell.as_proc().name.c_str());
+					return false;
+				}
+				add(Entity::Native, cell.object);
+				return true;
+			}
+
+			bool const immortal = cell.object->refcount.load(std::memory_order_relaxed) >= Object::immortal;
+			Entity const kind = cell.type == CellType::String ? Entity::String
+				: cell.type == CellType::List ? (immortal ? Entity::Form : Entity::List)
+				: cell.type == CellType::Vector ? Entity::Vector
+				: cell.type == CellType::Map ? Entity::Map
+				: cell.as_proc().memo ? Entity::Memo : Entity::Proc;
+			if (!add(kind, cell.object))
+				return true;
+
+			bool ok = true;
+			if (cell.type == CellType::List)
+			{
+				auto list = static_cast<ListObj*>(cell.object);
+				for (uint32_t i = 0; i < list->size; i++)
+					ok = visit(list->items()[i]) && ok;
+				if (list->lambda)
+					ok = visit(list->lambda) && ok;
+			}
+			else if (kind == Entity::Proc)
+			{
+				ok = visit(cell.as_proc().lambda.get());
+				ok = visit(cell.as_proc().env) && ok;
+			}
+			else if (kind == Entity::Memo)
+			{
+				ok = visit(cell.as_proc().memo->proc);
+			}
+			else if (kind == Entity::Map)
+			{
+				cell.as_map().each([&](Cell const& key, Cell const& value) {
+					ok = visit(key) && ok;
+					ok = visit(value) && ok;
+				});
+			}
+			return ok;
+		}
+
+		void write(ImageHeader header, SymbolTable const& symbols, std::unordered_set<std::string> const& imports,
+			std::vector<std::pair<SymbolId, Cell const*>> const& globals)
+		{
+			header.entities = (uint32_t)entities.size();
+			put(header);
+			for (size_t i = 0; i < symbols.size(); i++)
+				put_string(symbols.name((SymbolId)i));
+			for (auto const& file : imports)
+				put_string(file);
+
+			size_t const offsets = out.size();
+			out.resize(out.size() + entities.size() * sizeof(uint64_t));
+			for (size_t i = 0; i < entities.size(); i++)
+			{
+				uint64_t const offset = out.size();
+				std::memcpy(&out[offsets + i * sizeof(uint64_t)], &offset, sizeof(offset));
+				write_entity(entities[i].first, entities[i].second);
+			}
+
+			uint64_t const globals_offset = out.size();
+			std::memcpy(&out[offsetof(ImageHeader, globals_offset)], &globals_offset, sizeof(globals_offset));
+			for (auto const& [sym, value] : globals)
+			{
+				put(sym);
+				put_cell(*value);
+			}
+		}
+
+		std::string out;
+
+	private:
+		bool visit(Lambda const* lambda)
+		{
+			if (!add(Entity::Lambda, lambda))
+				return true;
+			visit(lambda->scope.get());
+			bool ok = true;
+			for (auto const& c : lambda->body)
+				ok = visit(c) && ok;
+			return ok;
+		}
+
+		bool visit(Environement const* frame)
+		{
+			bool ok = true;
+			for (; frame && add(Entity::Frame, frame); frame = frame->parent)
+			{
+				visit(frame->scope.get());
+				for (auto const& c : frame->slots)
+					ok = visit(c) && ok;
+			}
+			return ok;
+		}
+
+		void visit(Scope const* scope)
+		{
+			while (scope && add(Entity::Scope, scope))
+				scope = scope->parent;
+		}
+
+		// false when it already has one
+		bool add(Entity kind, void const* ptr)
+		{
+			if (!index.emplace(ptr, (uint32_t)entities.size()).second)
+				return false;
+			entities.emplace_back(kind, ptr);
+			return true;
+		}
+
+		uint32_t index_of(void const* ptr) const { return ptr ? index.at(ptr) : no_entity; }
+
+		void write_entity(Entity kind, void const* ptr)
+		{
+			put(kind);
+			switch (kind)
+			{
+			case Entity::String:
+				put_string(static_cast<StringObj const*>(ptr)->value);
+				break;
+			case Entity::List:
+			case Entity::Form:
+			{
+				auto list = static_cast<ListObj const*>(ptr);
+				put(list->size);
+				put(index_of(list->lambda));
+				for (uint32_t i = 0; i < list->size; i++)
+					put_cell(const_cast<ListObj*>(list)->items()[i]);
+				break;
+			}
+			case Entity::Vector:
+			{
+				auto v = static_cast<VectorObj const*>(ptr);
+				put(v->elem);
+				put(v->size);
+				out.append(reinterpret_cast<const char*>(v + 1), v->size * sizeof(int64_t));
+				break;
+			}
+			case Entity::Native:
+			{
+				auto p = static_cast<ProcObj const*>(ptr);
+				put(native_ids.at(p));
+				put_string(p->name);
+				break;
+			}
+			case Entity::Proc:
+			{
+				auto p = static_cast<ProcObj const*>(ptr);
+				put_string(p->name);
+				put(index_of(p->lambda.get()));
+				put(index_of(p->env));
+				break;
+			}
+			case Entity::Memo:
+			{
+				auto p = static_cast<ProcObj const*>(ptr);
+				put_string(p->name);
+				put(p->min_args);
+				put(p->max_args);
+				put((uint64_t)p->memo->capacity());
+				put_cell(p->memo->proc);
+				break;
+			}
+			case Entity::Map:
+			{
+				auto map = static_cast<MapObj const*>(ptr);
+				put((uint32_t)map->size());
+				map->each([&](Cell const& key, Cell const& value) {
+					put_cell(key);
+					put_cell(value);
+				});
+				break;
+			}
+			case Entity::Frame:
+			{
+				auto frame = static_cast<Environement const*>(ptr);
+				put(index_of(frame->scope.get()));
+				put(index_of(frame->parent));
+				put((uint32_t)frame->slots.size());
+				for (auto const& c : frame->slots)
+					put_cell(c);
+				break;
+			}
+			case Entity::Lambda:
+			{
+				auto lambda = static_cast<Lambda const*>(ptr);
+				put(lambda->name);
+				put(lambda->nparams);
+				put(index_of(lambda->scope.get()));
+				put((uint32_t)lambda->body.size());
+				for (auto const& c : lambda->body)
+					put_cell(c);
+				break;
+			}
+			case Entity::Scope:
+			{
+				auto scope = static_cast<Scope const*>(ptr);
+				put(index_of(scope->parent));
+				put((uint8_t)scope->dynamic);
+				put((uint8_t)scope->captures);
+				put((uint32_t)scope->names.size());
+				for (SymbolId sym : scope->names)
+					put(sym);
+				break;
+			}
+			}
+		}
+
+		void put_cell(Cell const& c)
+		{
+			put(c.type);
+			put(c.kind);
+			put(c.depth);
+			put(c.form);
+			put(c.sym);
+			put(c.is_object() ? (uint64_t)index_of(c.object) : c.bits);
+		}
+
+		void put_string(std::string const& str)
+		{
+			put((uint32_t)str.size());
+			out += str;
+		}
+
+		template<typename T>
+		void put(T const& value)
+		{
+			out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+
+		std::unordered_map<void const*, uint32_t> index;
+		std::vector<std::pair<Entity, void const*>> entities;
+		std::unordered_map<ProcObj const*, uint32_t> native_ids;
+	};
+
+	// decodes the entities straight from the mapped file, in two passes as they reference each other in cycles
+	class ImageReader
+	{
+	public:
+		ImageReader(std::string_view data, SymbolTable& symbols, std::vector<Cell> const& natives, FramePool& frame_pool)
+			: data(data), symbols(symbols), natives(natives), frame_pool(frame_pool) {}
+
+		~ImageReader()
+		{
+			// the references of the table go, what the globals reach stays
+			for (auto& e : loaded)
+			{
+				if (e.frame)
+					e.frame->release();
+			}
+		}
+
+		bool read(std::unordered_set<std::string>& imports, std::vector<std::pair<SymbolId, Cell>>& globals)
+		{
+			ImageHeader const header = get<ImageHeader>();
+			if (!ok || std::memcmp(header.magic, image_magic, sizeof(image_magic)) != 0)
+				return fail("not an image");
+			if (header.version != image_version || header.byte_order != byte_order)
+				return fail("written by another version or on another kind of machine");
+
+			for (uint32_t i = 0; i < header.symbols && ok; i++)
+				symbol_ids.push_back(symbols.intern(get_string()));
+			for (uint32_t i = 0; i < header.imports && ok; i++)
+				imports.emplace(get_string());
+
+			if (header.entities > data.size() / sizeof(uint64_t))
+				return fail("corrupted");
+			std::vector<uint64_t> offsets(header.entities);
+			for (auto& offset : offsets)
+				offset = get<uint64_t>();
+			if (!ok)
+				return fail("truncated");
+
+			loaded.resize(offsets.size());
+			for (size_t i = 0; i < offsets.size() && ok; i++)
+			{
+				pos = offsets[i];
+				create(loaded[i]);
+			}
+			for (size_t i = 0; i < offsets.size() && ok; i++)
+			{
+				pos = offsets[i];
+				fill(loaded[i]);
+			}
+
+			pos = header.globals_offset;
+			for (uint32_t i = 0; i < header.globals && ok; i++)
+			{
+				SymbolId const sym = symbol(get<uint32_t>());
+				globals.emplace_back(sym, get_cell());
+			}
+			return ok || fail("corrupted");
+		}
+
+	private:
+		struct Loaded
+		{
+			Entity kind;
+			Cell object;				   // strings, lists, vectors and procs
+			Environement* frame = nullptr; // holds a reference until the load ends
+			Lambda* lambda = nullptr;
+			Scope* scope = nullptr;
+		};
+
+		// the entity without its references to others
+		void create(Loaded& e)
+		{
+			e.kind = get<Entity>();
+			switch (e.kind)
+			{
+			case Entity::String:
+				e.object = Cell::make_string(std::string(get_string()));
+				break;
+			case Entity::List:
+			{
+				uint32_t const size = get_count(cell_bytes);
+				if (ok)
+					e.object = Cell::make_list(nullptr, size);
+				break;
+			}
+			case Entity::Form:
+			{
+				// the items are filled in place by the second pass
+				uint32_t const size = get_count(cell_bytes);
+				if (!ok)
+					break;
+				items.resize(size);
+				Cell c{ CellType::List };
+				c.object = image_arena().new_list(items.data(), size);
+				c.count = size;
+				e.object = c;
+				break;
+			}
+			case Entity::Vector:
+			{
+				CellType const elem = get<CellType>();
+				uint32_t const size = get<uint32_t>();
+				std::string_view const bytes = get_bytes(size * sizeof(int64_t));
+				if (!ok || (elem != CellType::Int && elem != CellType::Float))
+				{
+					ok = false;
+					break;
+				}
+				e.object = Cell::make_vector(elem, size);
+				std::memcpy(e.object.as_vector().ints(), bytes.data(), bytes.size());
+				break;
+			}
+			case Entity::Native:
+			{
+				uint32_t const id = get<uint32_t>();
+				std::string_view const name = get_string();
+				if (ok && (id >= natives.size() || natives[id].as_proc().name != name))
+				{
+					runtime_error("the image needs the native %.*s with the registration id %u !", (int)name.size(), name.data(), id);
+					ok = false;
+					break;
+				}
+				e.object = natives[id];
+				break;
+			}
+			case Entity::Proc:
+			case Entity::Memo:
+				e.object = Cell::make_proc(nullptr, std::string(get_string()));
+				break;
+			case Entity::Map:
+			{
+				uint32_t const size = get_count(2 * cell_bytes);
+				if (ok)
+					e.object = Cell::make_map(size);
+				break;
+			}
+			case Entity::Frame:
+				e.frame = new Environement();
+				e.frame->pool = &frame_pool;
+				e.frame->refcount.store(1, std::memory_order_relaxed);
+				break;
+			case Entity::Lambda:
+				e.lambda = image_arena().new_lambda();
+				break;
+			case Entity::Scope:
+				if (!scopes)
+					scopes = std::make_shared<std::deque<Scope>>();
+				e.scope = &scopes->emplace_back();
+				break;
+			default:
+				ok = false;
+			}
+		}
+
+		void fill(Loaded& e)
+		{
+			get<Entity>();
+			switch (e.kind)
+			{
+			case Entity::List:
+			case Entity::Form:
+			{
+				auto list = static_cast<ListObj*>(e.object.object);
+				get<uint32_t>();
+				if (Loaded* lambda = entity(get<uint32_t>(), Entity::Lambda))
+					list->lambda = lambda->lambda;
+				for (uint32_t i = 0; i < list->size && ok; i++)
+					list->items()[i] = get_cell();
+				break;
+			}
+			case Entity::Proc:
+			{
+				ProcObj& p = e.object.as_proc();
+				get_string();
+				Loaded* lambda = entity(get<uint32_t>(), Entity::Lambda);
+				if (!lambda)
+				{
+					ok = false;
+					break;
+				}
+				// the procs share the ownership of the arena holding the lambdas, like the ones made by defun
+				p.lambda = std::shared_ptr<Lambda>(arena, lambda->lambda);
+				if (Loaded* env = entity(get<uint32_t>(), Entity::Frame))
+				{
+					env->frame->retain();
+					p.env = env->frame;
+				}
+				break;
+			}
+			case Entity::Memo:
+			{
+				ProcObj& p = e.object.as_proc();
+				get_string();
+				p.min_args = get<uint16_t>();
+				p.max_args = get<uint16_t>();
+				uint64_t const capacity = get<uint64_t>();
+				Cell target = get_cell();
+				if (!ok || target.type != CellType::Proc)
+				{
+					ok = false;
+					break;
+				}
+				p.memo = std::make_shared<MemoCache>(std::move(target), (size_t)capacity);
+				break;
+			}
+			case Entity::Map:
+			{
+				MapObj& map = e.object.as_map();
+				uint32_t const size = get<uint32_t>();
+				for (uint32_t i = 0; i < size && ok; i++)
+				{
+					Cell key = get_cell();
+					Cell value = get_cell();
+					if (ok && !MapObj::valid_key(key))
+						ok = false;
+					if (ok)
+						map.set(key, std::move(value));
+				}
+				break;
+			}
+			case Entity::Frame:
+			{
+				Environement& frame = *e.frame;
+				if (Loaded* scope = entity(get<uint32_t>(), Entity::Scope))
+					frame.scope = std::shared_ptr<Scope>(scopes, scope->scope);
+				if (Loaded* parent = entity(get<uint32_t>(), Entity::Frame))
+				{
+					parent->frame->retain();
+					frame.parent = parent->frame;
+				}
+				frame.slots.resize(get_count(cell_bytes));
+				for (size_t i = 0; i < frame.slots.size() && ok; i++)
+					frame.slots[i] = get_cell();
+				break;
+			}
+			case Entity::Lambda:
+			{
+				Lambda& lambda = *e.lambda;
+				lambda.name = symbol(get<uint32_t>());
+				lambda.nparams = get<uint32_t>();
+				Loaded* scope = entity(get<uint32_t>(), Entity::Scope);
+				if (!scope)
+				{
+					ok = false;
+					break;
+				}
+				lambda.scope = std::shared_ptr<Scope>(scopes, scope->scope);
+				lambda.body.resize(get_count(cell_bytes));
+				for (size_t i = 0; i < lambda.body.size() && ok; i++)
+					lambda.body[i] = get_cell();
+				break;
+			}
+			case Entity::Scope:
+			{
+				Scope& scope = *e.scope;
+				if (Loaded* parent = entity(get<uint32_t>(), Entity::Scope))
+					scope.parent = parent->scope;
+				scope.dynamic = get<uint8_t>() != 0;
+				scope.captures = get<uint8_t>() != 0;
+				scope.names.resize(get_count(sizeof(uint32_t)));
+				for (size_t i = 0; i < scope.names.size() && ok; i++)
+					scope.names[i] = symbol(get<uint32_t>());
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		// symbols and global slots get the ids of this interpreter, local slots stay
+		Cell get_cell()
+		{
+			CellType const type = get<CellType>();
+			SymbolKind const kind = get<SymbolKind>();
+			uint8_t const depth = get<uint8_t>();
+			Form const form = get<Form>();
+			uint32_t const sym = get<uint32_t>();
+			uint64_t const bits = get<uint64_t>();
+			if (!ok || type > CellType::Map || kind > SymbolKind::Global || form > Form::Profile)
+			{
+				ok = false;
+				return Cell();
+			}
+
+			Cell c;
+			if (type >= CellType::String)
+			{
+				Loaded* e = bits < loaded.size() ? &loaded[bits] : nullptr;
+				if (!e || e->object.type != type)
+				{
+					ok = false;
+					return Cell();
+				}
+				c = e->object;
+			}
+			else
+			{
+				c.type = type;
+				c.bits = bits;
+			}
+
+			c.kind = kind;
+			c.depth = depth;
+			c.form = form;
+			c.sym = sym;
+			if (type == CellType::Symbol)
+			{
+				c.sym = symbol(sym);
+				if (kind == SymbolKind::Global)
+					c.slot = c.sym;
+			}
+			else if (type == CellType::List && sym > static_cast<ListObj*>(c.object)->size)
+			{
+				ok = false;
+			}
+			else if (type == CellType::String && sym > static_cast<StringObj*>(c.object)->value.size())
+			{
+				ok = false;
+			}
+			return c;
+		}
+
+		Arena& image_arena()
+		{
+			if (!arena)
+				arena = std::make_shared<Arena>();
+			return *arena;
+		}
+
+		// null for no_entity, an out of range index or one of another kind fails the load
+		Loaded* entity(uint32_t index, Entity kind)
+		{
+			if (index == no_entity)
+				return nullptr;
+			if (index >= loaded.size() || loaded[index].kind != kind)
+			{
+				ok = false;
+				return nullptr;
+			}
+			return &loaded[index];
+		}
+
+		SymbolId symbol(uint32_t id)
+		{
+			if (id < symbol_ids.size())
+				return symbol_ids[id];
+			ok = false;
+			return 0;
+		}
+
+		std::string_view get_bytes(size_t size)
+		{
+			if (!ok || size > data.size() - std::min(pos, data.size()))
+			{
+				ok = false;
+				return {};
+			}
+			std::string_view const bytes = data.substr(pos, size);
+			pos += size;
+			return bytes;
+		}
+
+		std::string_view get_string() { return get_bytes(get<uint32_t>()); }
+
+		// number of items that follow, a count the rest of the image cannot hold fails the load
+		uint32_t get_count(size_t item_bytes)
+		{
+			uint32_t const count = get<uint32_t>();
+			if (ok && count <= (data.size() - pos) / item_bytes)
+				return count;
+			ok = false;
+			return 0;
+		}
+
+		template<typename T>
+		T get()
+		{
+			T value{};
+			std::string_view const bytes = get_bytes(sizeof(T));
+			if (ok)
+				std::memcpy(&value, bytes.data(), sizeof(T));
+			return value;
+		}
+
+		bool fail(const char* why)
+		{
+			runtime_error("cannot load the image, %s !", why);
+			return ok = false;
+		}
+
+		std::string_view data;
+		size_t pos = 0;
+		bool ok = true;
+		SymbolTable& symbols;
+		std::vector<Cell> const& natives;
+		FramePool& frame_pool;
+		std::vector<SymbolId> symbol_ids; // image id to interpreter id
+		std::shared_ptr<Arena> arena;				// owns the lambdas and the forms, goes after the table
+		std::shared_ptr<std::deque<Scope>> scopes; // kept by the lambdas and frames, parents are plain pointers
+		std::vector<Loaded> loaded;
+		CellList_t items;
+	};
+}
+
+bool Interpreter::save_image(std::string const& file_name)
+{
+	Output::Scope const scope(*out);
+	sync_globals();
+	std::vector<std::pair<SymbolId, Cell const*>> globals;
+	ImageWriter writer(natives);
+	bool ok = true;
+	for (size_t i = 0; i < global_env.slots.size(); i++)
+	{
+		Cell const& value = global_env.slots[i];
+		if (value.type == CellType::Null)
+			continue;
+		ok = writer.visit(value) && ok;
+		globals.emplace_back((SymbolId)i, &value);
+	}
+	if (!ok)
+		return false;
+
+	ImageHeader header{};
+	std::memcpy(header.magic, image_magic, sizeof(image_magic));
+	header.version = image_version;
+	header.byte_order = byte_order;
+	header.symbols = (uint32_t)symbols.size();
+	header.imports = (uint32_t)imported_files.size();
+	header.globals = (uint32_t)globals.size();
+	writer.write(header, symbols, imported_files, globals);
+
+	std::ofstream file(file_name, std::ios::binary);
+	file.write(writer.out.data(), writer.out.size());
+	if (!file)
+	{
+		runtime_error("cannot write the image %s !", file_name.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool Interpreter::load_image(std::string const& file_name)
+{
+	if (in_parallel_task("load an image"))
+		return false;
+	Output::Scope const scope(*out);
+	Heap::Scope const heap_scope(*gc);
+
+	MappedFile file(file_name);
+	if (!file.is_open())
+	{
+		runtime_error("cannot open the image %s !", file_name.c_str());
+		return false;
+	}
+
+	std::unordered_set<std::string> imports;
+	std::vector<std::pair<SymbolId, Cell>> globals;
+	ImageReader reader(file.view(), symbols, natives, main_context.frame_pool);
+	if (!reader.read(imports, globals))
+		return false;
+
+	sync_globals();
+	for (auto& [sym, value] : globals)
+		global_env.slots[sym] = std::move(value);
+	imported_files.merge(imports);
+	return true;
+}
@@ -0,0 +1,1176 @@
+#include "jit.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(TINYLISP_NO_JIT)
+#define TINYLISP_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace lsp;
+
+enum class lsp::NativeOp : uint8_t
+{
+	Add,
+	Sub,
+	Mul,
+	Div,
+	Mod,
+	Less,
+	Greater,
+	LessEqual,
+	GreaterEqual,
+	Equal,
+	Return,
+};
+
+namespace {
+
+	// where the code reads and writes a local or a global
+	struct Var
+	{
+		bool global;
+		uint32_t slot;
+	};
+
+	// how the VM resumes once the code left at an instruction, the first depth cells of the scratch are its stack
+	struct Exit
+	{
+		uint32_t pc; // returned for the exit of a whole proc, its result is the last cell
+		uint32_t depth;
+		std::vector<std::pair<uint32_t, uint32_t>> callees; // cells of the stack holding a proc, with its global slot
+	};
+
+	static constexpr uint32_t returned = UINT32_MAX;
+
+	// locals, scratch, globals, returns the index of the exit taken
+	using Code_t = uint32_t (*)(Cell* frame, Cell* scratch, Cell* globals);
+}
+
+struct Jit::Variant
+{
+	~Variant();
+
+	std::vector<Var> vars;		 // locals and globals the code reads or writes
+	std::vector<CellType> types; // what they held when it was compiled, checked on entry
+	std::vector<std::pair<uint32_t, Cell>> callees; // globals holding the procs it calls, checked on entry
+	std::vector<Exit> exits;
+	Code_t code = nullptr;
+	size_t mapped = 0;
+	uint32_t frame_slots = 0; // locals the code writes, the frame is grown to them first
+	uint32_t scratch = 0;
+};
+
+#ifdef TINYLISP_JIT
+
+namespace {
+
+	enum Reg : uint8_t
+	{
+		RAX = 0,
+		RCX = 1,
+		RDX = 2,
+		RSI = 6,
+		RDI = 7,
+		R8 = 8,
+	};
+
+	enum Cond : uint8_t
+	{
+		CondEqual = 0x4,
+		CondNotEqual = 0x5,
+		CondAbove = 0x7,
+		CondNoParity = 0xB,
+		CondLess = 0xC,
+		CondGreaterEqual = 0xD,
+		CondLessEqual = 0xE,
+		CondGreater = 0xF,
+	};
+
+	struct Mem
+	{
+		uint8_t base;
+		int32_t disp;
+
+		Mem value() const noexcept { return { base, disp + 8 }; }
+	};
+
+	// the few instructions the compiled code needs, memory operands are always base + disp32
+	class Assembler
+	{
+	public:
+		using Label = size_t;
+
+		Label label()
+		{
+			labels.push_back(SIZE_MAX);
+			return labels.size() - 1;
+		}
+
+		void bind(Label l) { labels[l] = code.size(); }
+		void jmp(Label l) { byte(0xE9); fixup(l); }
+		void jcc(Cond c, Label l)
+		{
+			byte(0x0F);
+			byte(0x80 | c);
+			fixup(l);
+		}
+
+		void load(Reg r, Mem m) { op(true, r, m, 0x8B); }
+		void store(Mem m, Reg r) { op(true, r, m, 0x89); }
+		void store(Mem m, int32_t imm)
+		{
+			op(true, 0, m, 0xC7);
+			dword((uint32_t)imm);
+		}
+		void mov(Reg r, uint64_t imm)
+		{
+			rex(true, 0, r);
+			byte(0xB8 | (r & 7));
+			for (int i = 0; i < 8; i++)
+				byte((uint8_t)(imm >> (i * 8)));
+		}
+		void add(Reg r, Mem m) { op(true, r, m, 0x03); }
+		void sub(Reg r, Mem m) { op(true, r, m, 0x2B); }
+		void cmp(Reg r, Mem m) { op(true, r, m, 0x3B); }
+		void imul(Reg r, Mem m)
+		{
+			rex(true, r, m.base);
+			byte(0x0F);
+			byte(0xAF);
+			modrm(r, m);
+		}
+		// rdx:rax / m, the remainder goes to rdx
+		void idiv(Mem m)
+		{
+			byte(0x48);
+			byte(0x99); // cqo
+			op(true, 7, m, 0xF7);
+		}
+		void cmp8(Mem m, uint8_t imm)
+		{
+			op(false, 7, m, 0x80);
+			byte(imm);
+		}
+		void cmp64(Mem m, int8_t imm)
+		{
+			op(true, 7, m, 0x83);
+			byte((uint8_t)imm);
+		}
+		// movsd, cvtsi2sd for an integral
+		void load_double(uint8_t xmm, Mem m, bool integral)
+		{
+			byte(0xF2);
+			rex(integral, xmm, m.base);
+			byte(0x0F);
+			byte(integral ? 0x2A : 0x10);
+			modrm(xmm, m);
+		}
+		void store_double(Mem m, uint8_t xmm)
+		{
+			byte(0xF2);
+			rex(false, xmm, m.base);
+			byte(0x0F);
+			byte(0x11);
+			modrm(xmm, m);
+		}
+		// addsd 0x58, mulsd 0x59, subsd 0x5C, divsd 0x5E
+		void sse(uint8_t opcode, uint8_t a, uint8_t b)
+		{
+			byte(0xF2);
+			byte(0x0F);
+			byte(opcode);
+			byte(0xC0 | a << 3 | b);
+		}
+		void ucomisd(uint8_t a, uint8_t b)
+		{
+			byte(0x66);
+			byte(0x0F);
+			byte(0x2E);
+			byte(0xC0 | a << 3 | b);
+		}
+		void setcc(Cond c, Reg r)
+		{
+			byte(0x0F);
+			byte(0x90 | c);
+			byte(0xC0 | r);
+		}
+		void movzx_al() // movzx eax, al
+		{
+			byte(0x0F);
+			byte(0xB6);
+			byte(0xC0);
+		}
+		void and_al_cl()
+		{
+			byte(0x20);
+			byte(0xC8);
+		}
+		void xor_al(uint8_t imm)
+		{
+			byte(0x34);
+			byte(imm);
+		}
+		void mov_r8_rdx()
+		{
+			byte(0x49);
+			byte(0x89);
+			byte(0xD0);
+		}
+		void ret(uint32_t value) // mov eax, value
+		{
+			byte(0xB8);
+			dword(value);
+			byte(0xC3);
+		}
+
+		// resolves the jumps, false when one goes to a label never bound
+		bool finish()
+		{
+			for (auto const& f : fixups)
+			{
+				if (labels[f.second] == SIZE_MAX)
+					return false;
+				int32_t const rel = (int32_t)(labels[f.second] - (f.first + 4));
+				memcpy(&code[f.first], &rel, 4);
+			}
+			return true;
+		}
+
+		std::vector<uint8_t> code;
+
+	private:
+		void byte(uint8_t b) { code.push_back(b); }
+		void dword(uint32_t d)
+		{
+			for (int i = 0; i < 4; i++)
+				byte((uint8_t)(d >> (i * 8)));
+		}
+		void rex(bool wide, uint8_t reg, uint8_t base)
+		{
+			uint8_t const r = 0x40 | wide << 3 | (reg >> 3) << 2 | (base >> 3);
+			if (r != 0x40)
+				byte(r);
+		}
+		void modrm(uint8_t reg, Mem m)
+		{
+			byte(0x80 | (reg & 7) << 3 | (m.base & 7));
+			if ((m.base & 7) == 4)
+				byte(0x24);
+			dword((uint32_t)m.disp);
+		}
+		void op(bool wide, uint8_t reg, Mem m, uint8_t opcode)
+		{
+			rex(wide, reg, m.base);
+			byte(opcode);
+			modrm(reg, m);
+		}
+		void fixup(Label l)
+		{
+			dword(0);
+			fixups.emplace_back(code.size() - 4, l);
+		}
+
+		std::vector<size_t> labels;
+		std::vector<std::pair<size_t, Label>> fixups;
+	};
+
+	// static type of a cell, Unknown for a local after branches that left different types in it
+	// Any for a stack cell in the same case, its tag tells at runtime, Callee for a proc read from a global
+	enum class Ty : uint8_t
+	{
+		Int,
+		Float,
+		Bool,
+		Null,
+		Unbound,
+		Unknown,
+		Any,
+		Callee,
+	};
+
+	Ty type_of(CellType type) noexcept
+	{
+		switch (type)
+		{
+		case CellType::Int:
+			return Ty::Int;
+		case CellType::Float:
+			return Ty::Float;
+		case CellType::Bool:
+			return Ty::Bool;
+		case CellType::Null:
+			return Ty::Null;
+		case CellType::Unbound:
+			return Ty::Unbound;
+		default:
+			return Ty::Unknown;
+		}
+	}
+
+	int32_t tag_of(Ty ty) noexcept
+	{
+		switch (ty)
+		{
+		case Ty::Int:
+			return (int32_t)CellType::Int;
+		case Ty::Float:
+			return (int32_t)CellType::Float;
+		case Ty::Bool:
+			return (int32_t)CellType::Bool;
+		default:
+			return (int32_t)CellType::Null;
+		}
+	}
+
+	struct Value
+	{
+		Ty ty;
+		uint32_t callee = 0; // of a Callee, index in the callees of the variant
+
+		bool operator==(Value const& other) const noexcept { return ty == other.ty && (ty != Ty::Callee || callee == other.callee); }
+	};
+
+	struct State
+	{
+		std::vector<Ty> vars; // shorter than the vars of the variant when the last ones still have their entry type
+		std::vector<Value> stack;
+	};
+
+	// lowers the bytecode of a loop or a proc, the operand stack lives in the scratch (rsi), locals in the frame (rdi)
+	// and globals in the global slots (r8), each instruction reads and writes them as the VM would
+	class Builder
+	{
+	public:
+		Builder(std::unordered_map<ProcObj const*, NativeOp> const& natives, Cell const* frame, size_t frame_size,
+			Cell const* globals, size_t global_count, Jit::Variant& out)
+			: natives(natives), frame(frame), frame_size(frame_size), globals(globals), global_count(global_count), out(out)
+		{
+		}
+
+		bool loop(Chunk const& chunk, size_t head)
+		{
+			Body body(chunk, head + 1, chunk.code[head].a, Mode::Loop);
+			body.head = head;
+			as.mov_r8_rdx();
+			start = as.label();
+			as.bind(start);
+			State state;
+			return run(body, state) && finish();
+		}
+
+		bool leaf(Lambda const& fn, Chunk const& chunk)
+		{
+			Body body(chunk, 0, chunk.code.size(), Mode::Leaf);
+			body.params = fn.nparams;
+			as.mov_r8_rdx();
+			inlined.push_back(&fn);
+			State state;
+			return run(body, state) && finish();
+		}
+
+		std::vector<uint8_t> const& code() const noexcept { return as.code; }
+
+	private:
+		using Label = Assembler::Label;
+
+		enum class Mode
+		{
+			Loop,	// leaves on exit, at the head when a local changed type, or where a type is unknown
+			Leaf,	// a whole proc run without a frame, its params are the frame, leaves on return only
+			Inline, // a proc called by the code, its params are the cells of its arguments
+		};
+
+		struct Body
+		{
+			Body(Chunk const& chunk, size_t begin, size_t end, Mode mode)
+				: chunk(chunk), begin(begin), end(end), mode(mode), pending(end - begin), heads(end - begin)
+			{
+			}
+
+			Chunk const& chunk;
+			size_t begin, end;
+			Mode mode;
+			size_t head = 0;	  // of a loop
+			uint32_t params = 0;  // of a proc
+			size_t args = 0;	  // stack index of the first argument of an inlined proc
+			std::vector<Label> labels;
+			std::vector<std::optional<State>> pending; // states jumping forward to an instruction
+			std::vector<std::optional<State>> heads;   // states entering the loops nested in a loop
+		};
+
+		static constexpr size_t no_var = SIZE_MAX;
+		static constexpr size_t max_inline_depth = 4;
+		static constexpr size_t max_inline_size = 256;
+
+		bool run(Body& body, State& cur);
+		bool call(Body& body, State& cur, size_t pc, Instr const& in, bool& live);
+		bool native(Body& body, State& cur, size_t pc, NativeOp op, size_t callee, size_t argc, bool& live);
+		bool read_var(Body& body, State& cur, size_t pc, size_t v, bool& live);
+		bool read_global(Body& body, State& cur, size_t pc, uint32_t slot, bool& live);
+		void write_var(State& cur, size_t v);
+		bool target(Body& body, State& cur, size_t pc, size_t to, Label& label);
+
+		bool finish()
+		{
+			for (auto const& stub : stubs)
+			{
+				as.bind(stub.first);
+				as.ret(stub.second);
+			}
+			return as.finish();
+		}
+
+		// the exit to the VM at pc with the stack of cur
+		Label leave(size_t pc, State const& cur)
+		{
+			Exit exit{ (uint32_t)pc, (uint32_t)cur.stack.size(), {} };
+			for (size_t i = 0; i < cur.stack.size(); i++)
+			{
+				if (cur.stack[i].ty == Ty::Callee)
+					exit.callees.emplace_back((uint32_t)i, out.callees[cur.stack[i].callee].first);
+			}
+			out.exits.push_back(std::move(exit));
+			Label const l = as.label();
+			stubs.emplace_back(l, (uint32_t)out.exits.size() - 1);
+			return l;
+		}
+
+		// leaves to the VM at pc, only loops can
+		bool deopt(Body const& body, State const& cur, size_t pc, bool& live)
+		{
+			if (body.mode != Mode::Loop || !inlined.empty())
+				return false;
+			as.jmp(leave(pc, cur));
+			live = false;
+			return true;
+		}
+
+		size_t var(bool global, uint32_t slot)
+		{
+			for (size_t i = 0; i < out.vars.size(); i++)
+			{
+				if (out.vars[i].global == global && out.vars[i].slot == slot)
+					return i;
+			}
+			if (global && slot >= global_count)
+				return no_var;
+
+			CellType const type = global ? globals[slot].type : slot < frame_size ? frame[slot].type : CellType::Unbound;
+			out.vars.push_back({ global, slot });
+			out.types.push_back(type);
+			Ty const ty = type_of(type);
+			if (ty == Ty::Unknown || (global && ty == Ty::Unbound))
+				return no_var;
+			return out.vars.size() - 1;
+		}
+
+		Ty& type(State& s, size_t v)
+		{
+			while (s.vars.size() <= v)
+				s.vars.push_back(type_of(out.types[s.vars.size()]));
+			return s.vars[v];
+		}
+
+		bool same(State& a, State& b)
+		{
+			if (!(a.stack == b.stack))
+				return false;
+			for (size_t v = 0; v < out.vars.size(); v++)
+			{
+				if (type(a, v) != type(b, v))
+					return false;
+			}
+			return true;
+		}
+
+		bool entry_types(State& s)
+		{
+			for (size_t v = 0; v < out.vars.size(); v++)
+			{
+				if (type(s, v) != type_of(out.types[v]))
+					return false;
+			}
+			return s.stack.empty();
+		}
+
+		// what both states can be, false when they cannot be compiled as one
+		bool merge(State& into, State& from)
+		{
+			if (into.stack.size() != from.stack.size())
+				return false;
+			for (size_t i = 0; i < into.stack.size(); i++)
+			{
+				if (into.stack[i] == from.stack[i])
+					continue;
+				if (into.stack[i].ty == Ty::Callee || from.stack[i].ty == Ty::Callee)
+					return false;
+				into.stack[i] = { Ty::Any };
+			}
+			for (size_t v = 0; v < out.vars.size(); v++)
+			{
+				if (type(into, v) != type(from, v))
+					type(into, v) = Ty::Unknown;
+			}
+			return true;
+		}
+
+		uint32_t callee(uint32_t slot)
+		{
+			for (size_t i = 0; i < out.callees.size(); i++)
+			{
+				if (out.callees[i].first == slot)
+					return (uint32_t)i;
+			}
+			out.callees.emplace_back(slot, globals[slot]);
+			return (uint32_t)out.callees.size() - 1;
+		}
+
+		size_t push(State& cur, Value v)
+		{
+			cur.stack.push_back(v);
+			out.scratch = std::max(out.scratch, (uint32_t)cur.stack.size());
+			return cur.stack.size() - 1;
+		}
+
+		Mem slot(size_t i) const noexcept { return { RSI, (int32_t)(i * sizeof(Cell)) }; }
+		Mem var_mem(size_t v) const noexcept { return { out.vars[v].global ? (uint8_t)R8 : (uint8_t)RDI, (int32_t)(out.vars[v].slot * sizeof(Cell)) }; }
+
+		// a cell of a known type is written whole, the first word is the tag of a plain cell
+		void copy(Mem to, Mem from, Ty ty)
+		{
+			if (ty == Ty::Any)
+			{
+				as.load(RAX, from);
+				as.store(to, RAX);
+			}
+			else
+				as.store(to, tag_of(ty));
+			as.load(RAX, from.value());
+			as.store(to.value(), RAX);
+		}
+
+		void constant(Mem to, Ty ty, uint64_t bits)
+		{
+			as.store(to, tag_of(ty));
+			if ((int64_t)bits == (int32_t)bits)
+			{
+				as.store(to.value(), (int32_t)bits);
+				return;
+			}
+			as.mov(RAX, bits);
+			as.store(to.value(), RAX);
+		}
+
+		Ty arithmetic(NativeOp op, size_t lhs, Ty lt, size_t rhs, Ty rt, size_t to);
+
+		std::unordered_map<ProcObj const*, NativeOp> const& natives;
+		Cell const* frame;
+		size_t frame_size;
+		Cell const* globals;
+		size_t global_count;
+		Jit::Variant& out;
+		Assembler as;
+		Label start = 0;
+		std::vector<std::pair<Label, uint32_t>> stubs; // exits, emitted after the code
+		std::vector<Lambda const*> inlined;			   // procs being compiled, they cannot call themselves
+	};
+
+	bool Builder::run(Body& body, State& cur)
+	{
+		Chunk const& chunk = body.chunk;
+		for (size_t i = body.begin; i < body.end; i++)
+			body.labels.push_back(as.label());
+
+		bool live = true;
+		for (size_t pc = body.begin; pc < body.end; pc++)
+		{
+			size_t const at = pc - body.begin;
+			if (body.pending[at])
+			{
+				if (!live)
+				{
+					cur = std::move(*body.pending[at]);
+					live = true;
+				}
+				else if (!merge(cur, *body.pending[at]))
+					return false;
+				body.pending[at].reset();
+			}
+			as.bind(body.labels[at]);
+			if (!live)
+				continue;
+
+			Instr const& in = chunk.code[pc];
+			switch (in.op)
+			{
+			case OpCode::Const:
+			{
+				Cell const& c = chunk.consts[in.a];
+				Ty const ty = type_of(c.type);
+				if (ty != Ty::Int && ty != Ty::Float && ty != Ty::Bool && ty != Ty::Null)
+					return false;
+				constant(slot(push(cur, { ty })), ty, c.bits);
+				break;
+			}
+			case OpCode::Nil:
+				constant(slot(push(cur, { Ty::Null })), Ty::Null, 0);
+				break;
+			case OpCode::LoadLocal:
+			{
+				if (in.depth != 0 || (body.mode != Mode::Loop && in.a >= body.params))
+					return false;
+				if (body.mode == Mode::Inline)
+				{
+					Value const param = cur.stack[body.args + in.a];
+					if (param.ty == Ty::Callee)
+						return false;
+					copy(slot(push(cur, param)), slot(body.args + in.a), param.ty);
+					break;
+				}
+
+				size_t const v = var(false, in.a);
+				if (v == no_var)
+					return false;
+				// unassigned locals fall back to the global of the same name
+				if (type(cur, v) == Ty::Unbound ? !read_global(body, cur, pc, in.b, live) : !read_var(body, cur, pc, v, live))
+					return false;
+				break;
+			}
+			case OpCode::LoadGlobal:
+				if (!read_global(body, cur, pc, in.a, live))
+					return false;
+				break;
+			case OpCode::StoreLocal:
+			{
+				if (cur.stack.back().ty == Ty::Callee || (body.mode != Mode::Loop && in.a >= body.params))
+					return false;
+				if (body.mode == Mode::Inline)
+				{
+					copy(slot(body.args + in.a), slot(cur.stack.size() - 1), cur.stack.back().ty);
+					cur.stack[body.args + in.a] = cur.stack.back();
+					break;
+				}
+
+				size_t const v = var(false, in.a);
+				if (v == no_var)
+					return false;
+				write_var(cur, v);
+				out.frame_slots = std::max(out.frame_slots, in.a + 1);
+				break;
+			}
+			case OpCode::StoreGlobal:
+			{
+				if (cur.stack.back().ty == Ty::Callee)
+					return false;
+				for (auto const& c : out.callees)
+				{
+					if (c.first == in.a)
+						return false;
+				}
+				size_t const v = var(true, in.a);
+				if (v == no_var)
+					return false;
+				write_var(cur, v);
+				break;
+			}
+			case OpCode::Pop:
+				cur.stack.pop_back();
+				break;
+			case OpCode::Jump:
+			{
+				if (in.a > pc)
+				{
+					Label l;
+					if (!target(body, cur, pc, in.a, l))
+						return false;
+					as.jmp(l);
+				}
+				else if (body.mode != Mode::Loop)
+					return false;
+				else if (in.a == body.head)
+					as.jmp(entry_types(cur) ? start : leave(body.head, cur));
+				else
+				{
+					// back to a loop nested in this one
+					if (in.a < body.begin || !body.heads[in.a - body.begin])
+						return false;
+					as.jmp(same(cur, *body.heads[in.a - body.begin]) ? body.labels[in.a - body.begin] : leave(in.a, cur));
+				}
+				live = false;
+				break;
+			}
+			case OpCode::JumpIfFalse:
+			{
+				Value const cond = cur.stack.back();
+				Mem const at = slot(cur.stack.size() - 1);
+				cur.stack.pop_back();
+				if (cond.ty == Ty::Int || cond.ty == Ty::Float || cond.ty == Ty::Callee)
+					break; // always true
+
+				Label l;
+				if (in.a <= pc || !target(body, cur, pc, in.a, l))
+					return false;
+				if (cond.ty == Ty::Null)
+				{
+					as.jmp(l);
+					live = false;
+				}
+				else if (cond.ty == Ty::Bool)
+				{
+					as.cmp8(at.value(), 0);
+					as.jcc(CondEqual, l);
+				}
+				else
+				{
+					Label const taken = as.label();
+					as.cmp64(at, (int8_t)CellType::Null);
+					as.jcc(CondEqual, l);
+					as.cmp64(at, (int8_t)CellType::Bool);
+					as.jcc(CondNotEqual, taken);
+					as.cmp8(at.value(), 0);
+					as.jcc(CondEqual, l);
+					as.bind(taken);
+				}
+				break;
+			}
+			case OpCode::Call:
+			case OpCode::TailCall:
+				if (!call(body, cur, pc, in, live))
+					return false;
+				break;
+			case OpCode::Return:
+			{
+				Value const result = cur.stack.back();
+				if (result.ty == Ty::Callee || pc + 1 != body.end)
+					return false;
+				if (body.mode == Mode::Leaf)
+				{
+					as.jmp(leave(returned, cur));
+					live = false;
+				}
+				else if (body.mode == Mode::Inline)
+				{
+					copy(slot(body.args - 1), slot(cur.stack.size() - 1), result.ty);
+					cur.stack.resize(body.args - 1);
+					cur.stack.push_back(result);
+				}
+				else
+					return false;
+				break;
+			}
+			case OpCode::Loop:
+				if (body.mode != Mode::Loop)
+					return false;
+				body.heads[at] = cur;
+				break;
+			default:
+				return false;
+			}
+		}
+
+		// a loop only leaves through its exits, an inlined proc continues with the code calling it
+		return live == (body.mode == Mode::Inline);
+	}
+
+	bool Builder::read_var(Body& body, State& cur, size_t pc, size_t v, bool& live)
+	{
+		Ty ty = type(cur, v);
+		if (ty == Ty::Unknown)
+		{
+			// branches stored another type in it, it most likely still has the one it had on entry
+			Ty const entry = type_of(out.types[v]);
+			if (entry == Ty::Unbound || body.mode != Mode::Loop || !inlined.empty())
+				return deopt(body, cur, pc, live);
+			as.cmp8(var_mem(v), (uint8_t)tag_of(entry));
+			as.jcc(CondNotEqual, leave(pc, cur));
+			ty = type(cur, v) = entry;
+		}
+		if (ty == Ty::Unbound)
+			return false;
+		copy(slot(push(cur, { ty })), var_mem(v), ty);
+		return true;
+	}
+
+	bool Builder::read_global(Body& body, State& cur, size_t pc, uint32_t slot, bool& live)
+	{
+		if (slot >= global_count)
+			return false;
+		if (globals[slot].type == CellType::Proc)
+		{
+			for (auto const& v : out.vars)
+			{
+				if (v.global && v.slot == slot)
+					return false;
+			}
+			push(cur, { Ty::Callee, callee(slot) });
+			return true;
+		}
+
+		size_t const v = var(true, slot);
+		return v != no_var && read_var(body, cur, pc, v, live);
+	}
+
+	void Builder::write_var(State& cur, size_t v)
+	{
+		Ty const ty = cur.stack.back().ty;
+		copy(var_mem(v), slot(cur.stack.size() - 1), ty);
+		type(cur, v) = ty == Ty::Any ? Ty::Unknown : ty;
+	}
+
+	// label of the forward jump to `to`, whose state becomes cur merged with the others jumping there
+	bool Builder::target(Body& body, State& cur, size_t pc, size_t to, Label& label)
+	{
+		if (body.mode == Mode::Loop && to == body.end)
+		{
+			label = leave(to, cur);
+			return true;
+		}
+		if (to <= pc || to >= body.end)
+			return false;
+
+		auto& pending = body.pending[to - body.begin];
+		if (!pending)
+			pending = cur;
+		else if (!merge(*pending, cur))
+			return false;
+		label = body.labels[to - body.begin];
+		return true;
+	}
+
+	bool Builder::call(Body& body, State& cur, size_t pc, Instr const& in, bool& live)
+	{
+		size_t const k = cur.stack.size() - in.a - 1;
+		if (cur.stack[k].ty != Ty::Callee)
+			return false;
+
+		ProcObj const& p = out.callees[cur.stack[k].callee].second.as_proc();
+		auto const op = natives.find(&p);
+		if (op != natives.end())
+			return native(body, cur, pc, op->second, k, in.a, live);
+
+		// a proc reading only its params runs inline, its locals are the cells of its arguments
+		Lambda const* const fn = p.lambda.get();
+		if (!fn || p.memo || in.a != fn->nparams || inlined.size() >= max_inline_depth
+			|| std::find(inlined.begin(), inlined.end(), fn) != inlined.end())
+			return false;
+		Chunk const* const chunk = fn->compiled.load(std::memory_order_acquire);
+		if (!chunk || chunk->code.size() > max_inline_size)
+			return false;
+
+		Body inner(*chunk, 0, chunk->code.size(), Mode::Inline);
+		inner.params = fn->nparams;
+		inner.args = k + 1;
+		inlined.push_back(fn);
+		bool const ok = run(inner, cur);
+		inlined.pop_back();
+		return ok;
+	}
+
+	bool Builder::native(Body& body, State& cur, size_t pc, NativeOp op, size_t k, size_t argc, bool& live)
+	{
+		if (op == NativeOp::Return)
+		{
+			if (argc > 1)
+				return false;
+			if (argc == 0)
+			{
+				constant(slot(k), Ty::Null, 0);
+				cur.stack.resize(k);
+				cur.stack.push_back({ Ty::Null });
+				return true;
+			}
+			Value const result = cur.stack[k + 1];
+			if (result.ty == Ty::Callee)
+				return false;
+			copy(slot(k), slot(k + 1), result.ty);
+			cur.stack.resize(k);
+			cur.stack.push_back(result);
+			return true;
+		}
+
+		if (argc != 2)
+			return false;
+		Ty const lt = cur.stack[k + 1].ty, rt = cur.stack[k + 2].ty;
+		bool const numbers = (lt == Ty::Int || lt == Ty::Float) && (rt == Ty::Int || rt == Ty::Float);
+		// the VM reports the errors, and calls fmod
+		if (!numbers || (op == NativeOp::Mod && (lt != Ty::Int || rt != Ty::Int)))
+			return deopt(body, cur, pc, live);
+		// idiv traps on a zero divisor and on INT64_MIN % -1, the VM reports the first and gives 0 for the second
+		if (op == NativeOp::Mod)
+		{
+			if (body.mode != Mode::Loop || !inlined.empty())
+				return false;
+			Mem const divisor = slot(k + 2).value();
+			Label const vm = leave(pc, cur);
+			as.cmp64(divisor, 0);
+			as.jcc(CondEqual, vm);
+			as.cmp64(divisor, -1);
+			as.jcc(CondEqual, vm);
+		}
+
+		Ty const result = arithmetic(op, k + 1, lt, k + 2, rt, k);
+		cur.stack.resize(k);
+		cur.stack.push_back({ result });
+		return true;
+	}
+
+	// what the kernels of the natives compute, see Arithmetic, Divide, Modulo, Comparison and Equal
+	Ty Builder::arithmetic(NativeOp op, size_t lhs, Ty lt, size_t rhs, Ty rt, size_t to)
+	{
+		Mem const a = slot(lhs).value(), b = slot(rhs).value(), r = slot(to);
+		bool const ints = lt == Ty::Int && rt == Ty::Int;
+
+		if (op == NativeOp::Equal && !ints && lt != rt)
+		{
+			constant(r, Ty::Bool, 0); // values of different types are never equal
+			return Ty::Bool;
+		}
+
+		if (ints && op != NativeOp::Div)
+		{
+			as.load(RAX, a);
+			switch (op)
+			{
+			case NativeOp::Add:
+				as.add(RAX, b);
+				break;
+			case NativeOp::Sub:
+				as.sub(RAX, b);
+				break;
+			case NativeOp::Mul:
+				as.imul(RAX, b);
+				break;
+			case NativeOp::Mod:
+				as.idiv(b);
+				as.store(r.value(), RDX);
+				as.store(r, tag_of(Ty::Int));
+				return Ty::Int;
+			default:
+			{
+				Cond const cond = op == NativeOp::Less ? CondLess : op == NativeOp::Greater ? CondGreater
+					: op == NativeOp::LessEqual ? CondLessEqual : op == NativeOp::GreaterEqual ? CondGreaterEqual : CondEqual;
+				as.cmp(RAX, b);
+				as.setcc(cond, RAX);
+				as.movzx_al();
+				as.store(r.value(), RAX);
+				as.store(r, tag_of(Ty::Bool));
+				return Ty::Bool;
+			}
+			}
+			as.store(r.value(), RAX);
+			as.store(r, tag_of(Ty::Int));
+			return Ty::Int;
+		}
+
+		// a mixed pair is computed as doubles
+		as.load_double(0, a, lt == Ty::Int);
+		as.load_double(1, b, rt == Ty::Int);
+		switch (op)
+		{
+		case NativeOp::Add:
+		case NativeOp::Sub:
+		case NativeOp::Mul:
+		case NativeOp::Div:
+			as.sse(op == NativeOp::Add ? 0x58 : op == NativeOp::Sub ? 0x5C : op == NativeOp::Mul ? 0x59 : 0x5E, 0, 1);
+			as.store_double(r.value(), 0);
+			as.store(r, tag_of(Ty::Float));
+			return Ty::Float;
+		case NativeOp::Equal:
+			as.ucomisd(0, 1);
+			as.setcc(CondEqual, RAX);
+			as.setcc(CondNoParity, RCX);
+			as.and_al_cl();
+			break;
+		default:
+			// a < b is b above a, false when one is NaN, >= and <= are their negation like the kernels
+			if (op == NativeOp::Less || op == NativeOp::GreaterEqual)
+				as.ucomisd(1, 0);
+			else
+				as.ucomisd(0, 1);
+			as.setcc(CondAbove, RAX);
+			if (op == NativeOp::LessEqual || op == NativeOp::GreaterEqual)
+				as.xor_al(1);
+			break;
+		}
+		as.movzx_al();
+		as.store(r.value(), RAX);
+		as.store(r, tag_of(Ty::Bool));
+		return Ty::Bool;
+	}
+
+	Code_t map_code(std::vector<uint8_t> const& code, size_t& mapped)
+	{
+		size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+		mapped = (code.size() + page - 1) / page * page;
+		void* const memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			return nullptr;
+
+		// never writable and executable at once
+		memcpy(memory, code.data(), code.size());
+		if (mprotect(memory, mapped, PROT_READ | PROT_EXEC) != 0)
+		{
+			munmap(memory, mapped);
+			return nullptr;
+		}
+		return reinterpret_cast<Code_t>(memory);
+	}
+}
+
+Jit::Variant::~Variant()
+{
+	if (code)
+		munmap(reinterpret_cast<void*>(code), mapped);
+}
+
+bool Jit::supported() noexcept
+{
+	return true;
+}
+
+#else
+
+Jit::Variant::~Variant() = default;
+
+bool Jit::supported() noexcept
+{
+	return false;
+}
+
+#endif
+
+Jit::Jit(Interpreter& interp) : interp(interp)
+{
+	static constexpr std::pair<char const*, NativeOp> ops[] = {
+		{ "+", NativeOp::Add }, { "-", NativeOp::Sub }, { "*", NativeOp::Mul }, { "/", NativeOp::Div }, { "%", NativeOp::Mod },
+		{ "<", NativeOp::Less }, { ">", NativeOp::Greater }, { "<=", NativeOp::LessEqual }, { ">=", NativeOp::GreaterEqual },
+		{ "=", NativeOp::Equal }, { "return", NativeOp::Return },
+	};
+
+	// the builtins are registered first, a native registered later under the same name is not one of them
+	for (auto const& native : interp.natives)
+	{
+		ProcObj const& p = native.as_proc();
+		for (auto const& op : ops)
+		{
+			if (p.name == op.first && std::none_of(natives.begin(), natives.end(), [&](auto const& n) { return n.second == op.second; }))
+				natives.emplace(&p, op.second);
+		}
+	}
+}
+
+Jit::~Jit() = default;
+
+Jit::Site& Jit::site(Chunk const& chunk, uint32_t pc)
+{
+	SiteKey const key{ &chunk, pc };
+	Recent& r = recent[(SiteHash{}(key) >> 4) % recent.size()];
+	if (!(r.key == key))
+	{
+		r.key = key;
+		r.site = &sites[key];
+	}
+
+	Site& s = *r.site;
+	if (s.chunk != chunk.id)
+	{
+		s = Site();
+		s.chunk = chunk.id;
+	}
+	return s;
+}
+
+Jit::Variant* Jit::select(Site& site, Cell const* frame, size_t frame_size, bool leaf, Chunk const& chunk, size_t pc, Lambda const* fn)
+{
+	Cell const* const globals = interp.global_env.slots.data();
+	for (auto const& v : site.variants)
+	{
+		bool matches = true;
+		for (size_t i = 0; i < v->vars.size() && matches; i++)
+		{
+			Var const& var = v->vars[i];
+			CellType const type = var.global ? globals[var.slot].type : var.slot < frame_size ? frame[var.slot].type : CellType::Unbound;
+			matches = type == v->types[i];
+		}
+		for (size_t i = 0; i < v->callees.size() && matches; i++)
+		{
+			Cell const& g = globals[v->callees[i].first];
+			matches = g.type == CellType::Proc && g.object == v->callees[i].second.object;
+		}
+		if (matches)
+			return v.get();
+	}
+
+	if (++site.misses < hot || site.variants.size() >= max_variants)
+		return nullptr;
+
+	auto variant = std::make_unique<Variant>();
+#ifdef TINYLISP_JIT
+	Builder builder(natives, frame, frame_size, globals, interp.global_env.slots.size(), *variant);
+	if (leaf ? builder.leaf(*fn, chunk) : builder.loop(chunk, pc))
+		variant->code = map_code(builder.code(), variant->mapped);
+#endif
+	if (!variant->code)
+	{
+		site.dead = true;
+		return nullptr;
+	}
+	site.variants.push_back(std::move(variant));
+	return site.variants.back().get();
+}
+
+bool Jit::loop(Chunk const& chunk, size_t head, Environement& env, std::vector<Cell>& stack, size_t& pc)
+{
+	Site& s = site(chunk, (uint32_t)head);
+	if (s.dead)
+		return false;
+	interp.sync_globals();
+	Variant* const v = select(s, env.slots.data(), env.slots.size(), false, chunk, head, nullptr);
+	if (!v)
+		return false;
+
+	if (env.slots.size() < v->frame_slots)
+		env.slots.resize(v->frame_slots, Cell(CellType::Unbound));
+	if (scratch.size() < v->scratch)
+		scratch.resize(v->scratch);
+
+	Exit const& exit = v->exits[v->code(env.slots.data(), scratch.data(), interp.global_env.slots.data())];
+	auto callee = exit.callees.begin();
+	for (uint32_t i = 0; i < exit.depth; i++)
+	{
+		if (callee != exit.callees.end() && callee->first == i)
+			stack.push_back(interp.global_env.slots[(callee++)->second]);
+		else
+			stack.push_back(scratch[i]);
+	}
+	pc = exit.pc;
+	return true;
+}
+
+bool Jit::call(Lambda const& fn, Chunk const& chunk, Cell* args, size_t argc, Cell& result)
+{
+	if (argc != fn.nparams)
+		return false;
+	for (size_t i = 0; i < argc; i++)
+	{
+		if (args[i].is_object() || args[i].type == CellType::Symbol)
+			return false;
+	}
+
+	Site& s = site(chunk, leaf_site);
+	if (s.dead)
+		return false;
+	interp.sync_globals();
+	Variant* const v = select(s, args, argc, true, chunk, 0, &fn);
+	if (!v)
+		return false;
+
+	if (scratch.size() < v->scratch)
+		scratch.resize(v->scratch);
+	Exit const& exit = v->exits[v->code(args, scratch.data(), interp.global_env.slots.data())];
+	result = scratch[exit.depth - 1];
+	return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "vm.h"
+
+#include <array>
+#include <unordered_map>
+
+namespace lsp {
+
+	enum class NativeOp : uint8_t;
+
+	// compiles hot while loops and procs doing int and float arithmetic to x86-64 code, on Linux only
+	// the code is specialized to the types of the locals it touches when it is compiled and only entered while they
+	// still have them, where it cannot tell a type anymore it leaves to the VM with the stack the instruction expects
+	// every thread running the VM has its own, parallel tasks never use it, see Interpreter::jit
+	class Jit
+	{
+	public:
+		// false where the jit is not built, then nothing is ever compiled
+		static bool supported() noexcept;
+
+		explicit Jit(Interpreter& interp);
+		~Jit();
+		Jit(Jit const&) = delete;
+		Jit& operator=(Jit const&) = delete;
+
+		// runs the loop whose Loop instruction is at head, false to interpret it
+		// once it ran, the cells the VM expects are pushed on stack and pc is where to resume
+		bool loop(Chunk const& chunk, size_t head, Environement& env, std::vector<Cell>& stack, size_t& pc);
+		// calls fn without a frame when it only reads its params, false to interpret it
+		bool call(Lambda const& fn, Chunk const& chunk, Cell* args, size_t argc, Cell& result);
+
+		// entries of a loop or calls of a proc before it is compiled
+		static constexpr uint32_t hot = 32;
+		// types compiled for a loop or proc, past them it is interpreted with the others
+		static constexpr size_t max_variants = 4;
+
+		struct Variant;
+
+	private:
+		struct Site
+		{
+			uint64_t chunk = 0; // id of the chunk, addresses of freed chunks are reused
+			uint32_t misses = 0;
+			bool dead = false; // could not be compiled once, it does little arithmetic and is not tried again
+			std::vector<std::unique_ptr<Variant>> variants;
+		};
+
+		struct SiteKey
+		{
+			Chunk const* chunk;
+			uint32_t pc; // of the Loop instruction, whole procs use leaf_site
+
+			bool operator==(SiteKey const& other) const noexcept { return chunk == other.chunk && pc == other.pc; }
+		};
+
+		struct SiteHash
+		{
+			size_t operator()(SiteKey const& key) const noexcept { return detail::hash_combine(std::hash<Chunk const*>{}(key.chunk), key.pc); }
+		};
+
+		static constexpr uint32_t leaf_site = UINT32_MAX;
+
+		Site& site(Chunk const& chunk, uint32_t pc);
+		// the variant compiled for the types of frame, compiled on a miss once the site is hot
+		Variant* select(Site& site, Cell const* frame, size_t frame_size, bool leaf, Chunk const& chunk, size_t pc, Lambda const* fn);
+
+		// recent sites by address in front of the map, calls look up their proc's site each time
+		struct Recent
+		{
+			SiteKey key{ nullptr, 0 };
+			Site* site = nullptr;
+		};
+
+		Interpreter& interp;
+		std::unordered_map<SiteKey, Site, SiteHash> sites;
+		std::array<Recent, 64> recent;
+		std::unordered_map<ProcObj const*, NativeOp> natives; // inlined when they are called
+		std::vector<Cell> scratch; // operand stack of the compiled code
+	};
+}
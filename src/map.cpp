@@ -0,0 +1,132 @@
+#include "tinyLisp.h"
+
+#include <algorithm>
+
+using namespace lsp;
+
+static constexpr uint32_t empty_slot = UINT32_MAX;
+static constexpr uint32_t removed_slot = UINT32_MAX - 1;
+static constexpr size_t not_found = SIZE_MAX;
+static constexpr size_t min_index = 8;
+
+// cell_hash keeps the low bits of an integral, they pick the slot, so they are mixed with the high ones
+static size_t key_hash(Cell const& key) noexcept
+{
+	uint64_t h = cell_hash(key);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+static bool same_key(Cell const& a, Cell const& b) noexcept
+{
+	if (a.type != b.type)
+		return false;
+
+	switch (a.type)
+	{
+	case CellType::Int:
+		return a.as_int() == b.as_int();
+	case CellType::Symbol:
+		return a.sym == b.sym;
+	case CellType::String:
+		return a.as_string() == b.as_string();
+	default:
+		return false;
+	}
+}
+
+// slot of the index holding key, the index always has an empty slot to end the probe
+size_t MapObj::position(Cell const& key, size_t hash) const noexcept
+{
+	if (index.empty())
+		return not_found;
+
+	size_t const mask = index.size() - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask)
+	{
+		uint32_t const e = index[i];
+		if (e == empty_slot)
+			return not_found;
+		if (e != removed_slot && entries[e].hash == hash && same_key(entries[e].key, key))
+			return i;
+	}
+}
+
+Cell* MapObj::find(Cell const& key) noexcept
+{
+	size_t const i = position(key, key_hash(key));
+	return i == not_found ? nullptr : &entries[index[i]].value;
+}
+
+void MapObj::set(Cell const& key, Cell value)
+{
+	size_t const hash = key_hash(key);
+	size_t const i = position(key, hash);
+	if (i != not_found)
+	{
+		entries[index[i]].value = std::move(value);
+		return;
+	}
+
+	// removed entries still count, until a rebuild drops them
+	if ((entries.size() + 1) * 4 > index.size() * 3)
+		rebuild(count + 1);
+
+	size_t const mask = index.size() - 1;
+	size_t slot = hash & mask;
+	while (index[slot] != empty_slot && index[slot] != removed_slot)
+		slot = (slot + 1) & mask;
+	index[slot] = (uint32_t)entries.size();
+	entries.push_back({ key, std::move(value), hash });
+	count++;
+}
+
+bool MapObj::remove(Cell const& key) noexcept
+{
+	size_t const i = position(key, key_hash(key));
+	if (i == not_found)
+		return false;
+
+	Entry& e = entries[index[i]];
+	e.key = Cell(CellType::Unbound);
+	e.value = Cell();
+	index[i] = removed_slot;
+	if (--count == 0)
+	{
+		entries.clear();
+		std::fill(index.begin(), index.end(), empty_slot);
+	}
+	return true;
+}
+
+void MapObj::reserve(size_t capacity)
+{
+	entries.reserve(capacity);
+	if (capacity * 4 > index.size() * 3)
+		rebuild(capacity);
+}
+
+// at most half full afterwards, a map that keeps adding and removing keys is not rebuilt on every insertion
+void MapObj::rebuild(size_t capacity)
+{
+	if (count != entries.size())
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [](Entry const& e) { return e.key.type == CellType::Unbound; }), entries.end());
+
+	size_t size = min_index;
+	while (std::max(capacity, count) * 2 > size)
+		size *= 2;
+
+	index.assign(size, empty_slot);
+	size_t const mask = size - 1;
+	for (size_t e = 0; e < entries.size(); e++)
+	{
+		size_t slot = entries[e].hash & mask;
+		while (index[slot] != empty_slot)
+			slot = (slot + 1) & mask;
+		index[slot] = (uint32_t)e;
+	}
+}
@@ -0,0 +1,96 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace lsp;
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(std::string const& path)
+{
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		file = nullptr;
+		return;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size))
+		return;
+	size = (size_t)file_size.QuadPart;
+	opened = true;
+	// empty files cannot be mapped, they are an empty view
+	if (size == 0)
+		return;
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!data)
+	{
+		size = 0;
+		opened = false;
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file)
+		CloseHandle(file);
+}
+
+#else
+
+MappedFile::MappedFile(std::string const& path)
+{
+	int const fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0)
+	{
+		size = (size_t)st.st_size;
+		opened = true;
+		// empty files cannot be mapped, they are an empty view
+		if (size > 0)
+		{
+			int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+			flags |= MAP_POPULATE; // files are read whole, fault every page in at once
+#endif
+			void* const ptr = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+			if (ptr == MAP_FAILED)
+			{
+				size = 0;
+				opened = false;
+			}
+			else
+			{
+				data = ptr;
+			}
+		}
+	}
+	// the mapping stays valid once the descriptor is closed
+	close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	if (data)
+		munmap(const_cast<void*>(data), size);
+}
+
+#endif
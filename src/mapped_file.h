@@ -0,0 +1,30 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace lsp {
+
+	// whole file mapped read only, the pages are loaded when first read
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(std::string const& path);
+		~MappedFile();
+		MappedFile(MappedFile const&) = delete;
+		MappedFile& operator=(MappedFile const&) = delete;
+
+		// false when the file could not be opened or mapped
+		bool is_open() const noexcept { return opened; }
+		std::string_view view() const noexcept { return { static_cast<const char*>(data), size }; }
+
+	private:
+		void const* data = nullptr;
+		size_t size = 0;
+		bool opened = false;
+#ifdef _WIN32
+		void* file = nullptr;
+		void* mapping = nullptr;
+#endif
+	};
+}
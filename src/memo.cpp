@@ -0,0 +1,79 @@
+#include "memo.h"
+
+using namespace lsp;
+
+bool MemoCache::KeyEqual::operator()(Key const& a, Key const& b) const
+{
+	if (a.hash != b.hash || a.count != b.count)
+		return false;
+	for (size_t i = 0; i < a.count; i++)
+	{
+		if (!cell_value_equal(a.args[i], b.args[i]))
+			return false;
+	}
+	return true;
+}
+
+size_t MemoCache::hash_of(CellSpan_t args)
+{
+	size_t h = args.size();
+	for (auto const& c : args)
+		h = detail::hash_combine(h, cell_hash(c));
+	return h;
+}
+
+bool MemoCache::find(CellSpan_t args, Cell& result)
+{
+	auto const it = index.find({ hash_of(args), args.data(), args.size() });
+	if (it == index.end())
+	{
+		miss_count++;
+		return false;
+	}
+
+	hit_count++;
+	entries.splice(entries.begin(), entries, it->second);
+	result = it->second->result;
+	return true;
+}
+
+void MemoCache::insert(CellSpan_t args, Cell const& result)
+{
+	size_t const hash = hash_of(args);
+	auto const found = index.find({ hash, args.data(), args.size() });
+	if (found != index.end())
+	{
+		// a recursive call cached it first
+		found->second->result = result;
+		return;
+	}
+
+	if (bound && entries.size() >= bound)
+	{
+		Entry const& last = entries.back();
+		index.erase({ last.hash, last.args.data(), last.args.size() });
+		entries.pop_back();
+		eviction_count++;
+	}
+
+	entries.push_front({ hash, CellList_t(args.begin(), args.end()), result });
+	Entry const& entry = entries.front();
+	index.emplace(Key{ hash, entry.args.data(), entry.args.size() }, entries.begin());
+}
+
+void MemoCache::clear()
+{
+	index.clear();
+	entries.clear();
+}
+
+void MemoCache::references(HeapVisitor& visitor) const
+{
+	visitor.visit(proc);
+	for (auto const& e : entries)
+	{
+		for (auto const& c : e.args)
+			visitor.visit(c);
+		visitor.visit(e.result);
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "tinyLisp.h"
+
+#include <list>
+#include <unordered_map>
+
+namespace lsp {
+
+	// results of a proc by arguments, for procs whose result only depends on them, see the memoize builtin
+	// arguments are compared with cell_value_equal: the ones holding procs or NaN never match
+	class MemoCache
+	{
+	public:
+		// 0 for no bound, past it the least recently used result is evicted
+		MemoCache(Cell proc, size_t capacity) : proc(std::move(proc)), bound(capacity) {}
+		MemoCache(MemoCache const&) = delete;
+		MemoCache& operator=(MemoCache const&) = delete;
+
+		// the result cached for args, counted as a hit or a miss
+		bool find(CellSpan_t args, Cell& result);
+		void insert(CellSpan_t args, Cell const& result);
+		void clear();
+		// proc and the arguments and results of the entries, for the cycle collector
+		void references(HeapVisitor& visitor) const;
+
+		size_t size() const noexcept { return entries.size(); }
+		size_t capacity() const noexcept { return bound; }
+		uint64_t hits() const noexcept { return hit_count; }
+		uint64_t misses() const noexcept { return miss_count; }
+		uint64_t evictions() const noexcept { return eviction_count; }
+		double hit_rate() const noexcept { return hit_count + miss_count ? (double)hit_count / (hit_count + miss_count) : 0.0; }
+
+		Cell proc; // the memoized proc
+		bool frozen = false; // shared by the interpreters of a base environement, their calls go straight to proc
+
+	private:
+		struct Entry
+		{
+			size_t hash;
+			CellList_t args;
+			Cell result;
+		};
+
+		// arguments of an entry, or of the call being looked up
+		struct Key
+		{
+			size_t hash;
+			Cell const* args;
+			size_t count;
+		};
+
+		struct KeyHash
+		{
+			size_t operator()(Key const& key) const noexcept { return key.hash; }
+		};
+
+		struct KeyEqual
+		{
+			bool operator()(Key const& a, Key const& b) const;
+		};
+
+		static size_t hash_of(CellSpan_t args);
+
+		std::list<Entry> entries; // most recently used first
+		std::unordered_map<Key, std::list<Entry>::iterator, KeyHash, KeyEqual> index;
+		size_t bound;
+		uint64_t hit_count = 0;
+		uint64_t miss_count = 0;
+		uint64_t eviction_count = 0;
+	};
+}
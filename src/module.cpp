@@ -0,0 +1,142 @@
+#include "module.h"
+#include "mapped_file.h"
+
+using namespace lsp;
+
+namespace {
+
+	// same grammar as Interpreter::read_from, with symbols and strings kept in the module
+	class ModuleParser
+	{
+	public:
+		ModuleParser(std::string_view source, ParsedModule& module) : lexer(source), module(module) {}
+
+		void parse()
+		{
+			while (lexer.peek().type != TokenType::End)
+				read();
+		}
+
+	private:
+		void read()
+		{
+			Token const tk = lexer.next();
+			switch (tk.type)
+			{
+			case TokenType::Open:
+			{
+				size_t const list = push(CellType::List);
+				uint32_t count = 0;
+				for (;;)
+				{
+					TokenType const next = lexer.peek().type;
+					if (next == TokenType::Close)
+					{
+						lexer.next();
+						break;
+					}
+					if (next == TokenType::End)
+					{
+						runtime_error("missing ')' at the end of the source !");
+						break;
+					}
+					read();
+					count++;
+				}
+				module.nodes[list].index = count;
+				return;
+			}
+			case TokenType::Close:
+				runtime_error("unexpected ')' !");
+				push(CellType::Null);
+				return;
+			case TokenType::String:
+				module.nodes[push(CellType::String)].index = (uint32_t)module.strings.size();
+				module.strings.emplace_back(tk.text.substr(1, tk.text.size() - 2));
+				return;
+			case TokenType::Atom:
+				break;
+			case TokenType::End:
+				push(CellType::Null);
+				return;
+			}
+
+			Cell number;
+			if (parse_number(tk.text, number))
+			{
+				ModuleNode& node = module.nodes[push(number.type)];
+				if (number.type == CellType::Int)
+					node.int_value = number.as_int();
+				else
+					node.float_value = number.as_float();
+				return;
+			}
+
+			auto [it, added] = names.emplace(tk.text, (uint32_t)module.names.size());
+			if (added)
+				module.names.emplace_back(tk.text);
+			module.nodes[push(CellType::Symbol)].index = it->second;
+		}
+
+		size_t push(CellType type)
+		{
+			ModuleNode& node = module.nodes.emplace_back();
+			node.type = type;
+			node.int_value = 0;
+			return module.nodes.size() - 1;
+		}
+
+		Lexer lexer;
+		ParsedModule& module;
+		std::unordered_map<std::string_view, uint32_t> names; // views into the source
+	};
+}
+
+ParsedModule lsp::parse_module(std::string_view source)
+{
+	ParsedModule module;
+	ModuleParser(source, module).parse();
+	return module;
+}
+
+ModuleCache& ModuleCache::instance()
+{
+	static ModuleCache cache;
+	return cache;
+}
+
+std::shared_ptr<ParsedModule const> ModuleCache::get(std::string const& path)
+{
+	std::error_code ec;
+	auto const time = std::filesystem::last_write_time(path, ec);
+	uintmax_t const size = ec ? 0 : std::filesystem::file_size(path, ec);
+	if (ec)
+		return nullptr;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = modules.find(path);
+		if (it != modules.end() && it->second.time == time && it->second.size == size)
+		{
+			hit_count.fetch_add(1, std::memory_order_relaxed);
+			return it->second.module;
+		}
+	}
+
+	// parsed without the lock, two threads missing the same file at once both parse it
+	MappedFile file(path);
+	if (!file.is_open())
+		return nullptr;
+	auto module = std::make_shared<ParsedModule const>(parse_module(file.view()));
+	miss_count.fetch_add(1, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> guard(lock);
+	modules[path] = { time, size, module };
+	return module;
+}
+
+void ModuleCache::clear()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	modules.clear();
+}
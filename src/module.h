@@ -0,0 +1,59 @@
+#pragma once
+#include "tinyLisp.h"
+
+#include <filesystem>
+
+namespace lsp {
+
+	// a node of a parsed module, lists are followed by their items
+	struct ModuleNode
+	{
+		CellType type;		// List, Int, Float, String, Symbol, or Null for what could not be read
+		uint32_t index = 0; // items of a list, index in the strings or names of the module
+		union
+		{
+			CellIntegral_t int_value;
+			CellFloat_t float_value;
+		};
+	};
+
+	// forms of a source file read once, independent of any interpreter: symbols are indices into its names
+	struct ParsedModule
+	{
+		std::vector<ModuleNode> nodes; // the top level forms one after the other
+		std::vector<std::string> names;
+		std::vector<std::string> strings;
+	};
+
+	ParsedModule parse_module(std::string_view source);
+
+	// parsed modules shared by the interpreters of the process, keyed by path and parsed again when the file changes
+	class ModuleCache
+	{
+	public:
+		static ModuleCache& instance();
+
+		// null when the file cannot be read, the file is mapped and parsed unless the cached module is current
+		std::shared_ptr<ParsedModule const> get(std::string const& path);
+
+		// imports served without reading the file, from the cache or because the interpreter already had the module
+		uint64_t hits() const noexcept { return hit_count.load(std::memory_order_relaxed); }
+		// imports that mapped and parsed the file
+		uint64_t misses() const noexcept { return miss_count.load(std::memory_order_relaxed); }
+		void count_hit() noexcept { hit_count.fetch_add(1, std::memory_order_relaxed); }
+		void clear();
+
+	private:
+		struct Entry
+		{
+			std::filesystem::file_time_type time;
+			uintmax_t size = 0;
+			std::shared_ptr<ParsedModule const> module;
+		};
+
+		std::mutex lock;
+		std::unordered_map<std::string, Entry> modules;
+		std::atomic<uint64_t> hit_count{ 0 };
+		std::atomic<uint64_t> miss_count{ 0 };
+	};
+}
@@ -0,0 +1,316 @@
+#include "optimizer.h"
+#include "output.h"
+
+#include <cstdio>
+
+using namespace lsp;
+
+// bodies of at most this many nodes are inlined
+static constexpr size_t inline_size = 24;
+
+Optimizer::Optimizer(Interpreter& interp) : interp(interp)
+{
+	true_sym = interp.symbols.intern("true");
+	false_sym = interp.symbols.intern("false");
+	null_sym = interp.symbols.intern("null");
+}
+
+void Optimizer::optimize(Cell& form)
+{
+	if (!interp.dump_optimized)
+	{
+		expr(form);
+		return;
+	}
+
+	std::string const before = format(form);
+	expr(form);
+	std::string const after = format(form);
+	if (before != after)
+		interp.output().printf("[optimized] %s\n         => %s\n", before.c_str(), after.c_str());
+}
+
+std::string Optimizer::format(Cell const& cell) const
+{
+	switch (cell.type)
+	{
+	case CellType::Symbol:
+		return interp.symbols.name(cell.sym);
+	case CellType::String:
+		return "\"" + std::string(cell.as_string()) + "\"";
+	case CellType::Null:
+		return "null";
+	case CellType::Bool:
+		return cell.as_bool() ? "true" : "false";
+	case CellType::List:
+	{
+		std::string str("(");
+		for (auto const& c : cell.as_list())
+		{
+			if (str.size() > 1)
+				str += ' ';
+			str += format(c);
+		}
+		str += ')';
+		return str;
+	}
+	default:
+		return to_string(cell);
+	}
+}
+
+bool Optimizer::constant(Cell const& cell, Cell& value) const
+{
+	switch (cell.type)
+	{
+	case CellType::Null:
+	case CellType::Bool:
+	case CellType::Int:
+	case CellType::Float:
+	case CellType::String:
+		value = cell;
+		return true;
+	case CellType::Symbol:
+	{
+		if (cell.kind != SymbolKind::Global || cell.slot >= interp.global_env.slots.size())
+			return false;
+
+		Cell const& bound = interp.global_env.slots[cell.slot];
+		bool const is_self = (cell.sym == true_sym && bound.type == CellType::Bool && bound.as_bool())
+			|| (cell.sym == false_sym && bound.type == CellType::Bool && !bound.as_bool())
+			|| (cell.sym == null_sym && bound.type == CellType::Null);
+		if (is_self)
+			value = bound;
+		return is_self;
+	}
+	default:
+		return false;
+	}
+}
+
+ProcObj const* Optimizer::pure_callee(CellSpan_t call) const
+{
+	if (call.empty() || call[0].type != CellType::Symbol || call[0].kind != SymbolKind::Global
+		|| call[0].slot >= interp.global_env.slots.size())
+		return nullptr;
+
+	Cell const& callee = interp.global_env.slots[call[0].slot];
+	if (callee.type != CellType::Proc)
+		return nullptr;
+	ProcObj const& p = callee.as_proc();
+	return p.pure && p.accepts(call.size() - 1) ? &p : nullptr;
+}
+
+bool Optimizer::pure(Cell const& cell) const
+{
+	switch (cell.type)
+	{
+	case CellType::Symbol:
+		return cell.kind != SymbolKind::Unresolved;
+	case CellType::List:
+	{
+		auto const list = cell.as_list();
+		if (cell.form == Form::If)
+		{
+			if (list.size() < 3)
+				return false;
+		}
+		else if (cell.form != Form::Call || !pure_callee(list))
+		{
+			return false;
+		}
+
+		for (auto const& c : detail::Range(list.begin() + 1, list.end()))
+		{
+			if (!pure(c))
+				return false;
+		}
+		return true;
+	}
+	case CellType::Proc:
+	case CellType::Vector:
+	case CellType::Map:
+		return false;
+	default:
+		return true;
+	}
+}
+
+bool Optimizer::fold(Cell& call)
+{
+	auto const list = call.as_list();
+	ProcObj const* const p = pure_callee(list);
+	if (!p)
+		return false;
+
+	CellList_t args;
+	for (auto const& arg : detail::Range(list.begin() + 1, list.end()))
+	{
+		Cell value;
+		if (!constant(arg, value) || (value.type != CellType::Int && value.type != CellType::Float))
+			return false;
+		args.push_back(std::move(value));
+	}
+	// an integral modulo by zero has no value, it is left to the runtime
+	if (p->name == "%" && args[1].type == CellType::Int && args[1].as_int() == 0)
+		return false;
+
+	call = p->fn(interp, CellSpan_t(args.data(), args.size()));
+	return true;
+}
+
+size_t Optimizer::inlinable(Lambda const& fn, Cell const& cell, std::vector<uint32_t>& uses) const
+{
+	switch (cell.type)
+	{
+	case CellType::Symbol:
+		if (cell.kind == SymbolKind::Local)
+		{
+			if (cell.depth != 0 || cell.slot >= fn.nparams)
+				return 0;
+			uses[cell.slot]++;
+			return 1;
+		}
+		// a recursive proc, or one passing itself around
+		return cell.kind == SymbolKind::Global && cell.sym != fn.name ? 1 : 0;
+	case CellType::List:
+	{
+		auto const list = cell.as_list();
+		if (cell.form == Form::If)
+		{
+			if (list.size() < 3)
+				return 0;
+		}
+		else if (cell.form != Form::Call || !pure_callee(list))
+		{
+			return 0;
+		}
+
+		size_t size = 1;
+		for (auto const& c : detail::Range(list.begin() + 1, list.end()))
+		{
+			size_t const n = inlinable(fn, c, uses);
+			if (!n)
+				return 0;
+			size += n;
+		}
+		return size;
+	}
+	case CellType::Proc:
+	case CellType::Vector:
+	case CellType::Map:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+Cell Optimizer::substitute(Cell const& cell, CellSpan_t args)
+{
+	if (cell.type == CellType::Symbol && cell.kind == SymbolKind::Local)
+		return args[cell.slot];
+	if (cell.type != CellType::List)
+		return cell;
+
+	CellList_t items;
+	for (auto const& c : cell.as_list())
+		items.push_back(substitute(c, args));
+
+	Cell copy{ CellType::List };
+	copy.object = interp.arena->new_list(items.data(), items.size());
+	copy.count = (uint32_t)items.size();
+	copy.form = cell.form;
+	return copy;
+}
+
+// the body of a small pure proc replaces the call, its parameters replaced by the arguments
+bool Optimizer::inline_call(Cell& call)
+{
+	auto const list = call.as_list();
+	if (interp.opt_level < 2 || list[0].type != CellType::Symbol || list[0].kind != SymbolKind::Global
+		|| list[0].slot >= interp.global_env.slots.size())
+		return false;
+
+	Cell const& callee = interp.global_env.slots[list[0].slot];
+	if (callee.type != CellType::Proc || !callee.as_proc().lambda || callee.as_proc().env)
+		return false;
+
+	Lambda const& fn = *callee.as_proc().lambda;
+	Scope const& scope = *fn.scope;
+	if (fn.body.size() != 1 || fn.nparams != list.size() - 1 || scope.names.size() != fn.nparams || scope.captures || scope.dynamic)
+		return false;
+
+	std::vector<uint32_t> uses(fn.nparams, 0);
+	size_t const size = inlinable(fn, fn.body[0], uses);
+	if (size == 0 || size > inline_size)
+		return false;
+
+	// arguments are evaluated where their parameter is read, maybe never, maybe more than once
+	CellSpan_t const args(list.data() + 1, list.size() - 1);
+	for (uint32_t i = 0; i < fn.nparams; i++)
+	{
+		if (!pure(args[i]) || (uses[i] > 1 && args[i].type == CellType::List))
+			return false;
+	}
+
+	call = substitute(fn.body[0], args);
+	return true;
+}
+
+void Optimizer::expr(Cell& cell)
+{
+	if (cell.type != CellType::List || cell.as_list().empty())
+		return;
+
+	auto list = cell.as_list_mut();
+	switch (cell.form)
+	{
+	case Form::Unknown: // parameters of a defun
+	case Form::Import:
+	case Form::Eval:
+		return;
+	case Form::Profile:
+		if (list.size() > 1)
+			expr(list[1]);
+		return;
+	case Form::Set:
+	case Form::Setg:
+		if (list.size() > 2)
+			expr(list[2]);
+		return;
+	case Form::Defun:
+	{
+		Lambda* const lambda = static_cast<ListObj*>(cell.object)->lambda;
+		if (!lambda)
+			return;
+		for (auto& b : detail::Range(list.begin() + 3, list.end()))
+			expr(b);
+		lambda->body.assign(list.begin() + 3, list.end());
+		return;
+	}
+	case Form::If:
+	case Form::While:
+	{
+		for (auto& c : detail::Range(list.begin() + 1, list.end()))
+			expr(c);
+
+		Cell cond;
+		if (list.size() < (cell.form == Form::If ? 3u : 2u) || !constant(list[1], cond))
+			return;
+		if (cell.form == Form::While)
+		{
+			if (!cond.is_true())
+				cell = Cell();
+			return;
+		}
+		Cell branch = cond.is_true() ? list[2] : list.size() > 3 ? list[3] : Cell();
+		cell = std::move(branch);
+		return;
+	}
+	default:
+		for (auto& c : list)
+			expr(c);
+		if (!fold(cell) && inline_call(cell))
+			expr(cell);
+	}
+}
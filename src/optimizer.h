@@ -0,0 +1,39 @@
+#pragma once
+#include "tinyLisp.h"
+
+#include <string>
+
+namespace lsp {
+
+	// rewrites the resolved forms of a program before they are evaluated, see Interpreter::opt_level
+	// builtins are recognized by their value: only the pure natives still bound to their name are folded,
+	// only procs still bound to their name are inlined, later assignments do not change code already optimized
+	class Optimizer
+	{
+	public:
+		explicit Optimizer(Interpreter& interp);
+
+		// rewrites form in place, new lists go to the arena of the interpreter
+		void optimize(Cell& form);
+
+		// the form as it would be written, symbols by name
+		std::string format(Cell const& cell) const;
+
+	private:
+		void expr(Cell& cell);
+		// value of a literal or of true, false and null while they are bound to themselves
+		bool constant(Cell const& cell, Cell& value) const;
+		// the pure native called by a resolved call, null for anything else
+		ProcObj const* pure_callee(CellSpan_t call) const;
+		// no side effect and no error besides the ones of pure natives
+		bool pure(Cell const& cell) const;
+		bool fold(Cell& call);
+		bool inline_call(Cell& call);
+		// a single expression of its parameters, literals, pure natives and ifs, its size in nodes or 0
+		size_t inlinable(Lambda const& fn, Cell const& cell, std::vector<uint32_t>& uses) const;
+		Cell substitute(Cell const& cell, CellSpan_t args);
+
+		Interpreter& interp;
+		SymbolId true_sym, false_sym, null_sym;
+	};
+}
@@ -0,0 +1,229 @@
+#include "output.h"
+
+#include <csignal>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace lsp;
+
+static thread_local Output* current_output = nullptr;
+
+// the output install_crash_handlers was given
+static std::atomic<Output*> crash_output{ nullptr };
+
+// only calls safe in a signal handler
+static void write_fully(int fd, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+#ifdef _WIN32
+		int const n = _write(fd, data, (unsigned)size);
+#else
+		ssize_t const n = write(fd, data, size);
+#endif
+		if (n <= 0)
+			return;
+		data += n;
+		size -= n;
+	}
+}
+
+FileSink::~FileSink()
+{
+	if (owned)
+		fclose(file);
+	else
+		fflush(file);
+}
+
+std::shared_ptr<FileSink> FileSink::open(std::string const& path)
+{
+	FILE* const file = fopen(path.c_str(), "wb");
+	if (!file)
+		return nullptr;
+	auto sink = std::make_shared<FileSink>(file);
+	sink->owned = true;
+	return sink;
+}
+
+void FileSink::write(std::string_view text)
+{
+	fwrite(text.data(), 1, text.size(), file);
+}
+
+void FileSink::flush()
+{
+	fflush(file);
+}
+
+int FileSink::descriptor() const noexcept
+{
+#ifdef _WIN32
+	return _fileno(file);
+#else
+	return fileno(file);
+#endif
+}
+
+Output::Output(std::shared_ptr<OutputSink> sink, size_t capacity)
+	: sink(std::move(sink)), capacity(capacity), crash_descriptor(this->sink->descriptor())
+{
+	buffer.reserve(capacity);
+}
+
+Output::~Output()
+{
+	Output* self = this;
+	crash_output.compare_exchange_strong(self, nullptr);
+	flush();
+}
+
+// handlers already set by the host are kept
+void Output::install_crash_handlers(Output& out)
+{
+	crash_output.store(&out, std::memory_order_release);
+	static bool installed = false;
+	if (installed)
+		return;
+	installed = true;
+
+	int const signals[] = { SIGSEGV, SIGFPE, SIGILL, SIGABRT,
+#ifndef _WIN32
+		SIGBUS,
+#endif
+	};
+#ifdef _WIN32
+	for (int sig : signals)
+	{
+		auto const previous = signal(sig, on_crash);
+		if (previous != SIG_DFL)
+			signal(sig, previous);
+	}
+#else
+	// a stack overflow of the tree walker is the usual crash, the handler needs a stack of its own to run
+	static char crash_stack[64 * 1024];
+	stack_t stack;
+	if (sigaltstack(nullptr, &stack) == 0 && (stack.ss_flags & SS_DISABLE))
+	{
+		stack.ss_sp = crash_stack;
+		stack.ss_size = sizeof(crash_stack);
+		stack.ss_flags = 0;
+		sigaltstack(&stack, nullptr);
+	}
+	for (int sig : signals)
+	{
+		struct sigaction previous;
+		if (sigaction(sig, nullptr, &previous) != 0 || previous.sa_handler != SIG_DFL)
+			continue;
+		struct sigaction action = {};
+		action.sa_handler = on_crash;
+		action.sa_flags = SA_ONSTACK | SA_RESETHAND;
+		sigemptyset(&action.sa_mask);
+		sigaction(sig, &action, nullptr);
+	}
+#endif
+}
+
+// writes what the output buffered without blocking or allocating, then crashes as the signal would have
+// the text is lost when the crash interrupted a change of the buffer, or a parallel task holds the lock
+void Output::on_crash(int signal)
+{
+	Output* const out = crash_output.load(std::memory_order_acquire);
+	if (out && out->crash_descriptor >= 0 && !out->filling.load(std::memory_order_relaxed) && out->lock.try_lock())
+	{
+		write_fully(out->crash_descriptor, out->buffer.data(), out->buffer.size());
+		out->lock.unlock();
+	}
+	// the default handler is back
+	raise(signal);
+}
+
+void Output::printf(const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+void Output::vprintf(const char* fmt, va_list args)
+{
+	append([&](std::string& text) {
+		// formatted in place, a second pass when the spare capacity was too small
+		va_list again;
+		va_copy(again, args);
+		size_t const start = text.size();
+		text.resize(start + 256);
+		int const n = vsnprintf(&text[start], 256, fmt, args);
+		if (n < 0)
+		{
+			text.resize(start);
+		}
+		else if (n >= 256)
+		{
+			text.resize(start + n + 1);
+			vsnprintf(&text[start], n + 1, fmt, again);
+			text.resize(start + n);
+		}
+		else
+		{
+			text.resize(start + n);
+		}
+		va_end(again);
+	});
+}
+
+void Output::written(size_t start)
+{
+	if (policy == FlushPolicy::Line ? buffer.find('\n', start) != std::string::npos
+		: policy == FlushPolicy::Full && buffer.size() >= capacity)
+		drain();
+}
+
+void Output::drain()
+{
+	if (!buffer.empty())
+		sink->write(buffer);
+	buffer.clear();
+	sink->flush();
+}
+
+void Output::flush()
+{
+	if (!detail::concurrent())
+	{
+		Filling const filling_scope(*this);
+		drain();
+		return;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	Filling const filling_scope(*this);
+	drain();
+}
+
+void Output::set_sink(std::shared_ptr<OutputSink> sink)
+{
+	flush();
+	// the previous sink may close its file
+	crash_descriptor = -1;
+	this->sink = std::move(sink);
+	crash_descriptor = this->sink->descriptor();
+}
+
+Output* Output::current() noexcept
+{
+	return current_output;
+}
+
+Output::Scope::Scope(Output& out) noexcept : previous(current_output)
+{
+	current_output = &out;
+}
+
+Output::Scope::~Scope()
+{
+	current_output = previous;
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include "tinyLisp.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+namespace lsp {
+
+	// where the text of an Output goes once flushed
+	class OutputSink
+	{
+	public:
+		virtual ~OutputSink() = default;
+		virtual void write(std::string_view text) = 0;
+		virtual void flush() {}
+		// file descriptor the buffered text is written to when the process crashes, -1 when there is none
+		virtual int descriptor() const noexcept { return -1; }
+	};
+
+	// stdout by default, files opened by path are closed with the sink
+	class FileSink final : public OutputSink
+	{
+	public:
+		explicit FileSink(FILE* file = stdout) : file(file) {}
+		~FileSink() override;
+		FileSink(FileSink const&) = delete;
+		FileSink& operator=(FileSink const&) = delete;
+
+		// null when the file cannot be opened for writing
+		static std::shared_ptr<FileSink> open(std::string const& path);
+
+		void write(std::string_view text) override;
+		void flush() override;
+		int descriptor() const noexcept override;
+
+	private:
+		FILE* file;
+		bool owned = false;
+	};
+
+	// keeps the text in memory, for embedders capturing what scripts print
+	class StringSink final : public OutputSink
+	{
+	public:
+		void write(std::string_view text) override { text_.append(text); }
+
+		std::string const& text() const noexcept { return text_; }
+		// the text written so far, the sink starts over empty
+		std::string take() { return std::move(text_); }
+
+	private:
+		std::string text_;
+	};
+
+	enum class FlushPolicy : uint8_t
+	{
+		Full,	// when the buffer reaches its capacity
+		Line,	// after each write holding a newline, for terminals
+		Manual, // only on flush, the buffer grows as needed
+	};
+
+	// buffered text output of an interpreter: print, println and the errors reported while it runs
+	// during a parallel job the tasks share it, their writes are then serialized
+	class Output
+	{
+	public:
+		static constexpr size_t default_capacity = 64 * 1024;
+
+		explicit Output(std::shared_ptr<OutputSink> sink = std::make_shared<FileSink>(), size_t capacity = default_capacity);
+		~Output();
+		Output(Output const&) = delete;
+		Output& operator=(Output const&) = delete;
+
+		void write(std::string_view text) { append([&](std::string& buffer) { buffer.append(text); }); }
+		void printf(const char* fmt, ...);
+		void vprintf(const char* fmt, va_list args);
+
+		// fill appends to the buffer, the policy is applied once it returns
+		template<typename F>
+		void append(F&& fill)
+		{
+			if (!detail::concurrent())
+			{
+				Filling const filling_scope(*this);
+				size_t const start = buffer.size();
+				fill(buffer);
+				written(start);
+				return;
+			}
+			std::lock_guard<std::mutex> guard(lock);
+			Filling const filling_scope(*this);
+			size_t const start = buffer.size();
+			fill(buffer);
+			written(start);
+		}
+
+		// hands the buffered text to the sink and flushes it
+		void flush();
+		// flushes what went to the previous sink first
+		void set_sink(std::shared_ptr<OutputSink> sink);
+		std::shared_ptr<OutputSink> const& get_sink() const noexcept { return sink; }
+		void set_capacity(size_t capacity) noexcept { this->capacity = capacity; }
+
+		FlushPolicy policy = FlushPolicy::Full;
+
+		// the output the errors of the calling thread are reported to, null outside of an interpreter
+		static Output* current() noexcept;
+
+		// for runners: what out buffered is written to the file of its sink when the process crashes
+		// installs handlers of the fatal signals for the whole process where none is set, call it from the main thread
+		static void install_crash_handlers(Output& out);
+
+		// makes out the current output of the thread for its lifetime
+		class Scope
+		{
+		public:
+			explicit Scope(Output& out) noexcept;
+			~Scope();
+			Scope(Scope const&) = delete;
+			Scope& operator=(Scope const&) = delete;
+
+		private:
+			Output* previous;
+		};
+
+	private:
+		void written(size_t start);
+		void drain();
+
+		// marks the buffer as being changed for its lifetime, the crash handler leaves it then
+		struct Filling
+		{
+			explicit Filling(Output& out) noexcept : out(out)
+			{
+				out.filling.store(true, std::memory_order_relaxed);
+				std::atomic_signal_fence(std::memory_order_seq_cst);
+			}
+			~Filling()
+			{
+				std::atomic_signal_fence(std::memory_order_seq_cst);
+				out.filling.store(false, std::memory_order_relaxed);
+			}
+
+			Output& out;
+		};
+
+		static void on_crash(int signal);
+
+		std::shared_ptr<OutputSink> sink;
+		std::string buffer;
+		size_t capacity;
+		std::mutex lock;
+		int crash_descriptor;
+		std::atomic<bool> filling{ false };
+	};
+}
@@ -0,0 +1,137 @@
+#include "pool.h"
+
+#include <algorithm>
+
+using namespace lsp;
+
+WorkPool::WorkPool(size_t size)
+{
+	size = std::max<size_t>(size, 1);
+	for (size_t i = 0; i < size; i++)
+		queues.push_back(std::make_unique<Queue>());
+	for (size_t i = 1; i < size; i++)
+		threads.emplace_back(&WorkPool::thread_main, this, i);
+}
+
+WorkPool::~WorkPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& t : threads)
+		t.join();
+}
+
+void WorkPool::thread_main(size_t worker)
+{
+	uint64_t seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+
+		work(worker);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (--busy == 0)
+			done.notify_one();
+	}
+}
+
+void WorkPool::run(size_t count, size_t grain_size, Body_t const& fn)
+{
+	if (count == 0)
+		return;
+
+	// every worker starts with a contiguous share, the stealing evens out uneven items
+	size_t const n = queues.size();
+	for (size_t i = 0; i < n; i++)
+	{
+		size_t const begin = count * i / n, end = count * (i + 1) / n;
+		if (begin < end)
+			push(i, { begin, end });
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		body = &fn;
+		grain = std::max<size_t>(grain_size, 1);
+		remaining.store(count, std::memory_order_relaxed);
+		busy = threads.size();
+		generation++;
+	}
+	wake.notify_all();
+
+	work(0);
+
+	std::unique_lock<std::mutex> guard(lock);
+	done.wait(guard, [&] { return busy == 0; });
+	body = nullptr;
+}
+
+void WorkPool::work(size_t worker)
+{
+	Range range;
+	while (remaining.load(std::memory_order_acquire) > 0)
+	{
+		if (!pop(worker, range) && !steal(worker, range))
+		{
+			// the last ranges are running elsewhere
+			std::this_thread::yield();
+			continue;
+		}
+
+		// keep the first half, the others stay available to thieves
+		while (range.end - range.begin > grain)
+		{
+			size_t const mid = range.begin + (range.end - range.begin) / 2;
+			push(worker, { mid, range.end });
+			range.end = mid;
+		}
+
+		(*body)(worker, range.begin, range.end);
+		remaining.fetch_sub(range.end - range.begin, std::memory_order_acq_rel);
+	}
+}
+
+void WorkPool::push(size_t worker, Range range)
+{
+	Queue& q = *queues[worker];
+	std::lock_guard<std::mutex> guard(q.lock);
+	q.ranges.push_back(range);
+}
+
+bool WorkPool::pop(size_t worker, Range& range)
+{
+	Queue& q = *queues[worker];
+	std::lock_guard<std::mutex> guard(q.lock);
+	if (q.ranges.empty())
+		return false;
+	range = q.ranges.back();
+	q.ranges.pop_back();
+	return true;
+}
+
+// the front of a queue holds the oldest and largest ranges
+bool WorkPool::steal(size_t worker, Range& range)
+{
+	size_t const n = queues.size();
+	for (size_t i = 1; i < n; i++)
+	{
+		Queue& q = *queues[(worker + i) % n];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.ranges.empty())
+			continue;
+		range = q.ranges.front();
+		q.ranges.pop_front();
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lsp {
+
+	// fixed set of threads running parallel loops, the thread calling run takes part as worker 0
+	// workers split their ranges in halves as they go, idle workers steal the largest half left
+	class WorkPool
+	{
+	public:
+		// body(worker, begin, end), worker is in [0, size())
+		using Body_t = std::function<void(size_t, size_t, size_t)>;
+
+		explicit WorkPool(size_t size);
+		~WorkPool();
+		WorkPool(WorkPool const&) = delete;
+		WorkPool& operator=(WorkPool const&) = delete;
+
+		size_t size() const noexcept { return queues.size(); }
+		// runs body over [0, count) in ranges of at most grain items, returns once every range ran
+		// not reentrant, a body must not call run on the same pool
+		void run(size_t count, size_t grain, Body_t const& body);
+
+	private:
+		struct Range
+		{
+			size_t begin, end;
+		};
+
+		struct Queue
+		{
+			std::mutex lock;
+			std::deque<Range> ranges; // the owner works from the back, thieves take the front
+		};
+
+		void thread_main(size_t worker);
+		void work(size_t worker);
+		bool pop(size_t worker, Range& range);
+		bool steal(size_t worker, Range& range);
+		void push(size_t worker, Range range);
+
+		std::vector<std::unique_ptr<Queue>> queues;
+		std::vector<std::thread> threads;
+
+		std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable done;
+		Body_t const* body = nullptr;
+		size_t grain = 1;
+		uint64_t generation = 0; // bumped for every job, workers wait for a new one
+		size_t busy = 0;		 // threads still working on the current job
+		bool stopping = false;
+		std::atomic<size_t> remaining{ 0 }; // items of the current job not run yet
+	};
+}
@@ -0,0 +1,126 @@
+#include "profiler.h"
+
+#include <algorithm>
+
+using namespace lsp;
+
+// name of the bottom of every sampled stack, the code the profiler was attached around
+static constexpr char const* root_name = "profile";
+
+Profiler::Profiler(std::chrono::nanoseconds interval)
+	: tick(std::max<uint64_t>(interval.count(), 1)), origin(std::chrono::steady_clock::now()), next_sample(tick)
+{
+	nodes.push_back({ 0, 0 });
+}
+
+uint64_t Profiler::now() const noexcept
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+uint32_t Profiler::function_of(void const* key, std::string const& name)
+{
+	auto const it = keys.find(key);
+	if (it != keys.end() && table[it->second].name == name)
+		return it->second;
+
+	// a new proc, or the address of a dead one reused
+	auto const [named, added] = names.try_emplace(name, (uint32_t)table.size());
+	if (added)
+	{
+		table.push_back({ name });
+		active.push_back(0);
+	}
+	keys[key] = named->second;
+	return named->second;
+}
+
+void Profiler::sample(uint64_t time)
+{
+	if (time < next_sample)
+		return;
+
+	uint64_t const ticks = (time - next_sample) / tick + 1;
+	next_sample += ticks * tick;
+	sampled += ticks;
+	nodes[stack.empty() ? 0 : stack.back().node].samples += ticks;
+}
+
+void Profiler::enter(void const* key, std::string const& name)
+{
+	uint64_t const time = now();
+	sample(time);
+
+	uint32_t const f = function_of(key, name);
+	table[f].calls++;
+	active[f]++;
+
+	uint32_t const parent = stack.empty() ? 0 : stack.back().node;
+	auto const [child, added] = children.try_emplace((uint64_t)parent << 32 | f, (uint32_t)nodes.size());
+	if (added)
+		nodes.push_back({ parent, f });
+	stack.push_back({ f, child->second, time });
+}
+
+void Profiler::exit()
+{
+	// attached in the middle of a call
+	if (stack.empty())
+		return;
+
+	uint64_t const time = now();
+	sample(time);
+
+	Call const call = stack.back();
+	stack.pop_back();
+	uint64_t const elapsed = time - call.start;
+	Function& fn = table[call.function];
+	fn.exclusive_ns += elapsed - std::min(elapsed, call.children);
+	if (--active[call.function] == 0)
+		fn.inclusive_ns += elapsed;
+	if (!stack.empty())
+		stack.back().children += elapsed;
+}
+
+void Profiler::finish()
+{
+	sample(now());
+}
+
+std::vector<Profiler::Function> Profiler::functions() const
+{
+	std::vector<Function> result = table;
+	std::stable_sort(result.begin(), result.end(), [](Function const& a, Function const& b) { return a.exclusive_ns > b.exclusive_ns; });
+	return result;
+}
+
+void Profiler::write_collapsed(FILE* out) const
+{
+	std::vector<uint32_t> path;
+	std::string line;
+	for (uint32_t i = 0; i < nodes.size(); i++)
+	{
+		if (!nodes[i].samples)
+			continue;
+
+		path.clear();
+		for (uint32_t n = i; n != 0; n = nodes[n].parent)
+			path.push_back(nodes[n].function);
+
+		line = root_name;
+		for (auto f = path.rbegin(); f != path.rend(); ++f)
+		{
+			line += ';';
+			line += table[*f].name;
+		}
+		fprintf(out, "%s %llu\n", line.c_str(), (unsigned long long)nodes[i].samples);
+	}
+}
+
+void Profiler::write_report(FILE* out) const
+{
+	fprintf(out, "%-24s %12s %14s %14s\n", "function", "calls", "inclusive ms", "exclusive ms");
+	for (auto const& fn : functions())
+		fprintf(out, "%-24s %12llu %14.3f %14.3f\n", fn.name.c_str(), (unsigned long long)fn.calls, fn.inclusive_ns / 1e6, fn.exclusive_ns / 1e6);
+	fprintf(out, "%llu samples every %.3f ms\n", (unsigned long long)sampled, tick / 1e6);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lsp {
+
+	// call counts and times of the procs called while it is attached to an interpreter, see Interpreter::set_profiler
+	// the lisp stack is also sampled every interval of the time spent in it, for flamegraphs
+	class Profiler
+	{
+	public:
+		struct Function
+		{
+			std::string name;
+			uint64_t calls = 0;
+			uint64_t inclusive_ns = 0; // a recursive call is counted once, in its outermost call
+			uint64_t exclusive_ns = 0; // without the calls it made
+		};
+
+		explicit Profiler(std::chrono::nanoseconds interval = std::chrono::milliseconds(1));
+
+		// key is the identity of the proc, procs of the same name share the entry of their name
+		void enter(void const* key, std::string const& name);
+		void exit();
+		// gives the samples of the time spent since the last call or return, before reading the results
+		void finish();
+
+		// most exclusive time first
+		std::vector<Function> functions() const;
+		uint64_t sample_count() const noexcept { return sampled; }
+		std::chrono::nanoseconds interval() const noexcept { return std::chrono::nanoseconds(tick); }
+
+		// one line per sampled stack, the names from the outermost call separated by ';' then the number of samples
+		// it is the collapsed format read by flamegraph.pl, inferno and speedscope
+		void write_collapsed(FILE* out) const;
+		// table of the functions and their times
+		void write_report(FILE* out) const;
+
+	private:
+		struct Call
+		{
+			uint32_t function;
+			uint32_t node;
+			uint64_t start;
+			uint64_t children = 0; // time spent in the calls it made
+		};
+
+		// a distinct stack, the call of function made from the stack of parent
+		struct Node
+		{
+			uint32_t parent;
+			uint32_t function;
+			uint64_t samples = 0;
+		};
+
+		uint64_t now() const noexcept;
+		// the time up to now was spent in the current stack, it takes the samples due in it
+		void sample(uint64_t time);
+		uint32_t function_of(void const* key, std::string const& name);
+
+		uint64_t tick;
+		std::chrono::steady_clock::time_point origin;
+		uint64_t next_sample;
+		uint64_t sampled = 0;
+
+		std::vector<Function> table;
+		std::vector<uint32_t> active; // calls of each function on the stack
+		std::unordered_map<void const*, uint32_t> keys; // last function seen with each key
+		std::unordered_map<std::string, uint32_t> names;
+		std::vector<Call> stack;
+		std::vector<Node> nodes; // the first one is the empty stack
+		std::unordered_map<uint64_t, uint32_t> children; // node by parent node and function
+	};
+}
@@ -0,0 +1,462 @@
+#include "simd.h"
+
+#include <cstdlib>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LSP_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// avx2 kernels are compiled for the instruction set without a global flag and only called when the cpu has it
+#if defined(__GNUC__) || defined(__clang__)
+#define LSP_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LSP_TARGET_AVX2
+#endif
+
+using namespace lsp::simd;
+
+namespace {
+
+	constexpr bool is_compare(Op op) { return op == Op::Lt || op == Op::Gt || op == Op::Eq; }
+
+	// reference semantics of every kernel, ints wrap on overflow like the vector instructions do
+	template<Op O, typename T>
+	auto apply(T x, T y)
+	{
+		if constexpr (O == Op::Lt)
+			return int64_t(x < y);
+		else if constexpr (O == Op::Gt)
+			return int64_t(x > y);
+		else if constexpr (O == Op::Eq)
+			return int64_t(x == y);
+		else if constexpr (O == Op::Div)
+			return T(x / y);
+		else if constexpr (std::is_integral_v<T>)
+		{
+			uint64_t const ux = uint64_t(x), uy = uint64_t(y);
+			return T(O == Op::Add ? ux + uy : O == Op::Sub ? ux - uy : ux * uy);
+		}
+		else
+			return T(O == Op::Add ? x + y : O == Op::Sub ? x - y : x * y);
+	}
+
+	// from index i, the vector kernels finish their tails with it
+	template<Op O, typename T, typename R>
+	void scalar_loop(T const* a, T const* b, bool b_scalar, R* out, size_t i, size_t n)
+	{
+		if (b_scalar)
+		{
+			T const y = *b;
+			for (; i < n; i++)
+				out[i] = R(apply<O>(a[i], y));
+		}
+		else
+		{
+			for (; i < n; i++)
+				out[i] = R(apply<O>(a[i], b[i]));
+		}
+	}
+
+	// float kernels write doubles for arithmetic and an int mask for comparisons, other pairs are never called
+	template<typename Impl, Op O, typename T, typename R>
+	void run(T const* a, T const* b, bool b_scalar, R* out, size_t n)
+	{
+		if constexpr (std::is_integral_v<T> || is_compare(O) == std::is_integral_v<R>)
+			Impl::template run<O>(a, b, b_scalar, out, n);
+		else
+			scalar_loop<O>(a, b, b_scalar, out, 0, n);
+	}
+
+	// turns the runtime op into the template argument of Impl::run
+	template<typename Impl, typename T, typename R>
+	void dispatch(Op op, T const* a, T const* b, bool b_scalar, R* out, size_t n)
+	{
+		switch (op)
+		{
+		case Op::Add: return run<Impl, Op::Add>(a, b, b_scalar, out, n);
+		case Op::Sub: return run<Impl, Op::Sub>(a, b, b_scalar, out, n);
+		case Op::Mul: return run<Impl, Op::Mul>(a, b, b_scalar, out, n);
+		case Op::Div: return run<Impl, Op::Div>(a, b, b_scalar, out, n);
+		case Op::Lt: return run<Impl, Op::Lt>(a, b, b_scalar, out, n);
+		case Op::Gt: return run<Impl, Op::Gt>(a, b, b_scalar, out, n);
+		case Op::Eq: return run<Impl, Op::Eq>(a, b, b_scalar, out, n);
+		}
+	}
+
+	struct Scalar
+	{
+		template<Op O, typename T, typename R>
+		static void run(T const* a, T const* b, bool b_scalar, R* out, size_t n) { scalar_loop<O>(a, b, b_scalar, out, 0, n); }
+	};
+
+	template<typename T>
+	T scalar_sum(T const* a, size_t n)
+	{
+		T sum = 0;
+		for (size_t i = 0; i < n; i++)
+			sum = apply<Op::Add>(sum, a[i]);
+		return sum;
+	}
+
+	template<typename T>
+	T scalar_dot(T const* a, T const* b, size_t n)
+	{
+		T sum = 0;
+		for (size_t i = 0; i < n; i++)
+			sum = apply<Op::Add>(sum, apply<Op::Mul>(a[i], b[i]));
+		return sum;
+	}
+
+	template<typename T>
+	T scalar_min(T const* a, size_t n)
+	{
+		T m = a[0];
+		for (size_t i = 1; i < n; i++)
+			m = a[i] < m ? a[i] : m;
+		return m;
+	}
+
+	template<typename T>
+	T scalar_max(T const* a, size_t n)
+	{
+		T m = a[0];
+		for (size_t i = 1; i < n; i++)
+			m = a[i] > m ? a[i] : m;
+		return m;
+	}
+
+	Kernels const scalar_kernels{
+		"scalar",
+		dispatch<Scalar, double, double>,
+		dispatch<Scalar, double, int64_t>,
+		dispatch<Scalar, int64_t, int64_t>,
+		dispatch<Scalar, int64_t, int64_t>,
+		scalar_sum<double>,
+		scalar_dot<double>,
+		scalar_min<double>,
+		scalar_max<double>,
+		scalar_sum<int64_t>,
+		scalar_dot<int64_t>,
+		scalar_min<int64_t>,
+		scalar_max<int64_t>,
+	};
+
+#ifdef LSP_SIMD_X86
+
+	// sse2 is part of x86-64, 2 lanes of 64 bits
+	struct Sse2
+	{
+		template<Op O>
+		static __m128d f64(__m128d x, __m128d y)
+		{
+			if constexpr (O == Op::Add) return _mm_add_pd(x, y);
+			else if constexpr (O == Op::Sub) return _mm_sub_pd(x, y);
+			else if constexpr (O == Op::Mul) return _mm_mul_pd(x, y);
+			else if constexpr (O == Op::Div) return _mm_div_pd(x, y);
+			else if constexpr (O == Op::Lt) return _mm_cmplt_pd(x, y);
+			else if constexpr (O == Op::Gt) return _mm_cmpgt_pd(x, y);
+			else return _mm_cmpeq_pd(x, y);
+		}
+
+		template<Op O, typename R>
+		static void run(double const* a, double const* b, bool b_scalar, R* out, size_t n)
+		{
+			__m128d const vb = b_scalar ? _mm_set1_pd(*b) : _mm_setzero_pd();
+			__m128i const one = _mm_set1_epi64x(1);
+			size_t i = 0;
+			for (; i + 2 <= n; i += 2)
+			{
+				__m128d const r = f64<O>(_mm_loadu_pd(a + i), b_scalar ? vb : _mm_loadu_pd(b + i));
+				if constexpr (is_compare(O))
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_and_si128(_mm_castpd_si128(r), one));
+				else
+					_mm_storeu_pd(out + i, r);
+			}
+			scalar_loop<O>(a, b, b_scalar, out, i, n);
+		}
+
+		// 64 bit compares and multiplies need sse4 or avx512, they stay scalar
+		template<Op O, typename R>
+		static void run(int64_t const* a, int64_t const* b, bool b_scalar, R* out, size_t n)
+		{
+			size_t i = 0;
+			if constexpr (O == Op::Add || O == Op::Sub)
+			{
+				__m128i const vb = b_scalar ? _mm_set1_epi64x(*b) : _mm_setzero_si128();
+				for (; i + 2 <= n; i += 2)
+				{
+					__m128i const x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i));
+					__m128i const y = b_scalar ? vb : _mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), O == Op::Add ? _mm_add_epi64(x, y) : _mm_sub_epi64(x, y));
+				}
+			}
+			scalar_loop<O>(a, b, b_scalar, out, i, n);
+		}
+
+		static double f64_sum(double const* a, size_t n)
+		{
+			__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4)
+			{
+				acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+				acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+			}
+			double lanes[2];
+			_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+			return lanes[0] + lanes[1] + scalar_sum(a + i, n - i);
+		}
+
+		static double f64_dot(double const* a, double const* b, size_t n)
+		{
+			__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4)
+			{
+				acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+				acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+			}
+			double lanes[2];
+			_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+			return lanes[0] + lanes[1] + scalar_dot(a + i, b + i, n - i);
+		}
+
+		template<bool Max>
+		static double f64_extremum(double const* a, size_t n)
+		{
+			if (n < 2)
+				return a[0];
+			__m128d acc = _mm_loadu_pd(a);
+			size_t i = 2;
+			for (; i + 2 <= n; i += 2)
+				acc = Max ? _mm_max_pd(acc, _mm_loadu_pd(a + i)) : _mm_min_pd(acc, _mm_loadu_pd(a + i));
+			double lanes[3];
+			_mm_storeu_pd(lanes, acc);
+			lanes[2] = Max ? scalar_max(a + i - 1, n - i + 1) : scalar_min(a + i - 1, n - i + 1);
+			return Max ? scalar_max(lanes, 3) : scalar_min(lanes, 3);
+		}
+
+		static int64_t i64_sum(int64_t const* a, size_t n)
+		{
+			__m128i acc = _mm_setzero_si128();
+			size_t i = 0;
+			for (; i + 2 <= n; i += 2)
+				acc = _mm_add_epi64(acc, _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i)));
+			int64_t lanes[2];
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+			return apply<Op::Add>(apply<Op::Add>(lanes[0], lanes[1]), scalar_sum(a + i, n - i));
+		}
+	};
+
+	Kernels const sse2_kernels{
+		"sse2",
+		dispatch<Sse2, double, double>,
+		dispatch<Sse2, double, int64_t>,
+		dispatch<Sse2, int64_t, int64_t>,
+		dispatch<Sse2, int64_t, int64_t>,
+		Sse2::f64_sum,
+		Sse2::f64_dot,
+		Sse2::f64_extremum<false>,
+		Sse2::f64_extremum<true>,
+		Sse2::i64_sum,
+		scalar_dot<int64_t>,
+		scalar_min<int64_t>,
+		scalar_max<int64_t>,
+	};
+
+	// 4 lanes of 64 bits, avx2 has 64 bit adds and compares but no 64 bit multiply
+	struct Avx2
+	{
+		template<Op O>
+		LSP_TARGET_AVX2 static __m256d f64(__m256d x, __m256d y)
+		{
+			if constexpr (O == Op::Add) return _mm256_add_pd(x, y);
+			else if constexpr (O == Op::Sub) return _mm256_sub_pd(x, y);
+			else if constexpr (O == Op::Mul) return _mm256_mul_pd(x, y);
+			else if constexpr (O == Op::Div) return _mm256_div_pd(x, y);
+			else if constexpr (O == Op::Lt) return _mm256_cmp_pd(x, y, _CMP_LT_OQ);
+			else if constexpr (O == Op::Gt) return _mm256_cmp_pd(x, y, _CMP_GT_OQ);
+			else return _mm256_cmp_pd(x, y, _CMP_EQ_OQ);
+		}
+
+		template<Op O>
+		LSP_TARGET_AVX2 static __m256i i64(__m256i x, __m256i y)
+		{
+			if constexpr (O == Op::Add) return _mm256_add_epi64(x, y);
+			else if constexpr (O == Op::Sub) return _mm256_sub_epi64(x, y);
+			else if constexpr (O == Op::Lt) return _mm256_cmpgt_epi64(y, x);
+			else if constexpr (O == Op::Gt) return _mm256_cmpgt_epi64(x, y);
+			else return _mm256_cmpeq_epi64(x, y);
+		}
+
+		template<Op O, typename R>
+		LSP_TARGET_AVX2 static void run(double const* a, double const* b, bool b_scalar, R* out, size_t n)
+		{
+			__m256d const vb = b_scalar ? _mm256_set1_pd(*b) : _mm256_setzero_pd();
+			__m256i const one = _mm256_set1_epi64x(1);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4)
+			{
+				__m256d const r = f64<O>(_mm256_loadu_pd(a + i), b_scalar ? vb : _mm256_loadu_pd(b + i));
+				if constexpr (is_compare(O))
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_and_si256(_mm256_castpd_si256(r), one));
+				else
+					_mm256_storeu_pd(out + i, r);
+			}
+			scalar_loop<O>(a, b, b_scalar, out, i, n);
+		}
+
+		template<Op O, typename R>
+		LSP_TARGET_AVX2 static void run(int64_t const* a, int64_t const* b, bool b_scalar, R* out, size_t n)
+		{
+			size_t i = 0;
+			if constexpr (O != Op::Mul && O != Op::Div)
+			{
+				__m256i const vb = b_scalar ? _mm256_set1_epi64x(*b) : _mm256_setzero_si256();
+				__m256i const one = _mm256_set1_epi64x(1);
+				for (; i + 4 <= n; i += 4)
+				{
+					__m256i r = i64<O>(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i)),
+						b_scalar ? vb : _mm256_loadu_si256(reinterpret_cast<__m256i const*>(b + i)));
+					if constexpr (is_compare(O))
+						r = _mm256_and_si256(r, one);
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), r);
+				}
+			}
+			scalar_loop<O>(a, b, b_scalar, out, i, n);
+		}
+
+		LSP_TARGET_AVX2 static double f64_sum(double const* a, size_t n)
+		{
+			__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8)
+			{
+				acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+				acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+			}
+			double lanes[4];
+			_mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+			return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + scalar_sum(a + i, n - i);
+		}
+
+		LSP_TARGET_AVX2 static double f64_dot(double const* a, double const* b, size_t n)
+		{
+			__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8)
+			{
+				acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+				acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+			}
+			double lanes[4];
+			_mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+			return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + scalar_dot(a + i, b + i, n - i);
+		}
+
+		template<bool Max>
+		LSP_TARGET_AVX2 static double f64_extremum(double const* a, size_t n)
+		{
+			if (n < 4)
+				return Max ? scalar_max(a, n) : scalar_min(a, n);
+			__m256d acc = _mm256_loadu_pd(a);
+			size_t i = 4;
+			for (; i + 4 <= n; i += 4)
+				acc = Max ? _mm256_max_pd(acc, _mm256_loadu_pd(a + i)) : _mm256_min_pd(acc, _mm256_loadu_pd(a + i));
+			double lanes[5];
+			_mm256_storeu_pd(lanes, acc);
+			// the tail overlaps the last full block so it is never empty
+			lanes[4] = Max ? scalar_max(a + i - 1, n - i + 1) : scalar_min(a + i - 1, n - i + 1);
+			return Max ? scalar_max(lanes, 5) : scalar_min(lanes, 5);
+		}
+
+		LSP_TARGET_AVX2 static int64_t i64_sum(int64_t const* a, size_t n)
+		{
+			__m256i acc = _mm256_setzero_si256();
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4)
+				acc = _mm256_add_epi64(acc, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i)));
+			int64_t lanes[4];
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+			return apply<Op::Add>(scalar_sum(lanes, 4), scalar_sum(a + i, n - i));
+		}
+
+		template<bool Max>
+		LSP_TARGET_AVX2 static int64_t i64_extremum(int64_t const* a, size_t n)
+		{
+			if (n < 4)
+				return Max ? scalar_max(a, n) : scalar_min(a, n);
+			__m256i acc = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a));
+			size_t i = 4;
+			for (; i + 4 <= n; i += 4)
+			{
+				__m256i const x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i));
+				// take x in the lanes where it beats the accumulator
+				acc = _mm256_blendv_epi8(acc, x, Max ? _mm256_cmpgt_epi64(x, acc) : _mm256_cmpgt_epi64(acc, x));
+			}
+			int64_t lanes[5];
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+			lanes[4] = Max ? scalar_max(a + i - 1, n - i + 1) : scalar_min(a + i - 1, n - i + 1);
+			return Max ? scalar_max(lanes, 5) : scalar_min(lanes, 5);
+		}
+	};
+
+	Kernels const avx2_kernels{
+		"avx2",
+		dispatch<Avx2, double, double>,
+		dispatch<Avx2, double, int64_t>,
+		dispatch<Avx2, int64_t, int64_t>,
+		dispatch<Avx2, int64_t, int64_t>,
+		Avx2::f64_sum,
+		Avx2::f64_dot,
+		Avx2::f64_extremum<false>,
+		Avx2::f64_extremum<true>,
+		Avx2::i64_sum,
+		scalar_dot<int64_t>,
+		Avx2::i64_extremum<false>,
+		Avx2::i64_extremum<true>,
+	};
+
+	bool cpu_has_avx2()
+	{
+#if defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 1);
+		// the os must save the ymm registers
+		if (!(regs[2] & (1 << 27)) || !(regs[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(regs, 7, 0);
+		return (regs[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+
+#endif
+
+	Kernels const& select()
+	{
+		char const* const cap = std::getenv("TINYLISP_SIMD");
+		std::string_view const isa = cap ? cap : "avx2";
+#ifdef LSP_SIMD_X86
+		if (isa == "avx2" && cpu_has_avx2())
+			return avx2_kernels;
+		if (isa != "scalar")
+			return sse2_kernels;
+#endif
+		(void)isa;
+		return scalar_kernels;
+	}
+}
+
+Kernels const& lsp::simd::kernels()
+{
+	static Kernels const& best = select();
+	return best;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// element-wise and reduction kernels of packed vectors, implemented for the best instruction set of the cpu
+namespace lsp::simd {
+
+	enum class Op : uint8_t
+	{
+		Add,
+		Sub,
+		Mul,
+		Div, // floats only
+		Lt,
+		Gt,
+		Eq,
+	};
+
+	// out may alias a, b is read as a single value broadcast to every lane when b_scalar is set
+	// comparisons write a mask of 0 and 1, reductions of floats may add in a different order than a plain loop
+	struct Kernels
+	{
+		const char* isa;
+		void (*f64_arith)(Op, double const* a, double const* b, bool b_scalar, double* out, size_t n);
+		void (*f64_compare)(Op, double const* a, double const* b, bool b_scalar, int64_t* out, size_t n);
+		void (*i64_arith)(Op, int64_t const* a, int64_t const* b, bool b_scalar, int64_t* out, size_t n);
+		void (*i64_compare)(Op, int64_t const* a, int64_t const* b, bool b_scalar, int64_t* out, size_t n);
+		double (*f64_sum)(double const* a, size_t n);
+		double (*f64_dot)(double const* a, double const* b, size_t n);
+		double (*f64_min)(double const* a, size_t n); // n > 0
+		double (*f64_max)(double const* a, size_t n);
+		int64_t (*i64_sum)(int64_t const* a, size_t n);
+		int64_t (*i64_dot)(int64_t const* a, int64_t const* b, size_t n);
+		int64_t (*i64_min)(int64_t const* a, size_t n);
+		int64_t (*i64_max)(int64_t const* a, size_t n);
+	};
+
+	// picked once from the cpu features, TINYLISP_SIMD=scalar|sse2|avx2 caps the choice
+	Kernels const& kernels();
+}
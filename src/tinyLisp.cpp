@@ -1,29 +1,94 @@
 #include "tinyLisp.h"
+#include "vm.h"
+#include "simd.h"
+#include "pool.h"
+#include "module.h"
+#include "profiler.h"
+#include "optimizer.h"
+#include "memo.h"
+#include "output.h"
+#include "heap.h"
 
+#include <algorithm>
 #include <cctype>
 #include <cstdarg>
 #include <cstdio>
 #include <cmath>
 #include <numeric>
-#include <fstream>
+#include <functional>
+#include <chrono>
+#include <charconv>
+#include <thread>
 
-#define ENSURE(cond, fmt, ...) if (!(cond)) runtime_error(fmt, __VA_ARGS__);
+#define ENSURE(cond, ...) if (!(cond)) { runtime_error(__VA_ARGS__); return Cell(); }
 
 using namespace lsp;
 
+// per thread so interpreters on other threads do not contend on it
+static thread_local uint64_t allocations = 0;
+
+static void count_allocation() noexcept
+{
+	allocations++;
+}
+
+uint64_t lsp::allocation_count() noexcept
+{
+	return allocations;
+}
+
+// context of the parallel task running on this thread, null outside of tasks
+static thread_local ExecContext* active_context = nullptr;
+// lists made by the running task, no other thread can see them while it runs
+static thread_local uint64_t task_token = 0;
+static std::atomic<uint64_t> task_tokens{ 0 };
+
 static bool isPrimitivetype(CellType t)
 {
 	return t == CellType::Int || t == CellType::Float || t == CellType::Null || t == CellType::Bool || t == CellType::String;
 }
 
+// deep copy of a parsed form, lists are shared between copies of a cell
+static Cell clone_tree(Cell const& cell)
+{
+	if (cell.type != CellType::List)
+		return cell;
+
+	CellList_t list;
+	list.reserve(cell.as_list().size());
+	for (auto const& c : cell.as_list())
+		list.push_back(clone_tree(c));
+	return Cell::make_list(std::move(list));
+}
+
 void lsp::runtime_error(const char* fmt, ...)
 {
-	printf("[lisp error] : ");
+	detail::errors++;
 	va_list args;
 	va_start(args, fmt);
-	vprintf(fmt, args);
+	if (Output* const out = Output::current())
+	{
+		// a single write, the line stays whole when parallel tasks report errors at once
+		std::string const line = std::string("[lisp error] : ") + fmt + "\n";
+		out->vprintf(line.c_str(), args);
+	}
+	else
+	{
+		printf("[lisp error] : ");
+		vprintf(fmt, args);
+		printf("\n");
+	}
 	va_end(args);
-	printf("\n");
+}
+
+void lsp::arity_error(ProcObj const& proc, size_t argc)
+{
+	if (proc.min_args == proc.max_args)
+		runtime_error("%s takes %u arguments, got %zu !", proc.name.c_str(), proc.min_args, argc);
+	else if (proc.max_args == UINT16_MAX)
+		runtime_error("%s takes at least %u arguments, got %zu !", proc.name.c_str(), proc.min_args, argc);
+	else
+		runtime_error("%s takes %u to %u arguments, got %zu !", proc.name.c_str(), proc.min_args, proc.max_args, argc);
 }
 
 const char* lsp::to_string(CellType c)
@@ -46,610 +111,2087 @@ const char* lsp::to_string(CellType c)
 		return "Proc";
 	case CellType::List:
 		return "List";
+	case CellType::Vector:
+		return "Vector";
+	case CellType::Map:
+		return "Map";
+	case CellType::Unbound:
+		return "Unbound";
 	default:
 		return "Unknown";
 	}
 }
 
-std::queue<std::string> Interpreter::lex(std::string_view source)
+Token Lexer::peek()
+{
+	if (!has_peeked)
+	{
+		peeked = scan();
+		has_peeked = true;
+	}
+	return peeked;
+}
+
+Token Lexer::next()
+{
+	if (has_peeked)
+	{
+		has_peeked = false;
+		return peeked;
+	}
+	return scan();
+}
+
+Token Lexer::scan()
 {
-	std::queue<std::string> tokens;
-	size_t index = 0;
-	while (index < source.size())
+	for (;;)
 	{
-		while (index < source.size() && isspace(source[index]))
+		while (index < source.size() && isspace((unsigned char)source[index]))
 			index++;
 
 		if (index >= source.size())
+			return { TokenType::End, {} };
+
+		if (source[index] != ';')
 			break;
 
-		if (source[index] == ';')
-		{
-			while (index < source.size() && source[index++] != '\n') {}
-			continue;
-		}
+		while (index < source.size() && source[index++] != '\n') {}
+	}
 
-		if (source[index] == '(' || source[index] == ')')
-		{
-			source[index] == '(' ? tokens.push("(") : tokens.push(")");
+	size_t const save = index;
+	if (source[index] == '(' || source[index] == ')')
+	{
+		index++;
+		return { source[save] == '(' ? TokenType::Open : TokenType::Close, source.substr(save, 1) };
+	}
+	else if (source[index] == '"')
+	{
+		index++;
+		while (index < source.size() && source[index] != '"')
 			index++;
-		}
-		else if (source[index] == '"')
+
+		if (index >= source.size())
 		{
-			size_t const save = index++;
-			while (source[index++] != '"') {};
-			tokens.push(std::string(source.substr(save, index - save)));
+			runtime_error("unterminated string literal !");
+			return { TokenType::End, {} };
 		}
-		else
+
+		index++;
+		return { TokenType::String, source.substr(save, index - save) };
+	}
+	else
+	{
+		while (index < source.size() && !isspace((unsigned char)source[index]) && source[index] != '(' && source[index] != ')')
+			index++;
+		return { TokenType::Atom, source.substr(save, index - save) };
+	}
+}
+
+Cell Interpreter::read_from(Lexer& lexer)
+{
+	Token const tk = lexer.next();
+	switch (tk.type)
+	{
+	case TokenType::Open:
+	{
+		// items are gathered on the read stack and moved into a single arena allocation
+		size_t const base = read_stack.size();
+		for (;;)
 		{
-			size_t const save = index;
-			while (!isspace(source[index]) && source[index] != '(' && source[index] != ')')
-				index++;
-			tokens.push(std::string(source.substr(save, index - save)));
+			TokenType const next = lexer.peek().type;
+			if (next == TokenType::Close)
+			{
+				lexer.next();
+				break;
+			}
+			if (next == TokenType::End)
+			{
+				runtime_error("missing ')' at the end of the source !");
+				break;
+			}
+			Cell item = read_from(lexer);
+			read_stack.push_back(std::move(item));
 		}
+
+		Cell list{ CellType::List };
+		list.object = arena->new_list(read_stack.data() + base, read_stack.size() - base);
+		list.count = (uint32_t)(read_stack.size() - base);
+		read_stack.resize(base);
+		return list;
 	}
+	case TokenType::Close:
+		runtime_error("unexpected ')' !");
+		return Cell();
+	case TokenType::String:
+		return Cell::make_string(std::string(tk.text.substr(1, tk.text.size() - 2)));
+	case TokenType::Atom:
+		break;
+	case TokenType::End:
+		return Cell();
+	}
+
+	Cell number;
+	if (parse_number(tk.text, number))
+		return number;
 
-	return tokens;
+	Cell c{ CellType::Symbol };
+	c.sym = symbols.intern(tk.text);
+	return c;
 }
 
-Cell Interpreter::read_from(std::queue<std::string>& tokens)
+bool lsp::parse_number(std::string_view text, Cell& out)
 {
-	std::string tk = tokens.front();
-	tokens.pop();
-	if (tk == "(")
-	{
-		Cell c{ CellType::List };
-		c.value = CellList_t();
-		while (tokens.front() != ")")
-			std::get<CellList_t>(c.value).push_back(read_from(tokens));
+	if (!isdigit((unsigned char)text.front()) && !(text.front() == '-' && text.size() > 1 && isdigit((unsigned char)text[1])))
+		return false;
 
-		tokens.pop();
-		return c;
+	char const* const first = text.data();
+	char const* const last = text.data() + text.size();
+	if (text.find('.') != std::string_view::npos) // is float
+	{
+		CellFloat_t value = 0;
+		std::from_chars(first, last, value);
+		out = Cell::make_float(value);
+		return true;
 	}
-	else if (isdigit(tk.front()) || (tk.front() == '-' && isdigit(tk[1])))
+
+	CellIntegral_t value = 0;
+	std::from_chars(first, last, value);
+	out = Cell::make_int(value);
+	return true;
+}
+
+Cell Interpreter::read_node(ParsedModule const& module, size_t& pos, std::vector<SymbolId> const& ids)
+{
+	ModuleNode const& node = module.nodes[pos++];
+	switch (node.type)
+	{
+	case CellType::List:
 	{
-		if (tk.find('.') != std::string::npos) // is float
+		size_t const base = read_stack.size();
+		for (uint32_t i = 0; i < node.index; i++)
 		{
-			Cell c{ CellType::Float };
-			c.value = std::stod(tk);
-			return c;
+			Cell item = read_node(module, pos, ids);
+			read_stack.push_back(std::move(item));
 		}
 
-		Cell c{ CellType::Int };
-		c.value = std::stol(tk);
-		return c;
+		Cell list{ CellType::List };
+		list.object = arena->new_list(read_stack.data() + base, node.index);
+		list.count = node.index;
+		read_stack.resize(base);
+		return list;
 	}
-	else if (tk.front() == '"')
-	{
-		Cell c{ CellType::String };
-		c.value = tk.substr(1, tk.size() - 2);
-		return c;
-	}
-	else
+	case CellType::Int:
+		return Cell::make_int(node.int_value);
+	case CellType::Float:
+		return Cell::make_float(node.float_value);
+	case CellType::String:
+		return Cell::make_string(module.strings[node.index]);
+	case CellType::Symbol:
 	{
 		Cell c{ CellType::Symbol };
-		c.token_str = tk;
+		c.sym = ids[node.index];
 		return c;
 	}
+	default:
+		return Cell();
+	}
 }
 
-Cell Interpreter::eval(Cell const& cell, Environement& env)
+std::optional<SymbolId> SymbolTable::find(std::string_view name) const
 {
-	if (isPrimitivetype(cell.type))
-		return cell;
-
-	if (cell.type == CellType::Symbol)
-	{
-		if (env.symbols.find(cell.token_str) != env.symbols.end())
-			return env.symbols[cell.token_str];
-		else
-			return global_env.symbols[cell.token_str];
-	}
+	auto it = ids.find(name);
+	if (it != ids.end())
+		return it->second;
+	return base ? base->find(name) : std::nullopt;
+}
 
-	auto& list_value = std::get<CellList_t>(cell.value);
+SymbolId SymbolTable::intern(std::string_view name)
+{
+	if (auto id = find(name))
+		return *id;
 
-	if (list_value.empty())
-		return Cell();
+	SymbolId const id = (SymbolId)size();
+	names.emplace_back(name);
+	ids.emplace(names.back(), id);
+	return id;
+}
 
-	if (list_value[0].type == CellType::Symbol)
+std::optional<uint32_t> Scope::find(SymbolId sym) const
+{
+	for (uint32_t i = 0; i < names.size(); i++)
 	{
-		if (list_value[0].token_str == "import")
-		{
-			ENSURE(list_value[1].type == CellType::String, "a string literal must follow an import !");
-			std::string file_name = std::get<std::string>(list_value[1].value);
-			if (imported_files.count(file_name) == 0)
-			{
-				std::ifstream file(file_name);
-				std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-				evalS(source);
-			}
-			return Cell();
-		}
-		else if (list_value[0].token_str == "set")
-		{
-			return env.symbols[list_value[1].token_str] = eval(list_value[2], env);
-		}
-		else if (list_value[0].token_str == "setg")
-		{
-			return global_env.symbols[list_value[1].token_str] = eval(list_value[2], env);
-		}
-		else if (list_value[0].token_str == "if")
-		{
-			return eval(std::get<bool>(eval(list_value[1], env).value) ? list_value[2] : (list_value.size() > 3 ? list_value[3] : Cell()), env);
-		}
-		else if (list_value[0].token_str == "while")
-		{
-			std::vector<Cell> body = std::vector(list_value.begin() + 2, list_value.end());
-			while (std::get<bool>(eval(list_value[1], env).value))
-			{
-				for (auto const& b : body)
-					eval(b, env);
-			}
-			return Cell();
-		}
-		else if (list_value[0].token_str == "defun")
-		{
-			auto& cellList = std::get<CellList_t>(cell.value);
-			std::string const func_name = cellList[1].token_str;
-			Cell func_args = cellList[2];
-			std::vector<Cell> body = std::vector(cellList.begin() + 3, cellList.end());
-			Cell fun = { CellType::Proc };
-			fun.local_env = Environement();
-			fun.value = [this, cell, env, func_name, func_args, body](std::vector<Cell> const& args) mutable -> Cell {
-				// add function args in local env
-				size_t i = 0;
-				Cell& func_sym = env.symbols[func_name];
-				func_sym.local_env = Environement{};
-
-				for (auto const& arg : std::get<CellList_t>(func_args.value))
-					func_sym.local_env->symbols[arg.token_str] = args[i++];
-
-				Cell last;
-				for (auto const& b : body)
-					last = eval(b, *func_sym.local_env);
-				return last;
-				};
+		if (names[i] == sym)
+			return i;
+	}
+	return std::nullopt;
+}
 
-			fun.token_str = func_name;
-			return env.symbols[cellList[1].token_str] = fun;
-		}
+uint32_t Scope::add(SymbolId sym)
+{
+	if (auto slot = find(sym))
+		return *slot;
+	names.push_back(sym);
+	return (uint32_t)names.size() - 1;
+}
 
-		if (list_value[0].token_str == "eval")
-			return evalS(std::get<std::string>(list_value[1].value), env);
+void Interpreter::sync_globals()
+{
+	if (global_env.slots.size() < symbols.size())
+		global_env.slots.resize(symbols.size());
+}
 
-		Cell proc = eval(list_value[0], env);
-		if (proc.type == CellType::Proc)
-		{
-			std::vector<Cell> exprs;
-			exprs.reserve(list_value.size());
-			
-			for (auto& expr : detail::Range(list_value.begin() + 1, list_value.end()))
-				exprs.push_back(eval(expr, env));
+Form Interpreter::decode_form(CellSpan_t list) const
+{
+	if (list.empty() || list[0].type != CellType::Symbol)
+		return Form::Call;
 
-			return std::get<CellProc_t>(proc.value)(exprs);
-		}
-		else
-		{
-			printf("error : symbol %s undefined\n", list_value[0].token_str.c_str());
-			return Cell();
-		}
-	}
+	SymbolId const head = list[0].sym;
+	if (head == forms.import)
+		return Form::Import;
+	if (head == forms.set)
+		return Form::Set;
+	if (head == forms.setg)
+		return Form::Setg;
+	if (head == forms.if_)
+		return Form::If;
+	if (head == forms.while_)
+		return Form::While;
+	if (head == forms.defun)
+		return Form::Defun;
+	if (head == forms.eval)
+		return Form::Eval;
+	if (head == forms.profile)
+		return Form::Profile;
+	return Form::Call;
 }
 
-Cell Interpreter::evalS(std::string const& str)
+Cell Interpreter::get_global(std::string_view name)
 {
-	return evalS(str, global_env);
+	SymbolId const sym = symbols.intern(name);
+	sync_globals();
+	return global_env.slots[sym];
 }
 
-Cell Interpreter::evalS(std::string const& str, Environement& env)
+void Interpreter::set_global(std::string_view name, Cell const& value)
 {
-	auto tokens = lex(str);
-	Cell last;
-	while (!tokens.empty())
-		last = eval(read_from(tokens), env);
-	return last;
+	SymbolId const sym = symbols.intern(name);
+	sync_globals();
+	global_env.slots[sym] = value;
+	if (value.type == CellType::Proc && value.as_proc().fn)
+		natives.push_back(value);
 }
 
-static CellType get_cellList_arithmetic_type(CellList_t const& list)
+// hoist every name assigned by set or defun so that reads before the first assignment already use the local slot
+void Interpreter::collect_locals(Cell const& cell, Scope& scope)
 {
+	if (cell.type != CellType::List)
+		return;
+
+	auto const& list = cell.as_list();
+	if (list.empty())
+		return;
+
+	Form const form = decode_form(list);
+	if ((form == Form::Set || form == Form::Defun) && list.size() > 1 && list[1].type == CellType::Symbol)
+		scope.add(list[1].sym);
+
+	if (form == Form::Defun) // the body gets its own scope
+		return;
+	if (form == Form::Eval)
+		scope.dynamic = true;
+
 	for (auto const& c : list)
+		collect_locals(c, scope);
+}
+
+void Interpreter::resolve_symbol(Cell& cell, Scope* scope)
+{
+	uint8_t depth = 0;
+	for (Scope* s = scope; s != nullptr; s = s->parent, depth++)
 	{
-		if (c.type == CellType::Float)
+		if (auto slot = s->find(cell.sym))
 		{
-			return CellType::Float;
+			cell.kind = SymbolKind::Local;
+			cell.depth = depth;
+			cell.slot = *slot;
+
+			// every scope between the use and the definition needs its parent frame at runtime
+			Scope* inner = scope;
+			for (uint8_t d = 0; d < depth; d++, inner = inner->parent)
+				inner->captures = true;
+			return;
 		}
 	}
-	return CellType::Int;
+
+	if (scope && scope->dynamic)
+	{
+		cell.kind = SymbolKind::Unresolved;
+		return;
+	}
+
+	cell.kind = SymbolKind::Global;
+	cell.slot = cell.sym;
 }
 
-static auto lessOp(CellList_t const& args) 
+void Interpreter::resolve(Cell& cell, Environement& env)
 {
-	ENSURE(args[0].type == CellType::Float || args[0].type == CellType::Int, "only numerical value can be compared !");
-	Cell ret = { CellType::Bool };
-	if (args[0].type == CellType::Float)
+	if (&env == &global_env)
 	{
-		CellFloat_t n = std::get<CellFloat_t>(args[0].value);
-		for (auto const& e : detail::Range(args.begin() + 1, args.end()))
-		{
-			if (n >= e.get_as_double())
-			{
-				ret.value = false;
-				return ret;
-			}
-		}
-		ret.value = true;
-		return ret;
+		resolve(cell, nullptr);
 	}
-	else // Int
+	else
 	{
-		CellFloat_t n = std::get<CellIntegral_t>(args[0].value);
-		for (auto const& e : detail::Range(args.begin() + 1, args.end()))
+		if (!env.scope)
 		{
-			if (n >= e.get_as_int())
-			{
-				ret.value = false;
-				return ret;
-			}
+			env.scope = std::make_shared<Scope>();
+			env.scope->hosted = !env.pool;
 		}
-		ret.value = true;
-		return ret;
+		collect_locals(cell, *env.scope);
+		resolve(cell, env.scope.get());
 	}
+	sync_globals();
 }
 
-static auto moreOp(CellList_t const& args)
+void Interpreter::resolve(Cell& cell, Scope* scope)
 {
-	ENSURE(args[0].type == CellType::Float || args[0].type == CellType::Int, "only numerical value can be compared !");
-	Cell ret = { CellType::Bool };
-	if (args[0].type == CellType::Float)
+	if (cell.type == CellType::Symbol)
 	{
-		CellFloat_t n = std::get<CellFloat_t>(args[0].value);
-		for (auto const& e : detail::Range(args.begin() + 1, args.end()))
+		resolve_symbol(cell, scope);
+		return;
+	}
+
+	if (cell.type != CellType::List)
+		return;
+
+	auto list = cell.as_list_mut();
+	if (list.empty())
+		return;
+
+	auto resolve_target = [scope](Cell& target) {
+		if (target.type != CellType::Symbol)
+			return;
+		if (scope)
 		{
-			if (n <= e.get_as_double())
-			{
-				ret.value = false;
-				return ret;
-			}
+			target.kind = SymbolKind::Local;
+			target.depth = 0;
+			target.slot = scope->add(target.sym);
 		}
-		ret.value = true;
-		return ret;
-	}
-	else // Int
+		else
+		{
+			target.kind = SymbolKind::Global;
+			target.slot = target.sym;
+		}
+	};
+
+	cell.form = decode_form(list);
+	switch (cell.form)
 	{
-		CellFloat_t n = std::get<CellIntegral_t>(args[0].value);
-		for (auto const& e : detail::Range(args.begin() + 1, args.end()))
+	case Form::Import:
+	case Form::Eval:
+		return;
+	case Form::Set:
+	case Form::Setg:
+		if (list.size() < 3)
+			return;
+		if (cell.form == Form::Set)
 		{
-			if (n <= e.get_as_int())
-			{
-				ret.value = false;
-				return ret;
-			}
+			resolve_target(list[1]);
+		}
+		else if (list[1].type == CellType::Symbol)
+		{
+			list[1].kind = SymbolKind::Global;
+			list[1].slot = list[1].sym;
+		}
+		resolve(list[2], scope);
+		return;
+	case Form::Defun:
+	{
+		// eval reports the malformed ones
+		if (list.size() < 3 || list[1].type != CellType::Symbol || list[2].type != CellType::List)
+			return;
+
+		resolve_target(list[1]);
+
+		// function bodies see their own locals, then the ones of the enclosing defuns and the globals
+		if (!arena)
+			arena = std::make_shared<Arena>();
+		Lambda* lambda = arena->new_lambda();
+		lambda->name = list[1].sym;
+		lambda->scope = std::make_shared<Scope>();
+		lambda->scope->parent = scope && !scope->hosted ? scope : nullptr;
+		for (auto& param : list[2].as_list_mut())
+		{
+			param.kind = SymbolKind::Local;
+			param.slot = lambda->scope->add(param.sym);
 		}
-		ret.value = true;
-		return ret;
+		lambda->nparams = (uint32_t)lambda->scope->names.size();
+
+		for (auto const& expr : detail::Range(list.begin() + 3, list.end()))
+			collect_locals(expr, *lambda->scope);
+		if (lambda->scope->dynamic) // eval can read any enclosing local
+			lambda->scope->captures = true;
+		for (auto& expr : detail::Range(list.begin() + 3, list.end()))
+			resolve(expr, lambda->scope.get());
+
+		lambda->body.assign(list.begin() + 3, list.end());
+		static_cast<ListObj*>(cell.object)->lambda = lambda;
+		return;
+	}
+	default:
+		for (auto& c : list)
+			resolve(c, scope);
 	}
 }
 
-Interpreter::Interpreter()
+Cell Interpreter::lookup(Cell const& symbol, Environement& env)
 {
+	switch (symbol.kind)
 	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			Cell c{ CellType::List };
-			c.value = args;
-			return c;
-		};
-		global_env.symbols["list"] = retCell;
-	}
-	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			Cell c{ CellType::String };
-			c.value = std::string();
-			for (auto const& arg : args)
-				std::get<std::string>(c.value) += to_string(arg);
-			return c;
-		};
-		global_env.symbols["strcat"] = retCell;
-	}
-	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			CellType sumType = get_cellList_arithmetic_type(args);
-			if (sumType == CellType::Float) 
-			{ 
-				CellFloat_t sum = 0.0; 
-				for (auto const& c : args) 
-				{ 
-					ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be sumed !"); 
-					if (c.type == CellType::Float) 
-						sum += std::get<CellFloat_t>(c.value); 
-					else 
-						sum += std::get<CellIntegral_t>(c.value); 
-				} 
-				Cell ret = { CellType::Float }; 
-				ret.value = sum; 
-				return ret; 
-			}
-			{ // SumType == Int
-				CellIntegral_t sum = 0; 
-				for (auto const& c : args) 
-				{ 
-					ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be sumed !"); 
-					if (c.type == CellType::Float) 
-						sum += std::get<CellFloat_t>(c.value); 
-					else 
-						sum += std::get<CellIntegral_t>(c.value); 
-				} 
-				Cell ret = { CellType::Int }; 
-				ret.value = sum; 
-				return ret; 
-			} 
-		}; 
-		global_env.symbols["+"] = retCell;
-	}
-	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			CellType sumType = get_cellList_arithmetic_type(args);
-			if (sumType == CellType::Float)
-			{
-				CellFloat_t sum = 0.0;
-				if (args[0].type == CellType::Float)
-					sum = std::get<CellFloat_t>(args[0].value);
-				else // int type
-					sum = std::get<CellIntegral_t>(args[0].value);
-				for (auto const& c : detail::Range(args.begin() + 1, args.end()))
-				{
-					ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be sumed !");
-					if (c.type == CellType::Float)
-						sum -= std::get<CellFloat_t>(c.value);
-					else
-						sum -= std::get<CellIntegral_t>(c.value);
-				}
-				Cell ret = { CellType::Float };
-				ret.value = sum;
-				return ret;
-			}
-			{ // SumType == In
-				CellIntegral_t sum = 0;
-				if (args[0].type == CellType::Float)
-					sum = std::get<CellFloat_t>(args[0].value);
-				else // int type
-					sum = std::get<CellIntegral_t>(args[0].value);
-				for (auto const& c : detail::Range(args.begin() + 1, args.end()))
-				{
-					ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be sumed !");
-					if (c.type == CellType::Float)
-						sum -= std::get<CellFloat_t>(c.value);
-					else
-						sum -= std::get<CellIntegral_t>(c.value);
-				}
-				Cell ret = { CellType::Int };
-				ret.value = sum;
-				return ret;
-			}
-		};
-		global_env.symbols["-"] = retCell;
-	}
-	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			CellType sumType = get_cellList_arithmetic_type(args);
-			if (sumType == CellType::Float)
-			{
-				CellFloat_t sum = 1.0;
-				for (auto const& c : args)
-				{
-					ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be multiplied !");
-					if (c.type == CellType::Float)
-						sum *= std::get<CellFloat_t>(c.value);
-					else
-						sum *= std::get<CellIntegral_t>(c.value);
-				}
-				Cell ret = { CellType::Float };
-				ret.value = sum;
-				return ret;
-			}
-			{ // SumType == In
-				CellIntegral_t sum = 1;
-				for (auto const& c : args)
-				{
-					ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be multiplied !");
-					if (c.type == CellType::Float)
-						sum *= std::get<CellFloat_t>(c.value);
-					else
-						sum *= std::get<CellIntegral_t>(c.value);
-				}
-				Cell ret = { CellType::Int };
-				ret.value = sum;
-				return ret;
-			}
-		};
-		global_env.symbols["*"] = retCell;
-	}
+	case SymbolKind::Local:
 	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			ENSURE(args[0].type == CellType::Float || args[0].type == CellType::Int, "only numerical value can be divided !");
-			
-			CellFloat_t sum;
-			if (args[0].type == CellType::Float)
-				sum = std::get<CellFloat_t>(args[0].value);
-			else // int type
-				sum = std::get<CellIntegral_t>(args[0].value);
+		Environement* frame = &env;
+		for (uint16_t d = 0; d < symbol.depth && frame; d++)
+			frame = frame->parent;
 
-			for (auto const& c : detail::Range(args.begin() + 1, args.end()))
-			{
-				ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be divided !");
-				if (c.type == CellType::Float)
-					sum /= std::get<CellFloat_t>(c.value);
-				else
-					sum /= std::get<CellIntegral_t>(c.value);
-			}
-			Cell ret = { CellType::Float };
-			ret.value = sum;
-			return ret;
-		};
-		global_env.symbols["/"] = retCell;
+		if (frame && symbol.slot < frame->slots.size() && frame->slots[symbol.slot].type != CellType::Unbound)
+			return frame->slots[symbol.slot];
+		break;
 	}
-	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = CellProc_t(lessOp);
-		global_env.symbols["<"] = retCell;
+	case SymbolKind::Global:
+		return global_env.slots[symbol.slot];
+	case SymbolKind::Unresolved:
+		for (Environement* frame = &env; frame && frame != &global_env; frame = frame->parent)
+		{
+			if (!frame->scope)
+				continue;
+			auto slot = frame->scope->find(symbol.sym);
+			if (slot && *slot < frame->slots.size() && frame->slots[*slot].type != CellType::Unbound)
+				return frame->slots[*slot];
+		}
+		break;
 	}
+
+	// unassigned locals fall back to the global of the same name
+	sync_globals();
+	return global_env.slots[symbol.sym];
+}
+
+void Interpreter::assign(Cell const& symbol, Cell const& value, Environement& env)
+{
+	if (&env == &global_env || symbol.kind == SymbolKind::Global)
 	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = CellProc_t(moreOp);
-		global_env.symbols[">"] = retCell;
+		if (in_parallel_task("assign a global"))
+			return;
+		sync_globals();
+		global_env.slots[symbol.sym] = value;
+		return;
 	}
+
+	if (!env.scope)
+		env.scope = std::make_shared<Scope>();
+
+	uint32_t const slot = symbol.kind == SymbolKind::Local ? symbol.slot : env.scope->add(symbol.sym);
+	if (slot >= env.slots.size())
+		env.slots.resize(slot + 1, Cell(CellType::Unbound));
+	env.slots[slot] = value;
+}
+
+// a module is evaluated once per interpreter, its parsed forms are shared by every interpreter through the cache
+Cell Interpreter::import_file(std::string const& file_name)
+{
+	if (in_parallel_task("import"))
+		return Cell();
+
+	ModuleCache& cache = ModuleCache::instance();
+	if (!imported_files.insert(file_name).second)
 	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			Cell r = lessOp(args);
-			std::get<bool>(r.value) = !std::get<bool>(r.value);
-			return r;
-		};
-		global_env.symbols[">="] = retCell;
+		cache.count_hit();
+		return Cell();
 	}
+
+	std::shared_ptr<ParsedModule const> const module = cache.get(file_name);
+	if (!module)
 	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			Cell r = moreOp(args);
-			std::get<bool>(r.value) = !std::get<bool>(r.value);
-			return r;
-		};
-		global_env.symbols["<="] = retCell;
+		imported_files.erase(file_name);
+		runtime_error("cannot read %s !", file_name.c_str());
+		return Cell();
 	}
-	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			ENSURE(args.size() > 0, "");
-			Cell r = { CellType::Bool };
-			r.value = true;
-			for (auto const& arg : detail::Range(args.begin() + 1, args.end()))
-				std::get<bool>(r.value) &= cell_value_equal(args[0], arg);
 
-			return r;
-		};
-		global_env.symbols["="] = retCell;
-	}
+	struct ModuleSource
 	{
-		Cell retCell = { CellType::Proc };
-		retCell.value = [](CellList_t const& args) {
-			ENSURE(args.size() == 2, "");
+		Interpreter& interp;
+		ParsedModule const& module;
+		std::vector<SymbolId> ids;
+		size_t pos = 0;
 
-			Cell ret = { get_cellList_arithmetic_type(args) };
-			if (ret.type == CellType::Int)
-				ret.value = (CellIntegral_t)args[0].get_as_int() % args[1].get_as_int();
-			else
-				ret.value = (CellFloat_t)fmod(args[0].get_as_double(), args[1].get_as_double());
-			return ret;
-		};
-		global_env.symbols["%"] = retCell;
-	}
+		bool done() const noexcept { return pos == module.nodes.size(); }
+		Cell read() { return interp.read_node(module, pos, ids); }
+	} source{ *this, *module, {} };
+
+	// one lookup per distinct name instead of one per occurrence
+	source.ids.reserve(module->names.size());
+	for (auto const& name : module->names)
+		source.ids.push_back(symbols.intern(name));
+	eval_forms(source, global_env);
+	return Cell();
+}
+
+Cell Interpreter::make_proc(Lambda* lambda, Environement& env)
+{
+	Cell fun = Cell::make_proc(nullptr, symbols.name(lambda->name));
+	ProcObj& p = fun.as_proc();
+	// the proc shares the ownership of the arena holding the lambda and its body
+	p.lambda = std::shared_ptr<Lambda>(lambda->arena->shared_from_this(), lambda);
+	// closures keep the frame they are defined in, defining one is O(1)
+	if (lambda->scope->captures && env.pool)
 	{
-		Cell c = { CellType::Proc };
-		c.value = [](CellList_t const& args) {
-			for (auto const& a : args)
-				printf("%s\n", to_string(a).c_str());
-			return Cell();
-		};
-		global_env.symbols["println"] = c;
+		env.retain();
+		p.env = &env;
 	}
+	return fun;
+}
+
+Environement* FramePool::acquire(Lambda const& fn, Cell const* args, size_t argc, Environement* parent)
+{
+	Environement* frame;
+	if (free.empty())
 	{
-		Cell c = { CellType::Proc };
-		c.value = [](CellList_t const& args) {
-			for (auto const& a : args)
-				printf("%s", to_string(a).c_str());
-			return Cell();
-		};
-		global_env.symbols["print"] = c;
+		frame = new Environement();
+		frame->pool = this;
+		count_allocation();
 	}
+	else
 	{
-		Cell c = { CellType::Symbol };
-		c.value = true;
-		global_env.symbols["true"] = c;
+		frame = free.back().release();
+		free.pop_back();
 	}
+
+	// frames are shared by every function, leave room so they rarely grow again
+	size_t const size = fn.scope->names.size();
+	if (frame->slots.capacity() < size)
 	{
-		Cell c = { CellType::Symbol };
-		c.value = false;
-		global_env.symbols["false"] = c;
+		frame->slots.reserve(std::max(size, (size_t)16));
+		count_allocation();
 	}
+
+	frame->refcount.store(1, std::memory_order_relaxed);
+	frame->pool = this; // frames released by a parallel task go to the pool of its thread
+	frame->scope = fn.scope;
+	frame->parent = parent;
+	if (parent)
+		parent->retain();
+
+	frame->slots.assign(size, Cell(CellType::Unbound));
+	for (size_t i = 0; i < fn.nparams; i++)
+		frame->slots[i] = i < argc ? args[i] : Cell();
+	return frame;
+}
+
+// a frame and a closure stored in one of its slots keep each other alive,
+// the frame is garbage once such closures, only referenced by their slot, hold all its references
+static bool drop_own_closures(Environement* frame) noexcept
+{
+	uint32_t internal = 0;
+	for (auto const& c : frame->slots)
 	{
-		global_env.symbols["null"] = Cell();
+		if (c.type == CellType::Proc && c.object->unique() && c.as_proc().env == frame)
+			internal++;
 	}
+	// the exchange makes a single thread win when two drop their last outside references at once
+	if (internal == 0 || !frame->refcount.compare_exchange_strong(internal, 0))
+		return false;
+
+	for (auto& c : frame->slots)
+	{
+		if (c.type == CellType::Proc && c.object->unique() && c.as_proc().env == frame)
+		{
+			c.as_proc().env = nullptr; // the closure's reference was taken back above
+			c = Cell();
+		}
+	}
+	return true;
+}
+
+void Environement::release() noexcept
+{
+	// walk up iteratively, a chain of closures can be deep
+	for (Environement* frame = this; frame && (detail::drop_ref(frame->refcount) || drop_own_closures(frame));)
+	{
+		Environement* const parent = frame->parent;
+		frame->slots.clear();
+		frame->scope.reset();
+		frame->parent = nullptr;
+		// the pool of another thread may be in use, a task keeps what it frees
+		FramePool* const to = detail::concurrent() && active_context ? &active_context->frame_pool : frame->pool;
+		to->free.emplace_back(frame);
+		frame = parent;
+	}
+}
+
+// argument vectors of native calls, a nested call takes the next one
+CellList_t& Interpreter::acquire_args()
+{
+	ExecContext& ctx = context();
+	if (ctx.arg_depth == ctx.arg_lists.size())
+	{
+		ctx.arg_lists.emplace_back();
+		count_allocation();
+	}
+	return ctx.arg_lists[ctx.arg_depth++];
+}
+
+void Interpreter::release_args()
+{
+	ExecContext& ctx = context();
+	ctx.arg_lists[--ctx.arg_depth].clear();
+}
+
+Cell Interpreter::apply(Lambda& fn, Environement* parent, Cell const* args, size_t argc)
+{
+	gc->poll();
+	ExecContext& ctx = context();
+	Environement* frame = ctx.frame_pool.acquire(fn, args, argc, parent);
+	Cell last;
+	if (mode == EvalMode::Bytecode)
+	{
+		last = ctx.vm->call(fn, *frame);
+	}
+	else
+	{
+		for (auto const& b : fn.body)
+			last = eval(b, *frame);
+	}
+	frame->release();
+	return last;
+}
+
+Cell Interpreter::call(Cell const& proc, CellSpan_t args)
+{
+	Output::Scope const scope(*out);
+	Heap::Scope const heap_scope(*gc);
+	ENSURE(proc.type == CellType::Proc, "%s is not a procedure !", to_string(proc.type));
+	ProcObj const& p = proc.as_proc();
+	if (profiler && !active_context)
+	{
+		profiler->enter(p.lambda ? static_cast<void const*>(p.lambda.get()) : &p, p.name);
+		Profiler* const prof = profiler;
+		Cell result = invoke(p, args);
+		prof->exit();
+		return result;
+	}
+
+	if (p.lambda)
+		return apply(*p.lambda, p.env, args.data(), args.size());
+	if (!p.accepts(args.size()))
+	{
+		arity_error(p, args.size());
+		return Cell();
+	}
+	if (p.memo)
+		return call_memo(p, args);
+	return p.fn(*this, args);
+}
+
+Cell Interpreter::invoke(ProcObj const& p, CellSpan_t args)
+{
+	if (p.lambda)
+		return apply(*p.lambda, p.env, args.data(), args.size());
+	if (!p.accepts(args.size()))
+	{
+		arity_error(p, args.size());
+		return Cell();
+	}
+	if (p.memo)
+		return call_memo(p, args);
+	return p.fn(*this, args);
+}
+
+Cell Interpreter::eval(Cell const& cell, Environement& env)
+{
+	if (isPrimitivetype(cell.type))
+		return cell;
+
+	if (cell.type == CellType::Symbol)
+		return lookup(cell, env);
+
+	if (cell.type != CellType::List)
+		return cell;
+
+	auto const list_value = cell.as_list();
+
+	if (list_value.empty())
+		return Cell();
+
+	Form const form = cell.form != Form::Unknown ? cell.form : decode_form(list_value);
+	switch (form)
+	{
+	case Form::Import:
+		ENSURE(list_value.size() > 1 && list_value[1].type == CellType::String, "a string literal must follow an import !");
+		return import_file(std::string(list_value[1].as_string()));
+	// the VM leaves the malformed forms to these cases, they report the errors of both
+	case Form::Set:
+	{
+		ENSURE(list_value.size() > 1 && list_value[1].type == CellType::Symbol, "a symbol must follow a set !");
+		Cell value = list_value.size() > 2 ? eval(list_value[2], env) : Cell();
+		assign(list_value[1], value, env);
+		return value;
+	}
+	case Form::Setg:
+	{
+		ENSURE(list_value.size() > 1 && list_value[1].type == CellType::Symbol, "a symbol must follow a setg !");
+		Cell value = list_value.size() > 2 ? eval(list_value[2], env) : Cell();
+		if (in_parallel_task("assign a global"))
+			return Cell();
+		sync_globals();
+		return global_env.slots[list_value[1].sym] = value;
+	}
+	case Form::If:
+		ENSURE(list_value.size() > 2, "an if takes a condition and a branch !");
+		if (eval(list_value[1], env).is_true())
+			return eval(list_value[2], env);
+		return list_value.size() > 3 ? eval(list_value[3], env) : Cell();
+	case Form::While:
+		ENSURE(list_value.size() > 1, "a while takes a condition !");
+		while (eval(list_value[1], env).is_true())
+		{
+			gc->poll();
+			for (auto const& b : detail::Range(list_value.begin() + 2, list_value.end()))
+				eval(b, env);
+		}
+		return Cell();
+	case Form::Defun:
 	{
-		Cell c = { CellType::Proc };
-		c.value = [](CellList_t const& args) {
-			ENSURE(args.size() == 1, "lenth only takes one argument !");
-			ENSURE(args[0].type == CellType::List, "length takes a list as argument !");
-			Cell ret = { CellType::Int };
-			ret.value = (CellIntegral_t) std::get<CellList_t>(args[0].value).size();
-			return ret;
+		// the resolver attaches no lambda to these, resolving them again would never end
+		ENSURE(list_value.size() > 2 && list_value[1].type == CellType::Symbol && list_value[2].type == CellType::List,
+			"malformed defun, a name and a list of params must follow it !");
+		Lambda* const lambda = static_cast<ListObj*>(cell.object)->lambda;
+		if (!lambda) // not produced by evalS, resolve a copy first
+		{
+			Cell resolved = clone_tree(cell);
+			resolve(resolved, env);
+			return eval(resolved, env);
+		}
+
+		Cell fun = make_proc(lambda, env);
+		assign(list_value[1], fun, env);
+		return fun;
+	}
+	case Form::Eval:
+		ENSURE(list_value.size() > 1 && list_value[1].type == CellType::String, "a string literal must follow an eval !");
+		return evalS(std::string(list_value[1].as_string()), env);
+	case Form::Profile:
+		return profile(list_value, [&] { return list_value.size() > 1 ? eval(list_value[1], env) : Cell(); });
+	default:
+		break;
+	}
+
+	Cell proc = eval(list_value[0], env);
+	CellList_t& exprs = acquire_args();
+	for (auto& expr : detail::Range(list_value.begin() + 1, list_value.end()))
+		exprs.push_back(eval(expr, env));
+
+	Cell result;
+	if (proc.type == CellType::Proc)
+		result = call(proc, exprs);
+	else if (list_value[0].type == CellType::Symbol)
+	{
+		detail::errors++;
+		out->printf("error : symbol %s undefined\n", symbols.name(list_value[0].sym).c_str());
+	}
+	else
+		runtime_error("%s is not a procedure !", to_string(proc.type));
+
+	release_args();
+	return result;
+}
+
+Cell Interpreter::evalS(std::string const& str)
+{
+	return evalS(str, global_env);
+}
+
+Cell Interpreter::evalS(std::string const& str, Environement& env)
+{
+	if (in_parallel_task("eval"))
+		return Cell();
+	Output::Scope const scope(*out);
+	Heap::Scope const heap_scope(*gc);
+	// the scope is shared with the interpreters of the base, eval could add names to it
+	ENSURE(!env.scope || !env.scope->frozen, "cannot eval in a function of a base environement !");
+
+	struct SourceText
+	{
+		Interpreter& interp;
+		Lexer lexer;
+
+		bool done() { return lexer.peek().type == TokenType::End; }
+		Cell read() { return interp.read_from(lexer); }
+	} source{ *this, Lexer(str) };
+
+	return eval_forms(source, env);
+}
+
+size_t Interpreter::read_forms(std::string_view source)
+{
+	Output::Scope const scope(*out);
+	Heap::Scope const heap_scope(*gc);
+	std::shared_ptr<Arena> const outer = std::move(arena);
+	arena = std::make_shared<Arena>();
+	Lexer lexer(source);
+	size_t count = 0;
+	while (lexer.peek().type != TokenType::End)
+	{
+		read_from(lexer);
+		count++;
+	}
+	arena = outer;
+	return count;
+}
+
+template<typename Source>
+Cell Interpreter::eval_forms(Source& source, Environement& env)
+{
+	std::shared_ptr<Arena> const outer = std::move(arena);
+	Cell last;
+	while (!source.done())
+	{
+		// the arena of the previous form is reused unless one of its procs is still alive
+		if (!arena || arena.use_count() > 1)
+			arena = std::make_shared<Arena>();
+		else
+			arena->reset();
+
+		gc->poll();
+		Cell form = source.read();
+		resolve(form, env);
+		if (opt_level > 0)
+			Optimizer(*this).optimize(form);
+		last = mode == EvalMode::Bytecode ? main_context.vm->eval(form, env) : eval(form, env);
+	}
+	arena = outer;
+	return last;
+}
+
+static CellType get_cellList_arithmetic_type(CellSpan_t list)
+{
+	for (auto const& c : list)
+	{
+		if (c.type == CellType::Float)
+		{
+			return CellType::Float;
+		}
+	}
+	return CellType::Int;
+}
+
+// ints compare exactly, a mixed pair is compared as doubles
+static bool less_than(Cell const& lhs, Cell const& rhs)
+{
+	if (lhs.type == CellType::Int && rhs.type == CellType::Int)
+		return lhs.as_int() < rhs.as_int();
+	return lhs.get_as_double() < rhs.get_as_double();
+}
+
+static Cell lessOp(Interpreter&, CellSpan_t args)
+{
+	ENSURE(args[0].type == CellType::Float || args[0].type == CellType::Int, "only numerical value can be compared !");
+	for (auto const& e : detail::Range(args.begin() + 1, args.end()))
+	{
+		ENSURE(e.type == CellType::Float || e.type == CellType::Int, "only numerical value can be compared !");
+		if (!less_than(args[0], e))
+			return Cell::make_bool(false);
+	}
+	return Cell::make_bool(true);
+}
+
+static Cell moreOp(Interpreter&, CellSpan_t args)
+{
+	ENSURE(args[0].type == CellType::Float || args[0].type == CellType::Int, "only numerical value can be compared !");
+	for (auto const& e : detail::Range(args.begin() + 1, args.end()))
+	{
+		ENSURE(e.type == CellType::Float || e.type == CellType::Int, "only numerical value can be compared !");
+		if (!less_than(e, args[0]))
+			return Cell::make_bool(false);
+	}
+	return Cell::make_bool(true);
+}
+
+static bool is_number(Cell const& c)
+{
+	return c.type == CellType::Int || c.type == CellType::Float;
+}
+
+// float vector when any item is a float
+static Cell vector_of(CellSpan_t items, const char* name)
+{
+	CellType const elem = get_cellList_arithmetic_type(items);
+	Cell v = Cell::make_vector(elem, items.size());
+	VectorObj& obj = v.as_vector();
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		ENSURE(is_number(items[i]), "%s takes numbers, got %s !", name, to_string(items[i].type));
+		if (elem == CellType::Float)
+			obj.floats()[i] = items[i].get_as_double();
+		else
+			obj.ints()[i] = items[i].as_int();
+	}
+	return v;
+}
+
+// ints of mixed vector ops are converted to doubles a block at a time, without allocating
+static constexpr size_t promote_block = 1024;
+
+static double const* promote(VectorObj& v, size_t first, size_t count, double* out)
+{
+	if (v.elem == CellType::Float)
+		return v.floats() + first;
+	std::copy(v.ints() + first, v.ints() + first + count, out);
+	return out;
+}
+
+// element-wise op of a vector with a vector of the same length or a number
+// ints are promoted when the other side is a float, comparisons give a mask of 0 and 1 and compare mixed values as doubles
+static Cell vector_op(simd::Op op, CellSpan_t args, const char* name)
+{
+	Cell const& a = args[0];
+	Cell const& b = args[1];
+	ENSURE(a.type == CellType::Vector, "first arg of %s must be a vector !", name);
+	ENSURE(b.type == CellType::Vector || is_number(b), "second arg of %s must be a vector or a number !", name);
+	VectorObj& va = a.as_vector();
+	bool const b_scalar = b.type != CellType::Vector;
+	ENSURE(b_scalar || b.as_vector().size == va.size, "%s takes vectors of the same length, got %u and %u !", name, va.size, b.as_vector().size);
+
+	CellType const b_elem = b_scalar ? b.type : b.as_vector().elem;
+	bool const compare = op == simd::Op::Lt || op == simd::Op::Gt || op == simd::Op::Eq;
+	bool const floats = op == simd::Op::Div || va.elem == CellType::Float || b_elem == CellType::Float;
+	auto const& kernels = simd::kernels();
+	CellType const out_elem = compare || !floats ? CellType::Int : CellType::Float;
+	// a lhs that nothing else references is a temporary, its buffer is reused for the result
+	Cell out = a.object->unique() && va.elem == out_elem ? a : Cell::make_vector(out_elem, va.size);
+	VectorObj& vo = out.as_vector();
+
+	if (!floats)
+	{
+		int64_t const scalar = b_scalar ? b.as_int() : 0;
+		int64_t const* const pb = b_scalar ? &scalar : b.as_vector().ints();
+		(compare ? kernels.i64_compare : kernels.i64_arith)(op, va.ints(), pb, b_scalar, vo.ints(), va.size);
+		return out;
+	}
+
+	double const scalar = b_scalar ? b.get_as_double() : 0.0;
+	double block_a[promote_block], block_b[promote_block];
+	for (size_t first = 0; first < va.size; first += promote_block)
+	{
+		size_t const count = std::min<size_t>(promote_block, va.size - first);
+		double const* const pa = promote(va, first, count, block_a);
+		double const* const pb = b_scalar ? &scalar : promote(b.as_vector(), first, count, block_b);
+		if (compare)
+			kernels.f64_compare(op, pa, pb, b_scalar, vo.ints() + first, count);
+		else
+			kernels.f64_arith(op, pa, pb, b_scalar, vo.floats() + first, count);
+	}
+	return out;
+}
+
+// min or max of a vector, or of numbers
+template<bool Max>
+static Cell extremum(CellSpan_t args, const char* name)
+{
+	if (args.size() == 1 && args[0].type == CellType::Vector)
+	{
+		VectorObj& v = args[0].as_vector();
+		ENSURE(v.size > 0, "%s of an empty vector !", name);
+		auto const& kernels = simd::kernels();
+		if (v.elem == CellType::Int)
+			return Cell::make_int((CellIntegral_t)(Max ? kernels.i64_max : kernels.i64_min)(v.ints(), v.size));
+		return Cell::make_float((Max ? kernels.f64_max : kernels.f64_min)(v.floats(), v.size));
+	}
+
+	size_t best = 0;
+	for (size_t i = 0; i < args.size(); i++)
+	{
+		ENSURE(is_number(args[i]), "%s takes a vector or numbers, got %s !", name, to_string(args[i].type));
+		if (Max ? less_than(args[best], args[i]) : less_than(args[i], args[best]))
+			best = i;
+	}
+	return args[best];
+}
+
+// two argument kernels of the numeric builtins, they follow the generic versions exactly
+template<typename Op>
+struct Arithmetic
+{
+	static Cell int_int(Cell const& a, Cell const& b) { return Cell::make_int(Op{}(a.int_value, b.int_value)); }
+	static Cell float_float(Cell const& a, Cell const& b) { return Cell::make_float(Op{}(a.float_value, b.float_value)); }
+	static Cell mixed(Cell const& a, Cell const& b) { return Cell::make_float(Op{}(a.get_as_double(), b.get_as_double())); }
+	static constexpr BinaryKernels kernels{ int_int, float_float, mixed };
+};
+
+struct Divide
+{
+	static Cell any(Cell const& a, Cell const& b) { return Cell::make_float(a.get_as_double() / b.get_as_double()); }
+	static constexpr BinaryKernels kernels{ any, any, any };
+};
+
+// integral modulo of the kernel and the builtin, INT64_MIN % -1 overflows the division behind it
+static Cell int_modulo(CellIntegral_t a, CellIntegral_t b)
+{
+	ENSURE(b != 0, "division by zero !");
+	return Cell::make_int(b == -1 ? 0 : a % b);
+}
+
+struct Modulo
+{
+	static Cell int_int(Cell const& a, Cell const& b) { return int_modulo(a.int_value, b.int_value); }
+	static Cell other(Cell const& a, Cell const& b) { return Cell::make_float(fmod(a.get_as_double(), b.get_as_double())); }
+	static constexpr BinaryKernels kernels{ int_int, other, other };
+};
+
+// Swap compares b to a, Negate inverts the result, which gives < > >= <=
+template<bool Swap, bool Negate>
+struct Comparison
+{
+	static Cell int_int(Cell const& a, Cell const& b) { return Cell::make_bool(Negate != (Swap ? b.int_value < a.int_value : a.int_value < b.int_value)); }
+	static Cell float_float(Cell const& a, Cell const& b) { return Cell::make_bool(Negate != (Swap ? b.float_value < a.float_value : a.float_value < b.float_value)); }
+	static Cell mixed(Cell const& a, Cell const& b) { return Cell::make_bool(Negate != (Swap ? b.get_as_double() < a.get_as_double() : a.get_as_double() < b.get_as_double())); }
+	static constexpr BinaryKernels kernels{ int_int, float_float, mixed };
+};
+
+struct Equal
+{
+	static Cell int_int(Cell const& a, Cell const& b) { return Cell::make_bool(a.int_value == b.int_value); }
+	static Cell float_float(Cell const& a, Cell const& b) { return Cell::make_bool(a.float_value == b.float_value); }
+	static Cell mixed(Cell const&, Cell const&) { return Cell::make_bool(false); } // values of different types are never equal
+	static constexpr BinaryKernels kernels{ int_int, float_float, mixed };
+};
+
+ExecContext::ExecContext(Interpreter& interp) : vm(std::make_unique<VM>(interp, frame_pool))
+{
+}
+
+ExecContext::~ExecContext() = default;
+
+ExecContext& Interpreter::context() noexcept
+{
+	return active_context ? *active_context : main_context;
+}
+
+bool Interpreter::in_parallel_task(const char* what) const
+{
+	if (!active_context)
+		return false;
+	runtime_error("cannot %s in a parallel task, the globals are read only there !", what);
+	return true;
+}
+
+Cell Interpreter::call_memo(ProcObj const& p, CellSpan_t args)
+{
+	MemoCache& memo = *p.memo;
+	if (memo.frozen || active_context)
+		return call(memo.proc, args);
+
+	Cell result;
+	if (memo.find(args, result))
+		return result;
+	uint64_t const errors = detail::errors;
+	result = call(memo.proc, args);
+	if (detail::errors == errors)
+		memo.insert(args, result);
+	return result;
+}
+
+Profiler* Interpreter::active_profiler() const noexcept
+{
+	return active_context ? nullptr : profiler;
+}
+
+Cell Interpreter::profile(CellSpan_t form, std::function<Cell()> const& body)
+{
+	ENSURE(form.size() >= 2 && form.size() <= 4, "profile takes an expression, then optionally a file and an interval !");
+	ENSURE(form.size() < 3 || form[2].type == CellType::String, "the file of a profile must be a string literal !");
+	ENSURE(form.size() < 4 || (form[3].type == CellType::Int && form[3].as_int() > 0),
+		"the sampling interval of a profile must be a positive integral literal, in microseconds !");
+
+	// inside another profile the calls are already recorded
+	if (profiler || active_context)
+		return body();
+
+	Profiler prof(form.size() > 3 ? std::chrono::microseconds(form[3].as_int()) : std::chrono::microseconds(1000));
+	profiler = &prof;
+	Cell result = body();
+	profiler = nullptr;
+	prof.finish();
+
+	// the report goes after what the code printed
+	out->flush();
+	prof.write_report(stdout);
+	if (form.size() > 2)
+	{
+		std::string const file_name(form[2].as_string());
+		if (FILE* out = fopen(file_name.c_str(), "w"))
+		{
+			prof.write_collapsed(out);
+			fclose(out);
+		}
+		else
+		{
+			runtime_error("cannot write %s !", file_name.c_str());
+		}
+	}
+	return result;
+}
+
+size_t Interpreter::threads() const noexcept
+{
+	if (pool_size)
+		return pool_size;
+	return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+void Interpreter::set_threads(size_t count)
+{
+	pool_size = std::max<size_t>(count, 1);
+	if (pool && pool->size() != pool_size)
+		pool.reset();
+}
+
+void Interpreter::parallel_for(size_t count, std::function<void(size_t, size_t)> const& body)
+{
+	// a task calling a parallel builtin runs it itself
+	if (active_context)
+	{
+		body(0, count);
+		return;
+	}
+
+	size_t const n = threads();
+	if (!pool || pool->size() != n)
+	{
+		pool.reset();
+		pool = std::make_unique<WorkPool>(n);
+	}
+	while (worker_contexts.size() + 1 < n)
+		worker_contexts.push_back(std::make_unique<ExecContext>(*this));
+
+	// small enough ranges that the stealing can balance uneven items
+	size_t const grain = std::max<size_t>(1, count / (n * 16));
+	// the calling thread shares its objects for the whole job, the workers while they run a range
+	bool const shared = n > 1;
+	detail::shared_objects = shared;
+	pool->run(count, grain, [&](size_t worker, size_t begin, size_t end) {
+		detail::shared_objects = shared;
+		Output::Scope const scope(*out);
+		Heap::Scope const heap_scope(*gc);
+		active_context = worker == 0 ? &main_context : worker_contexts[worker - 1].get();
+		task_token = task_tokens.fetch_add(1, std::memory_order_relaxed) + 1;
+		body(begin, end);
+		active_context = nullptr;
+		task_token = 0;
+		detail::shared_objects = worker == 0 && shared;
+	});
+	detail::shared_objects = false;
+}
+
+// maps of a base environement are read by all of its interpreters, shared ones by the tasks of a parallel job
+static bool map_writable(Cell const& map, const char* name)
+{
+	if (map.object->refcount.load(std::memory_order_relaxed) >= Object::immortal)
+	{
+		runtime_error("%s cannot modify a map of a base environement !", name);
+		return false;
+	}
+	if (detail::concurrent() && map.as_map().task != task_token)
+	{
+		runtime_error("%s cannot modify a map shared by the tasks of a parallel job !", name);
+		return false;
+	}
+	return true;
+}
+
+// results kept by memoize when no capacity is given
+static constexpr size_t default_memo_capacity = 4096;
+
+Interpreter::Interpreter() : gc(std::make_unique<Heap>()), main_context(*this), out(std::make_unique<Output>())
+{
+	forms.import = symbols.intern("import");
+	forms.set = symbols.intern("set");
+	forms.setg = symbols.intern("setg");
+	forms.if_ = symbols.intern("if");
+	forms.while_ = symbols.intern("while");
+	forms.defun = symbols.intern("defun");
+	forms.eval = symbols.intern("eval");
+	forms.profile = symbols.intern("profile");
+
+	set_global("list", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		return Cell::make_list(args.data(), args.size());
+	}, "list"));
+
+	// (set s (strcat s x)) appends to the buffer of s in place
+	set_global("strcat", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		if (args.empty())
+			return Cell::make_string({});
+		return Cell::concat(args[0], args.data() + 1, args.size() - 1);
+	}, "strcat"));
+
+	set_global("+", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		CellType sumType = get_cellList_arithmetic_type(args);
+		if (sumType == CellType::Float)
+		{
+			CellFloat_t sum = 0.0;
+			for (auto const& c : args)
+			{
+				ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be sumed !");
+				if (c.type == CellType::Float)
+					sum += c.as_float();
+				else
+					sum += c.as_int();
+			}
+			return Cell::make_float(sum);
+		}
+		{ // SumType == Int
+			CellIntegral_t sum = 0;
+			for (auto const& c : args)
+			{
+				ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be sumed !");
+				sum += c.as_int();
+			}
+			return Cell::make_int(sum);
+		}
+	}, "+"));
+
+	set_global("-", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Float || args[0].type == CellType::Int, "only numerical value can be sumed !");
+		CellType sumType = get_cellList_arithmetic_type(args);
+		if (sumType == CellType::Float)
+		{
+			CellFloat_t sum = args[0].get_as_double();
+			for (auto const& c : detail::Range(args.begin() + 1, args.end()))
+			{
+				ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be sumed !");
+				if (c.type == CellType::Float)
+					sum -= c.as_float();
+				else
+					sum -= c.as_int();
+			}
+			return Cell::make_float(sum);
+		}
+		{ // SumType == Int
+			CellIntegral_t sum = args[0].as_int();
+			for (auto const& c : detail::Range(args.begin() + 1, args.end()))
+			{
+				ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be sumed !");
+				sum -= c.as_int();
+			}
+			return Cell::make_int(sum);
+		}
+	}, "-", 1));
+
+	set_global("*", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		CellType sumType = get_cellList_arithmetic_type(args);
+		if (sumType == CellType::Float)
+		{
+			CellFloat_t sum = 1.0;
+			for (auto const& c : args)
+			{
+				ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be multiplied !");
+				if (c.type == CellType::Float)
+					sum *= c.as_float();
+				else
+					sum *= c.as_int();
+			}
+			return Cell::make_float(sum);
+		}
+		{ // SumType == Int
+			CellIntegral_t sum = 1;
+			for (auto const& c : args)
+			{
+				ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be multiplied !");
+				sum *= c.as_int();
+			}
+			return Cell::make_int(sum);
+		}
+	}, "*"));
+
+	set_global("/", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Float || args[0].type == CellType::Int, "only numerical value can be divided !");
+
+		CellFloat_t sum = args[0].get_as_double();
+		for (auto const& c : detail::Range(args.begin() + 1, args.end()))
+		{
+			ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be divided !");
+			sum /= c.get_as_double();
+		}
+		return Cell::make_float(sum);
+	}, "/", 1));
+
+	set_global("<", Cell::make_proc(lessOp, "<", 1));
+	set_global(">", Cell::make_proc(moreOp, ">", 1));
+
+	set_global(">=", Cell::make_proc([](Interpreter& interp, CellSpan_t args) {
+		Cell r = lessOp(interp, args);
+		return Cell::make_bool(!r.as_bool());
+	}, ">=", 1));
+
+	set_global("<=", Cell::make_proc([](Interpreter& interp, CellSpan_t args) {
+		Cell r = moreOp(interp, args);
+		return Cell::make_bool(!r.as_bool());
+	}, "<=", 1));
+
+	set_global("=", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		bool r = true;
+		for (auto const& arg : detail::Range(args.begin() + 1, args.end()))
+			r &= cell_value_equal(args[0], arg);
+		return Cell::make_bool(r);
+	}, "=", 1));
+
+	set_global("%", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		for (auto const& c : args)
+			ENSURE(c.type == CellType::Float || c.type == CellType::Int, "only numerical value can be divided !");
+		if (get_cellList_arithmetic_type(args) == CellType::Int)
+			return int_modulo(args[0].get_as_int(), args[1].get_as_int());
+		return Cell::make_float(fmod(args[0].get_as_double(), args[1].get_as_double()));
+	}, "%", 2, 2));
+
+	set_global("println", Cell::make_proc([](Interpreter& interp, CellSpan_t args) {
+		interp.output().append([&](std::string& text) {
+			for (auto const& a : args)
+			{
+				format_cell(text, a);
+				text += '\n';
+			}
+		});
+		return Cell();
+	}, "println"));
+
+	set_global("print", Cell::make_proc([](Interpreter& interp, CellSpan_t args) {
+		interp.output().append([&](std::string& text) {
+			for (auto const& a : args)
+				format_cell(text, a);
+		});
+		return Cell();
+	}, "print"));
+
+	set_global("clock", Cell::make_proc([](Interpreter&, CellSpan_t) {
+		auto const now = std::chrono::steady_clock::now().time_since_epoch();
+		return Cell::make_float(std::chrono::duration<CellFloat_t>(now).count());
+	}, "clock", 0, 0));
+
+	set_global("true", Cell::make_bool(true));
+	set_global("false", Cell::make_bool(false));
+	set_global("null", Cell());
+
+	set_global("length", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		if (args[0].type == CellType::Vector)
+			return Cell::make_int((CellIntegral_t)args[0].as_vector().size);
+		if (args[0].type == CellType::Map)
+			return Cell::make_int((CellIntegral_t)args[0].as_map().size());
+		ENSURE(args[0].type == CellType::List, "length takes a list, a vector or a map as argument !");
+		return Cell::make_int((CellIntegral_t)args[0].as_list().size());
+	}, "length", 1, 1));
+
+	set_global("return", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		return args.empty() ? Cell() : args[0];
+	}, "return", 0, 1));
+
+	set_global("append", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::List || args[0].type == CellType::Null, "first arg of append must be a list or Null!");
+
+		return Cell::append(args[0], args.data() + 1, args.size() - 1);
+	}, "append", 1));
+
+	set_global("get", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::List || args[0].type == CellType::Vector, "first arg of get must be a list or a vector !");
+		ENSURE(args[1].type == CellType::Int, "second arg of get must be an integral !");
+		bool const vector = args[0].type == CellType::Vector;
+		CellIntegral_t const size = vector ? args[0].as_vector().size : args[0].count;
+		ENSURE(args[1].as_int() >= 0 && args[1].as_int() < size, "get index %ld out of range !", args[1].as_int());
+
+		if (vector)
+			return args[0].as_vector().get(args[1].as_int());
+		return args[0].as_list()[args[1].as_int()];
+	}, "get", 2, 2));
+
+	set_global("alloc_count", Cell::make_proc([](Interpreter&, CellSpan_t) {
+		return Cell::make_int((CellIntegral_t)allocation_count());
+	}, "alloc_count", 0, 0));
+
+	// frees the garbage cycles now, returns how many objects and frames went
+	set_global("gc", Cell::make_proc([](Interpreter& interp, CellSpan_t) {
+		if (interp.in_parallel_task("collect"))
+			return Cell();
+		return Cell::make_int((CellIntegral_t)interp.heap().collect());
+	}, "gc", 0, 0));
+
+	// collections, objects tracked, objects tracked in total, objects and frames freed, total and longest pause in ms
+	set_global("gc_stats", Cell::make_proc([](Interpreter& interp, CellSpan_t) {
+		HeapStats const& stats = interp.heap().stats();
+		Cell const values[] = {
+			Cell::make_int((CellIntegral_t)stats.collections),
+			Cell::make_int((CellIntegral_t)interp.heap().size()),
+			Cell::make_int((CellIntegral_t)stats.tracked),
+			Cell::make_int((CellIntegral_t)stats.freed),
+			Cell::make_float(std::chrono::duration<double, std::milli>(stats.pause_total).count()),
+			Cell::make_float(std::chrono::duration<double, std::milli>(stats.pause_max).count()),
+		};
+		return Cell::make_list(values, std::size(values));
+	}, "gc_stats", 0, 0));
+
+	set_global("cpu_count", Cell::make_proc([](Interpreter&, CellSpan_t) {
+		return Cell::make_int((CellIntegral_t)std::max(std::thread::hardware_concurrency(), 1u));
+	}, "cpu_count", 0, 0));
+
+	set_global("set_threads", Cell::make_proc([](Interpreter& interp, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Int && args[0].as_int() > 0, "set_threads takes a positive integral !");
+		if (interp.in_parallel_task("set_threads"))
+			return Cell();
+		interp.set_threads((size_t)args[0].as_int());
+		return Cell();
+	}, "set_threads", 1, 1));
+
+	// (pmap list proc), the results keep the order of the items
+	set_global("pmap", Cell::make_proc([](Interpreter& interp, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::List || args[0].type == CellType::Null, "first arg of pmap must be a list !");
+		ENSURE(args[1].type == CellType::Proc, "second arg of pmap must be a procedure !");
+		CellSpan_t const items = args[0].type == CellType::List ? args[0].as_list() : CellSpan_t{};
+		Cell out = Cell::make_list(nullptr, items.size());
+		detail::Span<Cell> const results = out.as_list_mut();
+		interp.parallel_for(items.size(), [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				results[i] = interp.call(args[1], CellSpan_t(&items[i], 1));
+		});
+		return out;
+	}, "pmap", 2, 2));
+
+	// (pfilter list pred), the items pred is true for in their order
+	set_global("pfilter", Cell::make_proc([](Interpreter& interp, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::List || args[0].type == CellType::Null, "first arg of pfilter must be a list !");
+		ENSURE(args[1].type == CellType::Proc, "second arg of pfilter must be a procedure !");
+		CellSpan_t const items = args[0].type == CellType::List ? args[0].as_list() : CellSpan_t{};
+		std::vector<uint8_t> keep(items.size());
+		interp.parallel_for(items.size(), [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				keep[i] = interp.call(args[1], CellSpan_t(&items[i], 1)).is_true();
+		});
+
+		Cell out = Cell::make_list(nullptr, 0, std::count(keep.begin(), keep.end(), 1));
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			if (keep[i])
+				out = Cell::append(out, &items[i], 1);
+		}
+		return out;
+	}, "pfilter", 2, 2));
+
+	// (preduce list proc init), proc must be associative: ranges are reduced apart, then their results from init in order
+	set_global("preduce", Cell::make_proc([](Interpreter& interp, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::List || args[0].type == CellType::Null, "first arg of preduce must be a list !");
+		ENSURE(args[1].type == CellType::Proc, "second arg of preduce must be a procedure !");
+		CellSpan_t const items = args[0].type == CellType::List ? args[0].as_list() : CellSpan_t{};
+		std::mutex lock;
+		std::vector<std::pair<size_t, Cell>> partials;
+		interp.parallel_for(items.size(), [&](size_t begin, size_t end) {
+			Cell acc = items[begin];
+			for (size_t i = begin + 1; i < end; i++)
+			{
+				Cell const pair[2] = { acc, items[i] };
+				acc = interp.call(args[1], CellSpan_t(pair, 2));
+			}
+			std::lock_guard<std::mutex> guard(lock);
+			partials.emplace_back(begin, std::move(acc));
+		});
+
+		std::sort(partials.begin(), partials.end(), [](auto const& a, auto const& b) { return a.first < b.first; });
+		Cell acc = args[2];
+		for (auto const& partial : partials)
+		{
+			Cell const pair[2] = { acc, partial.second };
+			acc = interp.call(args[1], CellSpan_t(pair, 2));
+		}
+		return acc;
+	}, "preduce", 3, 3));
+
+	set_global("vector", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		return vector_of(args, "vector");
+	}, "vector"));
+
+	set_global("to_vector", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::List || args[0].type == CellType::Null, "to_vector takes a list as argument !");
+		return vector_of(args[0].type == CellType::List ? args[0].as_list() : CellSpan_t{}, "to_vector");
+	}, "to_vector", 1, 1));
+
+	set_global("to_list", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Vector, "to_list takes a vector as argument !");
+		VectorObj& v = args[0].as_vector();
+		Cell list = Cell::make_list(nullptr, v.size);
+		for (uint32_t i = 0; i < v.size; i++)
+			list.as_list_mut()[i] = v.get(i);
+		return list;
+	}, "to_list", 1, 1));
+
+	// (range n) or (range start end), ints from start included to end excluded
+	set_global("range", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		for (auto const& arg : args)
+			ENSURE(arg.type == CellType::Int, "range takes integrals !");
+		int64_t const start = args.size() == 2 ? args[0].as_int() : 0;
+		int64_t const end = args[args.size() - 1].as_int();
+		ENSURE(end - start <= (int64_t)UINT32_MAX, "range of %lld elements is too large !", (long long)(end - start));
+		Cell v = Cell::make_vector(CellType::Int, (size_t)std::max<int64_t>(end - start, 0));
+		std::iota(v.as_vector().ints(), v.as_vector().ints() + v.as_vector().size, start);
+		return v;
+	}, "range", 1, 2));
+
+	set_global("v+", Cell::make_proc([](Interpreter&, CellSpan_t args) { return vector_op(simd::Op::Add, args, "v+"); }, "v+", 2, 2));
+	set_global("v-", Cell::make_proc([](Interpreter&, CellSpan_t args) { return vector_op(simd::Op::Sub, args, "v-"); }, "v-", 2, 2));
+	set_global("v*", Cell::make_proc([](Interpreter&, CellSpan_t args) { return vector_op(simd::Op::Mul, args, "v*"); }, "v*", 2, 2));
+	set_global("v/", Cell::make_proc([](Interpreter&, CellSpan_t args) { return vector_op(simd::Op::Div, args, "v/"); }, "v/", 2, 2));
+	set_global("v<", Cell::make_proc([](Interpreter&, CellSpan_t args) { return vector_op(simd::Op::Lt, args, "v<"); }, "v<", 2, 2));
+	set_global("v>", Cell::make_proc([](Interpreter&, CellSpan_t args) { return vector_op(simd::Op::Gt, args, "v>"); }, "v>", 2, 2));
+	set_global("v=", Cell::make_proc([](Interpreter&, CellSpan_t args) { return vector_op(simd::Op::Eq, args, "v="); }, "v=", 2, 2));
+
+	set_global("sum", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Vector, "sum takes a vector as argument !");
+		VectorObj& v = args[0].as_vector();
+		if (v.elem == CellType::Int)
+			return Cell::make_int((CellIntegral_t)simd::kernels().i64_sum(v.ints(), v.size));
+		return Cell::make_float(simd::kernels().f64_sum(v.floats(), v.size));
+	}, "sum", 1, 1));
+
+	set_global("dot", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Vector && args[1].type == CellType::Vector, "dot takes two vectors !");
+		VectorObj& a = args[0].as_vector();
+		VectorObj& b = args[1].as_vector();
+		ENSURE(a.size == b.size, "dot takes vectors of the same length, got %u and %u !", a.size, b.size);
+		if (a.elem == CellType::Int && b.elem == CellType::Int)
+			return Cell::make_int((CellIntegral_t)simd::kernels().i64_dot(a.ints(), b.ints(), a.size));
+		if (a.elem == CellType::Float && b.elem == CellType::Float)
+			return Cell::make_float(simd::kernels().f64_dot(a.floats(), b.floats(), a.size));
+
+		double block_a[promote_block], block_b[promote_block];
+		double sum = 0.0;
+		for (size_t first = 0; first < a.size; first += promote_block)
+		{
+			size_t const count = std::min<size_t>(promote_block, a.size - first);
+			sum += simd::kernels().f64_dot(promote(a, first, count, block_a), promote(b, first, count, block_b), count);
+		}
+		return Cell::make_float(sum);
+	}, "dot", 2, 2));
+
+	set_global("min", Cell::make_proc([](Interpreter&, CellSpan_t args) { return extremum<false>(args, "min"); }, "min", 1));
+	set_global("max", Cell::make_proc([](Interpreter&, CellSpan_t args) { return extremum<true>(args, "max"); }, "max", 1));
+
+	set_global("memoize", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Proc, "memoize takes a procedure !");
+		ENSURE(args.size() < 2 || (args[1].type == CellType::Int && args[1].as_int() >= 0),
+			"the capacity of memoize must be a positive integral, or 0 for no bound !");
+		ProcObj const& target = args[0].as_proc();
+		Cell memo = Cell::make_proc(nullptr, target.name, target.min_args, target.max_args);
+		memo.as_proc().memo = std::make_shared<MemoCache>(args[0], args.size() > 1 ? (size_t)args[1].as_int() : default_memo_capacity);
+		return memo;
+	}, "memoize", 1, 2));
+
+	// hits, misses, evictions, size, capacity and hit rate of the cache of a memoized proc
+	set_global("memo_stats", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Proc && args[0].as_proc().memo, "memo_stats takes a procedure made by memoize !");
+		MemoCache const& memo = *args[0].as_proc().memo;
+		Cell const stats[] = {
+			Cell::make_int((CellIntegral_t)memo.hits()),
+			Cell::make_int((CellIntegral_t)memo.misses()),
+			Cell::make_int((CellIntegral_t)memo.evictions()),
+			Cell::make_int((CellIntegral_t)memo.size()),
+			Cell::make_int((CellIntegral_t)memo.capacity()),
+			Cell::make_float(memo.hit_rate()),
 		};
-		global_env.symbols["length"] = c;
+		return Cell::make_list(stats, std::size(stats));
+	}, "memo_stats", 1, 1));
+
+	set_global("memo_clear", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Proc && args[0].as_proc().memo, "memo_clear takes a procedure made by memoize !");
+		args[0].as_proc().memo->clear();
+		return Cell();
+	}, "memo_clear", 1, 1));
+
+	// (map key value ...)
+	set_global("map", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args.size() % 2 == 0, "map takes keys each followed by its value !");
+		Cell map = Cell::make_map(args.size() / 2);
+		for (size_t i = 0; i < args.size(); i += 2)
+		{
+			ENSURE(MapObj::valid_key(args[i]), "keys of a map must be strings, integrals or symbols, got %s !", to_string(args[i].type));
+			map.as_map().set(args[i], args[i + 1]);
+		}
+		return map;
+	}, "map"));
+
+	// (map_get map key [default]), null or default when the key is not in the map
+	set_global("map_get", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Map, "first arg of map_get must be a map !");
+		Cell const* value = args[0].as_map().find(args[1]);
+		if (value)
+			return *value;
+		return args.size() > 2 ? args[2] : Cell();
+	}, "map_get", 2, 3));
+
+	set_global("map_set", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Map, "first arg of map_set must be a map !");
+		ENSURE(MapObj::valid_key(args[1]), "keys of a map must be strings, integrals or symbols, got %s !", to_string(args[1].type));
+		if (!map_writable(args[0], "map_set"))
+			return Cell();
+		args[0].as_map().set(args[1], args[2]);
+		return args[0];
+	}, "map_set", 3, 3));
+
+	set_global("map_has", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Map, "first arg of map_has must be a map !");
+		return Cell::make_bool(args[0].as_map().find(args[1]) != nullptr);
+	}, "map_has", 2, 2));
+
+	// true when the key was in the map
+	set_global("map_remove", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Map, "first arg of map_remove must be a map !");
+		if (!map_writable(args[0], "map_remove"))
+			return Cell();
+		return Cell::make_bool(args[0].as_map().remove(args[1]));
+	}, "map_remove", 2, 2));
+
+	// keys, values and (key value) pairs in the order the keys were added
+	set_global("map_keys", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Map, "map_keys takes a map as argument !");
+		CellList_t keys;
+		keys.reserve(args[0].as_map().size());
+		args[0].as_map().each([&](Cell const& key, Cell const&) { keys.push_back(key); });
+		return Cell::make_list(std::move(keys));
+	}, "map_keys", 1, 1));
+
+	set_global("map_values", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Map, "map_values takes a map as argument !");
+		CellList_t values;
+		values.reserve(args[0].as_map().size());
+		args[0].as_map().each([&](Cell const&, Cell const& value) { values.push_back(value); });
+		return Cell::make_list(std::move(values));
+	}, "map_values", 1, 1));
+
+	set_global("map_items", Cell::make_proc([](Interpreter&, CellSpan_t args) {
+		ENSURE(args[0].type == CellType::Map, "map_items takes a map as argument !");
+		CellList_t items;
+		items.reserve(args[0].as_map().size());
+		args[0].as_map().each([&](Cell const& key, Cell const& value) {
+			Cell const pair[] = { key, value };
+			items.push_back(Cell::make_list(pair, 2));
+		});
+		return Cell::make_list(std::move(items));
+	}, "map_items", 1, 1));
+
+	// hands what was printed to the sink of the output now, instead of when the buffer is full
+	set_global("flush", Cell::make_proc([](Interpreter& interp, CellSpan_t) {
+		interp.output().flush();
+		return Cell();
+	}, "flush", 0, 0));
+
+	auto set_kernels = [this](std::string_view name, BinaryKernels const& kernels) {
+		get_global(name).as_proc().kernels = &kernels;
+	};
+	set_kernels("+", Arithmetic<std::plus<>>::kernels);
+	set_kernels("-", Arithmetic<std::minus<>>::kernels);
+	set_kernels("*", Arithmetic<std::multiplies<>>::kernels);
+	set_kernels("/", Divide::kernels);
+	set_kernels("%", Modulo::kernels);
+	set_kernels("<", Comparison<false, false>::kernels);
+	set_kernels(">", Comparison<true, false>::kernels);
+	set_kernels(">=", Comparison<false, true>::kernels);
+	set_kernels("<=", Comparison<true, true>::kernels);
+	set_kernels("=", Equal::kernels);
+
+	for (std::string_view name : { "+", "-", "*", "/", "%", "<", ">", ">=", "<=", "=" })
+		get_global(name).as_proc().pure = true;
+}
+
+Interpreter::Interpreter(std::shared_ptr<BaseEnvironement const> from)
+	: symbols(&from->loader->symbols), base(std::move(from)), gc(std::make_unique<Heap>()), imported_files(base->loader->imported_files),
+	natives(base->loader->natives), main_context(*this), out(std::make_unique<Output>()),
+	forms(base->loader->forms)
+{
+	// the objects of the base are immortal, its globals are copied without touching them
+	global_env.slots = base->loader->global_env.slots;
+	base_caches.resize(base->cache_count);
+}
+
+Interpreter::~Interpreter()
+{
+	// globals can hold closures, release their frames while the pool is alive, with the cycles they were part of
+	global_env.slots.clear();
+	gc->collect();
+}
+
+BaseEnvironement::BaseEnvironement(std::function<void(Interpreter&)> const& setup) : loader(std::make_unique<Interpreter>())
+{
+	if (setup)
+		setup(*loader);
+
+	// a first walk compiles the lambdas, their constants are counted before the second walk records the reference counts
+	loader->sync_globals();
+	for (bool const mark : { false, true })
+	{
+		marking = mark;
+		for (auto const& c : loader->global_env.slots)
+			freeze(c);
+		frozen.clear();
+	}
+	loader->pool.reset();
+}
+
+BaseEnvironement::~BaseEnvironement()
+{
+	// no interpreter is left, the loader releases the objects as usual
+	for (auto const& [obj, refs] : objects)
+		obj->refcount.store(refs, std::memory_order_relaxed);
+	for (auto const& [frame, refs] : frames)
+		frame->refcount.store(refs, std::memory_order_relaxed);
+}
+
+void BaseEnvironement::freeze(Cell const& cell)
+{
+	if (!cell.is_object() || !frozen.insert(cell.object).second)
+		return;
+
+	uint32_t const refs = cell.object->refcount.load(std::memory_order_relaxed);
+	if (marking && refs < Object::immortal)
+	{
+		objects.emplace_back(cell.object, refs);
+		cell.object->refcount.store(Object::immortal, std::memory_order_relaxed);
 	}
+
+	if (cell.type == CellType::List)
 	{
-		Cell c = { CellType::Proc };
-		c.value = [](CellList_t const& args) {
-			return args[0];
-		};
-		global_env.symbols["return"] = c;
+		auto list = static_cast<ListObj*>(cell.object);
+		// interpreters must not fill the spare capacity of a shared list, appends copy it
+		if (marking)
+			list->capacity = list->size;
+		for (uint32_t i = 0; i < list->size; i++)
+			freeze(list->items()[i]);
+	}
+	else if (cell.type == CellType::Proc)
+	{
+		ProcObj const& p = cell.as_proc();
+		if (p.lambda)
+			freeze(*p.lambda->arena);
+		freeze(p.env);
+		// the cache would be written by every interpreter of the base, they call the proc instead
+		if (p.memo)
+		{
+			freeze(p.memo->proc);
+			if (marking)
+				p.memo->frozen = true;
+		}
 	}
+	else if (cell.type == CellType::Map)
 	{
-		Cell c = { CellType::Proc };
-		c.value = [](CellList_t const& args) {
-			ENSURE(args[0].type == CellType::List || args[0].type == CellType::Null, "first arg of append must be a list or Null!");
-			Cell ret = { CellType::List };
+		cell.as_map().each([&](Cell const& key, Cell const& value) {
+			freeze(key);
+			freeze(value);
+		});
+	}
+}
 
-			if (args[0].type == CellType::List)
-				ret.value = CellList_t(std::get<CellList_t>(args[0].value));
-			else
-				ret.value = CellList_t();
+void BaseEnvironement::freeze(Environement* frame)
+{
+	for (; frame && frozen.insert(frame).second; frame = frame->parent)
+	{
+		if (marking)
+		{
+			frames.emplace_back(frame, frame->refcount.load(std::memory_order_relaxed));
+			frame->refcount.store(Object::immortal, std::memory_order_relaxed);
+		}
+		for (auto const& c : frame->slots)
+			freeze(c);
+	}
+}
 
-			std::get<CellList_t>(ret.value).reserve(std::get<CellList_t>(ret.value).size() + args.size() - 1);
-			for (size_t i = 1; i < args.size(); i++)
-				std::get<CellList_t>(ret.value).push_back(args[i]);
-			return ret;
-		};
-		global_env.symbols["append"] = c;
+// compiles every lambda now, the interpreters of the base only read the chunks
+void BaseEnvironement::freeze(Arena& arena)
+{
+	if (!frozen.insert(&arena).second)
+		return;
+
+	for (ListObj* list : arena.lists)
+	{
+		for (uint32_t i = 0; i < list->size; i++)
+			freeze(list->items()[i]);
 	}
+
+	for (auto const& lambda : arena.lambdas)
 	{
-		Cell c = { CellType::Proc };
-		c.value = [](CellList_t const& args) {
+		if (!lambda->chunk)
+		{
+			lambda->chunk = Compiler(*loader).compile_lambda(*lambda);
+			lambda->compiled.store(lambda->chunk.get(), std::memory_order_release);
+		}
 
-			ENSURE(args.size() == 2, "get take 2 arguments !");
-			ENSURE(args[0].type == CellType::List, "first arg of get must be a list !");
-			ENSURE(args[1].type == CellType::Int, "second arg of get must be an integral !");
-			
-			Cell ret = std::get<CellList_t>(args[0].value)[std::get<CellIntegral_t>(args[1].value)];
-			return ret;
-		};
-		global_env.symbols["get"] = c;
+		freeze(*lambda->chunk);
+		if (marking)
+			lambda->scope->frozen = true;
+	}
+}
+
+void BaseEnvironement::freeze(Chunk& chunk)
+{
+	for (auto const& c : chunk.consts)
+		freeze(c);
+	for (auto const& cache : chunk.caches)
+		freeze(cache.proc);
+	for (auto const& nested : chunk.chunks)
+		freeze(*nested);
+	if (marking)
+	{
+		chunk.frozen_caches = cache_count;
+		cache_count += (uint32_t)chunk.caches.size();
+	}
+}
+
+Cell Cell::make_int(CellIntegral_t v) noexcept
+{
+	Cell c{ CellType::Int };
+	c.int_value = v;
+	return c;
+}
+
+Cell Cell::make_float(CellFloat_t v) noexcept
+{
+	Cell c{ CellType::Float };
+	c.float_value = v;
+	return c;
+}
+
+Cell Cell::make_bool(bool v) noexcept
+{
+	Cell c{ CellType::Bool };
+	c.bool_value = v;
+	return c;
+}
+
+Cell Cell::make_string(std::string v)
+{
+	Cell c{ CellType::String };
+	auto obj = new StringObj();
+	count_allocation();
+	obj->value = std::move(v);
+	obj->task = task_token;
+	c.object = obj;
+	c.count = (uint32_t)obj->value.size();
+	return c;
+}
+
+// strings are appended as they are, other cells as printed
+static void append_text(std::string& buffer, Cell const& cell)
+{
+	if (cell.type == CellType::String)
+		buffer.append(cell.as_string());
+	else
+		buffer += to_string(cell);
+}
+
+Cell Cell::concat(Cell const& str, Cell const* items, size_t count)
+{
+	// same rule as the lists, the strings of a base environement never grow
+	auto obj = str.type == CellType::String ? static_cast<StringObj*>(str.object) : nullptr;
+	bool const in_place = obj && obj->value.size() == str.count
+		&& obj->refcount.load(std::memory_order_relaxed) < Object::immortal
+		&& (!detail::concurrent() || obj->task == task_token);
+
+	Cell c = in_place ? str : Cell();
+	if (!in_place)
+	{
+		std::string value;
+		append_text(value, str);
+		c = make_string(std::move(value));
+	}
+
+	// std::string grows geometrically, repeated concatenations are amortized O(1) per byte added
+	std::string& buffer = static_cast<StringObj*>(c.object)->value;
+	for (size_t i = 0; i < count; i++)
+		append_text(buffer, items[i]);
+	c.count = (uint32_t)buffer.size();
+	return c;
+}
+
+// lists, maps and procs made while an interpreter runs go to its heap, the lists of an arena are never tracked
+static void track(Container* obj)
+{
+	if (Heap* const heap = Heap::current())
+		heap->track(obj);
+}
+
+static ListObj* new_list_obj(void* mem, size_t count, size_t capacity)
+{
+	auto obj = new (mem) ListObj((uint32_t)count, (uint32_t)capacity);
+	obj->task = task_token;
+	for (size_t i = 0; i < count; i++)
+		new (obj->items() + i) Cell();
+	return obj;
+}
+
+Cell Cell::make_list(CellList_t v)
+{
+	Cell c = make_list(nullptr, v.size());
+	std::move(v.begin(), v.end(), c.as_list_mut().begin());
+	return c;
+}
+
+// null items when items is null
+Cell Cell::make_list(Cell const* items, size_t count, size_t capacity)
+{
+	capacity = std::max(capacity, count);
+	Cell c{ CellType::List };
+	ListObj* obj = new_list_obj(::operator new(sizeof(ListObj) + capacity * sizeof(Cell)), count, capacity);
+	count_allocation();
+	track(obj);
+	if (items)
+		std::copy(items, items + count, obj->items());
+	c.object = obj;
+	c.count = (uint32_t)count;
+	return c;
+}
+
+Cell Cell::make_vector(CellType elem, size_t size)
+{
+	Cell c{ CellType::Vector };
+	c.object = new (::operator new(sizeof(VectorObj) + size * sizeof(int64_t))) VectorObj(elem, (uint32_t)size);
+	count_allocation();
+	return c;
+}
+
+Cell Cell::make_map(size_t capacity)
+{
+	Cell c{ CellType::Map };
+	auto obj = new MapObj();
+	obj->task = task_token;
+	if (capacity)
+		obj->reserve(capacity);
+	c.object = obj;
+	count_allocation();
+	track(obj);
+	return c;
+}
+
+Cell Cell::append(Cell const& list, Cell const* items, size_t count)
+{
+	if (list.type != CellType::List)
+		return make_list(items, count);
+
+	auto obj = static_cast<ListObj*>(list.object);
+	uint32_t const size = list.count;
+
+	// the view ends where the buffer does, no other list can see the spare capacity yet
+	// during a parallel job other threads may hold the list, only the lists of the running task grow in place
+	if (obj->size == size && obj->capacity - size >= count && (!detail::concurrent() || obj->task == task_token))
+	{
+		for (size_t i = 0; i < count; i++)
+			new (obj->items() + size + i) Cell(items[i]);
+		obj->size += (uint32_t)count;
+
+		Cell c = list;
+		c.count = obj->size;
+		return c;
 	}
+
+	// grow geometrically so repeated appends are amortized O(1)
+	Cell c = make_list(obj->items(), size, std::max<size_t>((size + count) * 2, 8));
+	auto grown = static_cast<ListObj*>(c.object);
+	for (size_t i = 0; i < count; i++)
+		new (grown->items() + size + i) Cell(items[i]);
+	grown->size += (uint32_t)count;
+	c.count = grown->size;
+	return c;
+}
+
+ListObj::~ListObj()
+{
+	for (uint32_t i = 0; i < size; i++)
+		items()[i].~Cell();
+}
+
+Arena::~Arena()
+{
+	reset();
+}
+
+void* Arena::allocate(size_t size)
+{
+	size = (size + alignof(Cell) - 1) & ~(alignof(Cell) - 1);
+	for (; current < blocks.size(); current++)
+	{
+		Block& block = blocks[current];
+		if (block.size - block.used >= size)
+		{
+			void* ptr = block.data.get() + block.used;
+			block.used += size;
+			return ptr;
+		}
+	}
+
+	// blocks double in size up to 1MB, bigger lists get their own block
+	size_t const block_size = std::max(size, blocks.empty() ? (size_t)4096 : std::min(blocks.back().size * 2, (size_t)1 << 20));
+	Block& block = blocks.emplace_back();
+	block.data.reset(new char[block_size]);
+	block.size = block_size;
+	block.used = size;
+	count_allocation();
+	return block.data.get();
+}
+
+ListObj* Arena::new_list(Cell* items, size_t count)
+{
+	ListObj* obj = new_list_obj(allocate(sizeof(ListObj) + count * sizeof(Cell)), count, count);
+	obj->refcount.store(Object::immortal, std::memory_order_relaxed);
+	std::move(items, items + count, obj->items());
+	lists.push_back(obj);
+	return obj;
+}
+
+Lambda* Arena::new_lambda()
+{
+	Lambda* lambda = lambdas.emplace_back(std::make_unique<Lambda>()).get();
+	lambda->arena = this;
+	return lambda;
 }
 
-Cell::Cell() : type(CellType::Null)
+void Arena::reset()
 {
+	// lambdas reference the lists and parents are read after their items, release in reverse order
+	lambdas.clear();
+	for (auto it = lists.rbegin(); it != lists.rend(); ++it)
+		(*it)->~ListObj();
+	lists.clear();
+	for (Block& block : blocks)
+		block.used = 0;
+	current = 0;
 }
 
-Cell::Cell(CellType t) : type(t)
+Cell Cell::make_proc(CellProc_t fn, std::string name, uint16_t min_args, uint16_t max_args)
 {
+	Cell c{ CellType::Proc };
+	auto obj = new ProcObj();
+	count_allocation();
+	track(obj);
+	obj->fn = fn;
+	obj->name = std::move(name);
+	obj->min_args = min_args;
+	obj->max_args = max_args;
+	c.object = obj;
+	return c;
 }
 
 CellFloat_t lsp::Cell::get_as_double() const
 {
 	if (type == CellType::Float)
-		return std::get<CellFloat_t>(value);
-	return (CellFloat_t) std::get<CellIntegral_t>(value);
+		return float_value;
+	return (CellFloat_t)int_value;
 }
 
 CellIntegral_t lsp::Cell::get_as_int() const
 {
 	if (type == CellType::Int)
-		return std::get<CellIntegral_t>(value);
-	return (CellIntegral_t)std::get<CellFloat_t>(value);
+		return int_value;
+	return (CellIntegral_t)float_value;
 }
 
 bool lsp::cell_value_equal(Cell const& rhs, Cell const& lhs)
@@ -660,27 +2202,52 @@ bool lsp::cell_value_equal(Cell const& rhs, Cell const& lhs)
 	switch (rhs.type)
 	{
 	case CellType::Symbol:
-		return rhs.token_str == lhs.token_str;
+		return rhs.sym == lhs.sym;
 	case CellType::Float:
-		return std::get<CellFloat_t>(rhs.value) == std::get<CellFloat_t>(lhs.value);
+		return rhs.as_float() == lhs.as_float();
 	case CellType::Int:
-		return std::get<CellIntegral_t>(rhs.value) == std::get<CellIntegral_t>(lhs.value);
+		return rhs.as_int() == lhs.as_int();
 	case CellType::Bool:
-		return std::get<bool>(rhs.value) == std::get<bool>(lhs.value);
+		return rhs.as_bool() == lhs.as_bool();
 	case CellType::String:
-		return std::get<std::string>(rhs.value) == std::get<std::string>(lhs.value);
+		return rhs.as_string() == lhs.as_string();
 	case CellType::Null:
 		return true;
 	case CellType::List:
 	{
-		bool r = true;
-		auto& rlist = std::get<CellList_t>(rhs.value);
-		auto& llist = std::get<CellList_t>(lhs.value);
+		auto const rlist = rhs.as_list();
+		auto const llist = lhs.as_list();
 		if (rlist.size() != llist.size())
 			return false;
-		for (int i = 0; i < rlist.size(); i++)
-			r |= cell_value_equal(rlist[i], llist[i]);
-		return r;
+		for (size_t i = 0; i < rlist.size(); i++)
+		{
+			if (!cell_value_equal(rlist[i], llist[i]))
+				return false;
+		}
+		return true;
+	}
+	case CellType::Vector:
+	{
+		VectorObj& r = rhs.as_vector();
+		VectorObj& l = lhs.as_vector();
+		if (r.elem != l.elem || r.size != l.size)
+			return false;
+		if (r.elem == CellType::Int)
+			return std::equal(r.ints(), r.ints() + r.size, l.ints());
+		return std::equal(r.floats(), r.floats() + r.size, l.floats());
+	}
+	case CellType::Map:
+	{
+		MapObj& r = rhs.as_map();
+		MapObj& l = lhs.as_map();
+		if (r.size() != l.size())
+			return false;
+		bool equal = true;
+		r.each([&](Cell const& key, Cell const& value) {
+			Cell const* other = equal ? l.find(key) : nullptr;
+			equal = other && cell_value_equal(value, *other);
+		});
+		return equal;
 	}
 	case CellType::Proc:
 	default:
@@ -688,36 +2255,146 @@ bool lsp::cell_value_equal(Cell const& rhs, Cell const& lhs)
 	}
 }
 
-std::string lsp::to_string(Cell const& cell)
+// -0.0 equals 0.0 but not bitwise
+static size_t float_hash(double value) noexcept
+{
+	return std::hash<double>{}(value == 0.0 ? 0.0 : value);
+}
+
+size_t lsp::cell_hash(Cell const& cell)
 {
+	size_t const h = (size_t)cell.type;
 	switch (cell.type)
 	{
+	case CellType::Symbol:
+		return detail::hash_combine(h, cell.sym);
 	case CellType::Float:
-		return std::to_string(std::get<CellFloat_t>(cell.value));
+		return detail::hash_combine(h, float_hash(cell.as_float()));
 	case CellType::Int:
-		return std::to_string(std::get<CellIntegral_t>(cell.value));
+		return detail::hash_combine(h, std::hash<CellIntegral_t>{}(cell.as_int()));
 	case CellType::Bool:
-		return std::to_string(std::get<bool>(cell.value));
+		return detail::hash_combine(h, cell.as_bool());
 	case CellType::String:
-		return std::get<std::string>(cell.value);
+		return detail::hash_combine(h, std::hash<std::string_view>{}(cell.as_string()));
+	case CellType::List:
+	{
+		size_t r = detail::hash_combine(h, cell.count);
+		for (auto const& c : cell.as_list())
+			r = detail::hash_combine(r, cell_hash(c));
+		return r;
+	}
+	case CellType::Vector:
+	{
+		VectorObj& v = cell.as_vector();
+		size_t r = detail::hash_combine(h, (size_t)v.elem);
+		for (size_t i = 0; i < v.size; i++)
+			r = detail::hash_combine(r, v.elem == CellType::Int ? std::hash<int64_t>{}(v.ints()[i]) : float_hash(v.floats()[i]));
+		return r;
+	}
+	case CellType::Map:
+	{
+		// the same for any order of the keys
+		size_t entries = 0;
+		cell.as_map().each([&](Cell const& key, Cell const& value) { entries += detail::hash_combine(cell_hash(key), cell_hash(value)); });
+		return detail::hash_combine(detail::hash_combine(h, cell.as_map().size()), entries);
+	}
+	case CellType::Proc:
+		return detail::hash_combine(h, std::hash<void const*>{}(cell.object));
 	case CellType::Null:
-		return "Null";
+	default:
+		return h;
+	}
+}
+
+// the digits of %f, without going through printf
+static void format_float(std::string& out, CellFloat_t value)
+{
+	char buf[64];
+	auto const [end, ec] = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed, 6);
+	if (ec == std::errc())
+		out.append(buf, end);
+	else
+		out += std::to_string(value); // too large for buf
+}
+
+static void format_int(std::string& out, CellIntegral_t value)
+{
+	char buf[24];
+	out.append(buf, std::to_chars(buf, buf + sizeof(buf), value).ptr);
+}
+
+void lsp::format_cell(std::string& out, Cell const& cell)
+{
+	switch (cell.type)
+	{
+	case CellType::Float:
+		format_float(out, cell.as_float());
+		break;
+	case CellType::Int:
+		format_int(out, cell.as_int());
+		break;
+	case CellType::Bool:
+		out += cell.as_bool() ? '1' : '0';
+		break;
+	case CellType::String:
+		out.append(cell.as_string());
+		break;
+	case CellType::Null:
+		out += "Null";
+		break;
 	case CellType::Proc:
-		return cell.token_str;
+		out += cell.as_proc().name;
+		break;
 	case CellType::List:
 	{
-		std::string str("( ");
-		size_t i = std::get<CellList_t>(cell.value).size();
-		for (auto const& c : std::get<CellList_t>(cell.value))
+		out += "( ";
+		size_t i = cell.as_list().size();
+		for (auto const& c : cell.as_list())
 		{
-			str += to_string(c);
-			if (i > 1) str += ", ";
+			format_cell(out, c);
+			if (i > 1) out += ", ";
 			i--;
 		}
-		str += " )";
-		return str;
+		out += " )";
+		break;
+	}
+	case CellType::Vector:
+	{
+		VectorObj& v = cell.as_vector();
+		out += "[ ";
+		for (uint32_t i = 0; i < v.size; i++)
+		{
+			if (v.elem == CellType::Int)
+				format_int(out, (CellIntegral_t)v.ints()[i]);
+			else
+				format_float(out, v.floats()[i]);
+			if (i + 1 < v.size) out += ", ";
+		}
+		out += " ]";
+		break;
+	}
+	case CellType::Map:
+	{
+		out += "{ ";
+		size_t i = cell.as_map().size();
+		cell.as_map().each([&](Cell const& key, Cell const& value) {
+			format_cell(out, key);
+			out += ": ";
+			format_cell(out, value);
+			if (i > 1) out += ", ";
+			i--;
+		});
+		out += " }";
+		break;
 	}
 	default:
-		return "Unknown";
+		out += "Unknown";
 	}
+}
+
+std::string lsp::to_string(Cell const& cell)
+{
+	std::string str;
+	format_cell(str, cell);
+	return str;
 }
\ No newline at end of file
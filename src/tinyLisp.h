@@ -1,12 +1,16 @@
 #pragma once
 #include <vector>
-#include <queue>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
-#include <variant>
-#include <functional>
+#include <string_view>
 #include <optional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstdint>
 
 namespace lsp {
 
@@ -23,84 +27,754 @@ namespace lsp {
 		private:
 			IT b, e;
 		};
+
+		// non owning view over contiguous items
+		template<typename T>
+		struct Span
+		{
+			Span() noexcept = default;
+			Span(T* data, size_t count) noexcept : ptr(data), count(count) {}
+
+			T* begin() const noexcept { return ptr; }
+			T* end() const noexcept { return ptr + count; }
+			T* data() const noexcept { return ptr; }
+			size_t size() const noexcept { return count; }
+			bool empty() const noexcept { return count == 0; }
+			T& operator[](size_t i) const noexcept { return ptr[i]; }
+
+			template<typename C, typename = decltype(std::declval<C&>().data())>
+			Span(C& container) noexcept : ptr(container.data()), count(container.size()) {}
+
+			operator Span<T const>() const noexcept { return { ptr, count }; }
+
+		private:
+			T* ptr = nullptr;
+			size_t count = 0;
+		};
+
+		// set on the threads of a parallel job while they share objects, reference counts are then updated atomically
+		// per thread so interpreters running on other threads keep their plain counts
+		inline thread_local bool shared_objects = false;
+
+		inline bool concurrent() noexcept { return shared_objects; }
+
+		// errors reported on this thread, a memoized call that reported one is not cached
+		inline thread_local uint64_t errors = 0;
+
+		inline size_t hash_combine(size_t seed, size_t value) noexcept
+		{
+			return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+		}
+
+		// refcount of objects and frames owned by an arena or frozen in a base environement, they are never written
+		inline constexpr uint32_t immortal = 1u << 30;
+
+		// a plain increment unless threads share the counted object
+		inline void add_ref(std::atomic<uint32_t>& count) noexcept
+		{
+			uint32_t const refs = count.load(std::memory_order_relaxed);
+			if (refs >= immortal)
+				return;
+			if (concurrent())
+				count.fetch_add(1, std::memory_order_relaxed);
+			else
+				count.store(refs + 1, std::memory_order_relaxed);
+		}
+
+		// true when that was the last reference
+		inline bool drop_ref(std::atomic<uint32_t>& count) noexcept
+		{
+			uint32_t const refs = count.load(std::memory_order_relaxed);
+			if (refs >= immortal)
+				return false;
+			if (concurrent())
+				return count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+			count.store(refs - 1, std::memory_order_relaxed);
+			return refs == 1;
+		}
 	}
 
 	void runtime_error(const char* fmt, ...);
 
 	struct Cell;
+	class Interpreter;
 
 	using CellList_t = std::vector<Cell>;
-	//using CellProc_t = Cell(*)(CellList_t const&);
-	using CellProc_t = std::function<Cell(CellList_t const&)>;
+	using CellSpan_t = detail::Span<Cell const>;
+	// natives read their arguments in place, from the VM stack or the caller's argument list
+	using CellProc_t = Cell(*)(Interpreter&, CellSpan_t);
 	using CellIntegral_t = long;
 	using CellFloat_t = double;
 
-	enum class CellType
+	enum class CellType : uint8_t
 	{
 		Symbol,
 		Int,
 		Float,
 		Bool,
+		Null,
+		Unbound, // local slot that has not been assigned yet
+		// types stored in an Object
 		String,
 		List,
 		Proc,
-		Null,
+		Vector, // packed ints or floats
+		Map,	// keyed by strings, integrals or symbols
 	};
 
 	const char* to_string(CellType);
+
+	using SymbolId = uint32_t;
+
+	// interns every symbol name once, ids are dense and double as global slots
+	class SymbolTable
+	{
+	public:
+		SymbolTable() = default;
+		// extends a table that no longer changes, its names keep their ids
+		explicit SymbolTable(SymbolTable const* base) : base(base), first((SymbolId)base->size()) {}
+
+		SymbolId intern(std::string_view name);
+		std::string const& name(SymbolId id) const { return id < first ? base->name(id) : names[id - first]; }
+		size_t size() const noexcept { return first + names.size(); }
+
+	private:
+		std::optional<SymbolId> find(std::string_view name) const;
+
+		SymbolTable const* base = nullptr;
+		SymbolId first = 0; // ids below belong to the base
+		std::deque<std::string> names;
+		std::unordered_map<std::string_view, SymbolId> ids;
+	};
+
+	// how a resolved symbol cell is looked up at runtime
+	enum class SymbolKind : uint8_t
+	{
+		Unresolved, // looked up by name in the current scope, then in the globals
+		Local,		// slot of the frame `depth` levels up
+		Global,		// slot of the global environement, equal to the symbol id
+	};
+
+	// special form of a list, decoded once by the resolver so evaluation is a single switch
+	enum class Form : uint8_t
+	{
+		Unknown, // not resolved yet, decoded from the head symbol when evaluated
+		Call,
+		Import,
+		Set,
+		Setg,
+		If,
+		While,
+		Defun,
+		Eval,
+		Profile,
+	};
+
+	// names of the local slots of a frame, filled by the resolver
+	struct Scope
+	{
+		std::optional<uint32_t> find(SymbolId sym) const;
+		uint32_t add(SymbolId sym);
+
+		std::vector<SymbolId> names;
+		Scope* parent = nullptr; // scope of the enclosing defun, null at the top level
+		bool dynamic = false;	 // contains an eval form, unknown names are looked up at runtime
+		bool captures = false;	 // reads locals of an enclosing scope, procs keep the frame they are defined in
+		bool frozen = false;	 // scope of a lambda of a base environement, no name can be added
+		bool hosted = false;	 // scope of a frame the host owns, procs cannot keep it so defuns do not see its locals
+	};
+
+	class FramePool;
+
 	struct Environement
 	{
-		std::unordered_map<std::string, Cell> symbols;
+		std::vector<Cell> slots;
+		std::shared_ptr<Scope> scope; // null for the global environement where slot == symbol id
+		Environement* parent = nullptr; // frame of the enclosing defun, retained
+
+		// frames are shared by a call and the closures defined in it, the last release returns them to the pool
+		void retain() noexcept { detail::add_ref(refcount); }
+		void release() noexcept;
+
+		std::atomic<uint32_t> refcount{ 0 };
+		FramePool* pool = nullptr; // null for frames not acquired from a pool, like the global environement
+		// set while the heap collects, the frame is one of its nodes when epoch is the collection's
+		uint32_t heap_refs = 0;
+		uint32_t heap_epoch = 0;
+	};
+
+	// heap payload of String, List, Proc, Vector and Map cells, shared between copies and freed with the last reference
+	struct Object
+	{
+		// refcount of objects owned by an arena or a base environement, never reaches zero
+		static constexpr uint32_t immortal = detail::immortal;
+
+		virtual ~Object() = default;
+
+		// nothing else can read or write the object, it may be updated in place
+		bool unique() const noexcept { return refcount.load(std::memory_order_acquire) == 1; }
+
+		std::atomic<uint32_t> refcount{ 1 };
+	};
+
+	class Heap;
+
+	// what the cycle collector follows out of an object
+	struct HeapVisitor
+	{
+		virtual void visit(Cell const& cell) = 0;
+		virtual void visit(Environement* frame) = 0;
+	};
+
+	// lists, maps and procs, the objects holding references that can end up referencing themselves
+	// the ones made while an interpreter runs are tracked by its heap, which frees the cycles, see Heap
+	struct Container : Object
+	{
+		~Container() override;
+
+		// each cell and frame the object holds a reference to
+		virtual void references(HeapVisitor& visitor) const = 0;
+		// drops those references, the object is part of a garbage cycle
+		virtual void clear() noexcept = 0;
+
+		Heap* heap = nullptr; // null when untracked
+		uint32_t heap_slot = 0;
 	};
 
+	struct StringObj;
+	struct ListObj;
+	struct ProcObj;
+	struct VectorObj;
+	struct MapObj;
+	class MemoCache;
+
+	// 16 bytes: the tag and symbol address in the first word, the immediate value or object pointer in the second
 	struct Cell
 	{
-		Cell();
-		Cell(CellType t);
-		Cell(Cell const&) = default;
-		Cell(Cell&&) noexcept = default;
-		~Cell() = default;
+		Cell() noexcept : type(CellType::Null) {}
+		Cell(CellType t) noexcept : type(t) {}
+		Cell(Cell const& other) noexcept { copy_from(other); retain(); }
+		Cell(Cell&& other) noexcept { copy_from(other); other.type = CellType::Null; }
+		~Cell() { release(); }
+
+		Cell& operator=(Cell const& other) noexcept
+		{
+			other.retain();
+			release();
+			copy_from(other);
+			return *this;
+		}
+
+		Cell& operator=(Cell&& other) noexcept
+		{
+			if (this != &other)
+			{
+				release();
+				copy_from(other);
+				other.type = CellType::Null;
+			}
+			return *this;
+		}
+
+		static Cell make_int(CellIntegral_t v) noexcept;
+		static Cell make_float(CellFloat_t v) noexcept;
+		static Cell make_bool(bool v) noexcept;
+		static Cell make_string(std::string v);
+		static Cell make_list(CellList_t v);
+		static Cell make_list(Cell const* items, size_t count, size_t capacity = 0);
+		// list of the items of `list` followed by `items`, shares the buffer of `list` when it can
+		static Cell append(Cell const& list, Cell const* items, size_t count);
+		// string of the text of `str` followed by the text of `items`, appends to the buffer of `str` when it can
+		static Cell concat(Cell const& str, Cell const* items, size_t count);
+		// native proc taking from min_args to max_args arguments, checked by the caller
+		static Cell make_proc(CellProc_t fn, std::string name, uint16_t min_args = 0, uint16_t max_args = UINT16_MAX);
+		// vector of `size` uninitialized elements of type elem, Int or Float
+		static Cell make_vector(CellType elem, size_t size);
+		// empty map with room for `capacity` keys before it grows
+		static Cell make_map(size_t capacity = 0);
 
-		Cell& operator=(Cell const&) = default;
-		Cell& operator=(Cell&&) noexcept = default;
+		bool is_object() const noexcept { return type >= CellType::String; }
+		// condition of if / while, anything but false and null is true
+		bool is_true() const noexcept { return type == CellType::Bool ? bool_value : type != CellType::Null; }
+
+		CellIntegral_t as_int() const noexcept { return int_value; }
+		CellFloat_t as_float() const noexcept { return float_value; }
+		bool as_bool() const noexcept { return bool_value; }
+		std::string_view as_string() const noexcept;
+		CellSpan_t as_list() const noexcept;
+		detail::Span<Cell> as_list_mut() noexcept;
+		ProcObj& as_proc() const noexcept;
+		VectorObj& as_vector() const noexcept;
+		MapObj& as_map() const noexcept;
 
 		CellFloat_t get_as_double() const;
 		CellIntegral_t get_as_int() const;
 
 		CellType type;
-		std::string token_str;
-		
-		std::variant<
-			CellIntegral_t,
-			CellFloat_t,
-			bool,
-			std::string,
-			CellList_t,
-			CellProc_t
-		> value;
 
-		std::optional<Environement> local_env;
+		// symbol address and list form, filled by the resolver
+		SymbolKind kind = SymbolKind::Unresolved;
+		uint8_t depth = 0;
+		Form form = Form::Unknown;
+		union
+		{
+			SymbolId sym = 0;
+			uint32_t count; // items of the list or bytes of the string seen by this cell, the buffer may hold more
+		};
+
+		union
+		{
+			CellIntegral_t int_value;
+			CellFloat_t float_value;
+			bool bool_value;
+			uint32_t slot;
+			Object* object;
+			uint64_t bits = 0;
+		};
+
+	private:
+		void copy_from(Cell const& other) noexcept
+		{
+			type = other.type;
+			kind = other.kind;
+			depth = other.depth;
+			form = other.form;
+			sym = other.sym;
+			bits = other.bits;
+		}
+
+		void retain() const noexcept
+		{
+			if (is_object())
+				detail::add_ref(object->refcount);
+		}
+
+		void release() noexcept
+		{
+			if (is_object() && detail::drop_ref(object->refcount))
+				delete object;
+		}
+	};
+
+	static_assert(sizeof(Cell) == 16, "Cell must stay two words");
+
+	// like lists, string cells are views of the first `count` bytes: concatenating to the view that ends
+	// where the buffer does appends in place, short strings are stored inline by std::string
+	struct StringObj final : Object
+	{
+		std::string value;
+		uint64_t task = 0; // parallel task that made the string, 0 outside of tasks
+	};
+
+	struct Chunk;
+	class Arena;
+
+	// a resolved defun, owned by the arena of its form and kept alive by the procs it creates
+	struct Lambda
+	{
+		SymbolId name = 0;
+		uint32_t nparams = 0;
+		std::shared_ptr<Scope> scope;
+		CellList_t body;
+		std::shared_ptr<Chunk> chunk; // compiled by the VM on the first call
+		std::atomic<Chunk const*> compiled{ nullptr }; // set once chunk is, read without the compile lock
+		Arena* arena = nullptr;
+	};
+
+	// items are stored right after the object, a list is a single allocation
+	// list cells are views of the first `count` items: appending to the view that ends at `size`
+	// fills the spare capacity in place, other views are left untouched
+	struct ListObj final : Container
+	{
+		ListObj(uint32_t size, uint32_t capacity) noexcept : size(size), capacity(capacity) {}
+		~ListObj() override;
+
+		void references(HeapVisitor& visitor) const override;
+		void clear() noexcept override;
+
+		static void operator delete(void* ptr) { ::operator delete(ptr); }
+
+		Cell* items() noexcept { return reinterpret_cast<Cell*>(this + 1); }
+		Cell const* items() const noexcept { return reinterpret_cast<Cell const*>(this + 1); }
+
+		Lambda* lambda = nullptr; // set on defun forms by the resolver
+		uint32_t size;			  // constructed items
+		uint32_t capacity;
+		uint64_t task = 0;		  // parallel task that made the list, 0 outside of tasks
+	};
+
+	static_assert(sizeof(ListObj) % alignof(Cell) == 0, "list items must be aligned");
+
+	using BinaryKernel_t = Cell(*)(Cell const&, Cell const&);
+
+	// two argument fast paths of a numeric native, picked by the VM call site caches
+	struct BinaryKernels
+	{
+		BinaryKernel_t int_int;
+		BinaryKernel_t float_float;
+		BinaryKernel_t mixed; // one int and one float, the int is promoted
+	};
+
+	struct ProcObj final : Container
+	{
+		~ProcObj() override
+		{
+			if (env)
+				env->release();
+		}
+
+		void references(HeapVisitor& visitor) const override;
+		void clear() noexcept override;
+
+		CellProc_t fn = nullptr;
+		std::string name;
+		uint16_t min_args = 0;
+		uint16_t max_args = UINT16_MAX;
+		BinaryKernels const* kernels = nullptr; // must give the same results as fn
+		bool pure = false; // no side effect, the optimizer calls it ahead of time on constant arguments
+
+		bool accepts(size_t argc) const noexcept { return argc >= min_args && argc <= max_args; }
+		std::shared_ptr<Lambda> lambda; // user procs have no fn, shares the ownership of the lambda's arena
+		Environement* env = nullptr;	// frame captured by a closure, retained
+		std::shared_ptr<MemoCache> memo; // procs made by memoize have no fn either, calls look in the cache first
+	};
+
+	void arity_error(ProcObj const& proc, size_t argc);
+
+	// elements are stored right after the object as int64_t or double, so the simd kernels can run over them
+	struct VectorObj final : Object
+	{
+		VectorObj(CellType elem, uint32_t size) noexcept : elem(elem), size(size) {}
+
+		static void operator delete(void* ptr) { ::operator delete(ptr); }
+
+		int64_t* ints() noexcept { return reinterpret_cast<int64_t*>(this + 1); }
+		double* floats() noexcept { return reinterpret_cast<double*>(this + 1); }
+		Cell get(size_t i) noexcept { return elem == CellType::Int ? Cell::make_int((CellIntegral_t)ints()[i]) : Cell::make_float(floats()[i]); }
+
+		CellType elem;
+		uint32_t size;
+	};
+
+	static_assert(sizeof(VectorObj) % alignof(double) == 0, "vector elements must be aligned");
+
+	// hash map updated in place, its cells share it
+	// entries are kept in insertion order, the index is an open addressing table of entry positions probed linearly
+	struct MapObj final : Container
+	{
+		struct Entry
+		{
+			Cell key; // Unbound once removed, the entry is dropped when the index is rebuilt
+			Cell value;
+			size_t hash;
+		};
+
+		static bool valid_key(Cell const& key) noexcept { return key.type == CellType::String || key.type == CellType::Int || key.type == CellType::Symbol; }
+
+		// null when the key is not in the map
+		Cell* find(Cell const& key) noexcept;
+		// key must be valid
+		void set(Cell const& key, Cell value);
+		bool remove(Cell const& key) noexcept;
+		void reserve(size_t capacity);
+		size_t size() const noexcept { return count; }
+
+		template<typename F>
+		void each(F&& f) const
+		{
+			for (auto const& e : entries)
+			{
+				if (e.key.type != CellType::Unbound)
+					f(e.key, e.value);
+			}
+		}
+
+		void references(HeapVisitor& visitor) const override;
+		void clear() noexcept override;
+
+		uint64_t task = 0; // parallel task that made the map, 0 outside of tasks
+
+	private:
+		size_t position(Cell const& key, size_t hash) const noexcept;
+		void rebuild(size_t capacity);
+
+		std::vector<Entry> entries;
+		std::vector<uint32_t> index; // a power of two of entry positions, empty or removed
+		size_t count = 0;
+	};
+
+	// recycles the frames of finished calls so steady state calls do not allocate
+	class FramePool
+	{
+	public:
+		FramePool() = default;
+		FramePool(FramePool const&) = delete;
+		FramePool& operator=(FramePool const&) = delete;
+
+		// params are the first slots, the frame starts with one reference
+		Environement* acquire(Lambda const& fn, Cell const* args, size_t argc, Environement* parent);
+
+	private:
+		friend struct Environement;
+		std::vector<std::unique_ptr<Environement>> free;
 	};
 
+	inline std::string_view Cell::as_string() const noexcept { return { static_cast<StringObj*>(object)->value.data(), count }; }
+	inline CellSpan_t Cell::as_list() const noexcept { return { static_cast<ListObj*>(object)->items(), count }; }
+	inline detail::Span<Cell> Cell::as_list_mut() noexcept { return { static_cast<ListObj*>(object)->items(), count }; }
+	inline ProcObj& Cell::as_proc() const noexcept { return *static_cast<ProcObj*>(object); }
+	inline VectorObj& Cell::as_vector() const noexcept { return *static_cast<VectorObj*>(object); }
+	inline MapObj& Cell::as_map() const noexcept { return *static_cast<MapObj*>(object); }
+
 	bool cell_value_equal(Cell const& rhs, Cell const& lhs);
+	// cells equal for cell_value_equal have the same hash
+	size_t cell_hash(Cell const& cell);
 
 	std::string to_string(Cell const&);
+	// appends what to_string returns
+	void format_cell(std::string& out, Cell const& cell);
+
+	// number of heap allocations made by the calling thread for objects, arena blocks, frames and argument lists
+	uint64_t allocation_count() noexcept;
+
+	// bump allocator for the parsed forms of a program, everything is released at once
+	class Arena : public std::enable_shared_from_this<Arena>
+	{
+	public:
+		Arena() = default;
+		Arena(Arena const&) = delete;
+		Arena& operator=(Arena const&) = delete;
+		~Arena();
+
+		// the list takes the items, its refcount is immortal
+		ListObj* new_list(Cell* items, size_t count);
+		Lambda* new_lambda();
+		// destroys every list and lambda but keeps the blocks for the next program
+		void reset();
+
+	private:
+		friend class BaseEnvironement;
+
+		void* allocate(size_t size);
+
+		struct Block
+		{
+			std::unique_ptr<char[]> data;
+			size_t size = 0;
+			size_t used = 0;
+		};
+
+		std::vector<Block> blocks;
+		size_t current = 0;
+		std::vector<ListObj*> lists;
+		std::vector<std::unique_ptr<Lambda>> lambdas;
+	};
+
+	enum class TokenType : uint8_t
+	{
+		Open,
+		Close,
+		String, // with its quotes
+		Atom,	// number or symbol
+		End,
+	};
+
+	struct Token
+	{
+		TokenType type;
+		std::string_view text; // view into the source
+	};
+
+	// pull based tokenizer, the source must outlive the tokens
+	class Lexer
+	{
+	public:
+		explicit Lexer(std::string_view source) : source(source) {}
+
+		Token next();
+		Token peek();
+
+	private:
+		Token scan();
+
+		std::string_view source;
+		size_t index = 0;
+		Token peeked{ TokenType::End, {} };
+		bool has_peeked = false;
+	};
+
+	// value of an atom that is a number, false for a symbol
+	bool parse_number(std::string_view text, Cell& out);
+
+	enum class EvalMode
+	{
+		Tree,	  // walks the parsed forms, kept as the reference implementation
+		Bytecode, // compiles each form and runs it on the VM
+	};
+
+	class VM;
+	class WorkPool;
+	class BaseEnvironement;
+	struct CallCache;
+	struct ParsedModule;
+	class Profiler;
+	class Output;
+
+	// what a thread running code of an interpreter needs for itself, the interpreter's thread and each pool worker have one
+	struct ExecContext
+	{
+		explicit ExecContext(Interpreter& interp);
+		~ExecContext();
+
+		FramePool frame_pool;
+		std::unique_ptr<VM> vm;
+		std::deque<CellList_t> arg_lists; // arguments of the native calls in progress, reused by depth
+		size_t arg_depth = 0;
+	};
 
 	class Interpreter
 	{
 
 	public:
 		Interpreter();
+		// starts with the globals of base, takes microseconds, interpreters of the same base can run on different threads
+		explicit Interpreter(std::shared_ptr<BaseEnvironement const> base);
+		~Interpreter();
 		Cell eval(Cell const& cell, Environement& env);
 		Cell evalS(std::string const&, Environement& env);
 		Cell evalS(std::string const&);
+		// reads the forms of source without evaluating them and drops them, returns how many were read
+		size_t read_forms(std::string_view source);
+		Cell call(Cell const& proc, CellSpan_t args);
+
+		Cell get_global(std::string_view name);
+		// natives set here get the next registration id, images refer to them by it
+		void set_global(std::string_view name, Cell const& value);
+
+		// writes the globals and everything they reach to a binary image, false on error
+		bool save_image(std::string const& file_name);
+		// maps an image written by save_image and sets its globals, without reading or evaluating any source
+		// natives are found by registration id, the interpreter must register the same ones in the same order
+		bool load_image(std::string const& file_name);
 
+		// threads of the parallel builtins, the calling thread included
+		size_t threads() const noexcept;
+		void set_threads(size_t count);
+		// runs body over [0, count) in ranges spread on the threads, body may call procs of the interpreter
+		// tasks read the globals but cannot assign them, import or eval, nested calls run in the calling task
+		void parallel_for(size_t count, std::function<void(size_t begin, size_t end)> const& body);
+
+		// the calls made on the interpreter's thread are recorded by profiler until it is set back to null
+		// code running without one has no check for it, parallel tasks are never recorded
+		void set_profiler(Profiler* profiler) noexcept { this->profiler = profiler; }
+		Profiler* get_profiler() const noexcept { return profiler; }
+
+		// where print, println and the errors reported while the interpreter runs are written, see Output
+		Output& output() const noexcept { return *out; }
+		// tracks the lists, maps and procs made while the interpreter runs and frees their cycles, see Heap
+		Heap& heap() const noexcept { return *gc; }
+
+		SymbolTable symbols;
 		Environement global_env;
+		EvalMode mode = EvalMode::Bytecode;
+		// 0 evaluates the forms as read, 1 folds constant arithmetic and comparisons and prunes literal branches,
+		// 2 also inlines the calls to small pure procs, see Optimizer
+		int opt_level = 0;
+		// prints each top level form the optimizer changed, before and after
+		bool dump_optimized = false;
+		// compiles the hot loops and procs doing int and float arithmetic to native code, see Jit
+		// only x86-64 Linux builds have one, elsewhere the flag does nothing
+		bool jit = false;
+
+	private:
+		friend class VM;
+		friend class Jit;
+		friend class Compiler;
+		friend class Optimizer;
+		friend class BaseEnvironement;
+
+		std::shared_ptr<BaseEnvironement const> base; // first so it goes last, the cells below may hold its objects
+		std::unique_ptr<Heap> gc; // then the heap, the objects below leave it when they are freed
+		std::vector<CallCache> base_caches;			  // call site caches of the chunks of the base, filled by this interpreter
+		std::unordered_set<std::string> imported_files; // added before they are evaluated so cyclic imports stop
+		std::vector<Cell> natives; // in registration order, the index is the id
+
+		std::shared_ptr<Arena> arena; // receives the forms read and the lambdas resolved
+		std::vector<Cell> read_stack; // items of the lists being read
+
+		ExecContext main_context;
+		// never shrinks, frames acquired by a worker can outlive its thread
+		std::vector<std::unique_ptr<ExecContext>> worker_contexts;
+		std::unique_ptr<WorkPool> pool; // after the contexts, its threads stop before they go
+		size_t pool_size = 0;			// 0 for the hardware threads
+		std::mutex compile_lock;		// lambdas first called by two tasks at once compile once
+		Profiler* profiler = nullptr;
+		std::unique_ptr<Output> out;
+
+		struct SpecialForms
+		{
+			SymbolId import, set, setg, if_, while_, defun, eval, profile;
+		} forms;
+
+		Cell read_from(Lexer& lexer);
+		// builds the node at pos of a parsed module, ids are the symbols of its names
+		Cell read_node(ParsedModule const& module, size_t& pos, std::vector<SymbolId> const& ids);
+		// reads, resolves and evaluates the forms of source one at a time
+		template<typename Source>
+		Cell eval_forms(Source& source, Environement& env);
+
+		void resolve(Cell& cell, Environement& env);
+		void resolve(Cell& cell, Scope* scope);
+		void resolve_symbol(Cell& cell, Scope* scope);
+		void collect_locals(Cell const& cell, Scope& scope);
+		Form decode_form(CellSpan_t list) const;
+		Cell lookup(Cell const& symbol, Environement& env);
+		void assign(Cell const& symbol, Cell const& value, Environement& env);
+		void sync_globals();
+
+		Cell import_file(std::string const& file_name);
+		Cell make_proc(Lambda* lambda, Environement& env);
+		ExecContext& context() noexcept;
+		// reports an error when called from a parallel task, what cannot happen there
+		bool in_parallel_task(const char* what) const;
+		// the profiler recording the calls of the calling thread, if any
+		Profiler* active_profiler() const noexcept;
+		// (profile expr [file] [interval]), body evaluates expr
+		Cell profile(CellSpan_t form, std::function<Cell()> const& body);
+		CellList_t& acquire_args();
+		void release_args();
+		Cell apply(Lambda& fn, Environement* parent, Cell const* args, size_t argc);
+		// call without the profiler
+		Cell invoke(ProcObj const& proc, CellSpan_t args);
+		// results of a memoized proc come from its cache, the calls of parallel tasks and base environements bypass it
+		Cell call_memo(ProcObj const& proc, CellSpan_t args);
+	};
+
+	// builtins and libraries evaluated once then frozen, shared read only by the interpreters made from it
+	// what its globals reach is immortal while it lives so their reference counts are never written, it goes with the last interpreter
+	class BaseEnvironement
+	{
+	public:
+		// setup runs on a fresh interpreter, usually to import libraries, what it leaves in the globals is frozen
+		explicit BaseEnvironement(std::function<void(Interpreter&)> const& setup = {});
+		~BaseEnvironement();
+		BaseEnvironement(BaseEnvironement const&) = delete;
+		BaseEnvironement& operator=(BaseEnvironement const&) = delete;
 
 	private:
-		std::unordered_set<std::string> imported_files;
+		friend class Interpreter;
+
+		void freeze(Cell const& cell);
+		void freeze(Environement* frame);
+		void freeze(Arena& arena);
+		void freeze(Chunk& chunk);
 
-		static std::queue<std::string> lex(std::string_view source);
-		static Cell read_from(std::queue<std::string>& tokens);
+		std::unique_ptr<Interpreter> loader; // owns the frozen globals, never runs code again
+		std::unordered_set<void const*> frozen; // visited by the current walk
+		bool marking = false;
+		// reference counts before freezing, restored before the loader releases everything
+		std::vector<std::pair<Object*, uint32_t>> objects;
+		std::vector<std::pair<Environement*, uint32_t>> frames;
+		uint32_t cache_count = 0; // call site caches of the frozen chunks, every interpreter has its own copy
 	};
 }
\ No newline at end of file
@@ -0,0 +1,552 @@
+#include "vm.h"
+#include "jit.h"
+#include "profiler.h"
+#include "output.h"
+#include "heap.h"
+
+#include <atomic>
+#include <cstdio>
+
+using namespace lsp;
+
+static constexpr uint32_t no_symbol = UINT32_MAX;
+
+uint64_t Chunk::next_id() noexcept
+{
+	static std::atomic<uint64_t> last{ 0 };
+	return last.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+std::shared_ptr<Chunk> Compiler::compile_form(Cell const& form)
+{
+	auto result = std::make_shared<Chunk>();
+	chunk = result.get();
+	expr(form);
+	emit(OpCode::Return);
+	return result;
+}
+
+std::shared_ptr<Chunk> Compiler::compile_lambda(Lambda const& fn)
+{
+	auto result = std::make_shared<Chunk>();
+	chunk = result.get();
+	if (fn.body.empty())
+		emit(OpCode::Nil);
+
+	for (size_t i = 0; i < fn.body.size(); i++)
+	{
+		if (i > 0)
+			emit(OpCode::Pop);
+		expr(fn.body[i], i + 1 == fn.body.size());
+	}
+	emit(OpCode::Return);
+	return result;
+}
+
+size_t Compiler::emit(OpCode op, uint32_t a, uint32_t b, uint8_t depth)
+{
+	Instr in;
+	in.op = op;
+	in.depth = depth;
+	in.a = a;
+	in.b = b;
+	chunk->code.push_back(in);
+	return chunk->code.size() - 1;
+}
+
+uint32_t Compiler::constant(Cell const& value)
+{
+	chunk->consts.push_back(value);
+	return (uint32_t)chunk->consts.size() - 1;
+}
+
+void Compiler::store(Cell const& target)
+{
+	switch (target.kind)
+	{
+	case SymbolKind::Local:
+		emit(OpCode::StoreLocal, target.slot);
+		break;
+	case SymbolKind::Global:
+		emit(OpCode::StoreGlobal, target.slot);
+		break;
+	case SymbolKind::Unresolved:
+		emit(OpCode::StoreName, target.sym);
+		break;
+	}
+}
+
+void Compiler::call(CellSpan_t list, bool tail)
+{
+	for (auto const& c : list)
+		expr(c);
+	size_t const at = emit(tail ? OpCode::TailCall : OpCode::Call, (uint32_t)list.size() - 1, list[0].type == CellType::Symbol ? list[0].sym : no_symbol);
+
+	if (list.size() == 3 && chunk->caches.size() < UINT16_MAX)
+	{
+		chunk->caches.emplace_back();
+		chunk->code[at].cache = (uint16_t)chunk->caches.size();
+	}
+}
+
+// tail is set for the value returned by a lambda body, calls there reuse the frame
+void Compiler::expr(Cell const& cell, bool tail)
+{
+	switch (cell.type)
+	{
+	case CellType::Null:
+		emit(OpCode::Nil);
+		return;
+	case CellType::Symbol:
+		switch (cell.kind)
+		{
+		case SymbolKind::Local:
+			emit(OpCode::LoadLocal, cell.slot, cell.sym, (uint8_t)cell.depth);
+			break;
+		case SymbolKind::Global:
+			emit(OpCode::LoadGlobal, cell.slot);
+			break;
+		case SymbolKind::Unresolved:
+			emit(OpCode::LoadName, cell.sym);
+			break;
+		}
+		return;
+	case CellType::List:
+		break;
+	default:
+		emit(OpCode::Const, constant(cell));
+		return;
+	}
+
+	auto const& list = cell.as_list();
+	if (list.empty())
+	{
+		emit(OpCode::Nil);
+		return;
+	}
+
+	Form const form = cell.form != Form::Unknown ? cell.form : interp.decode_form(list);
+	switch (form)
+	{
+	case Form::Import:
+	case Form::Eval:
+		if (list.size() > 1 && list[1].type == CellType::String)
+			emit(form == Form::Import ? OpCode::Import : OpCode::Eval, constant(list[1]));
+		else // let the tree walker report the error
+			emit(OpCode::Tree, constant(cell));
+		break;
+	case Form::Set:
+	case Form::Setg:
+		if (list.size() < 2 || list[1].type != CellType::Symbol)
+		{
+			emit(OpCode::Tree, constant(cell));
+			break;
+		}
+
+		if (list.size() > 2)
+			expr(list[2]);
+		else
+			emit(OpCode::Nil);
+
+		if (form == Form::Setg)
+			emit(OpCode::StoreGlobal, list[1].sym);
+		else
+			store(list[1]);
+		break;
+	case Form::If:
+	{
+		if (list.size() < 3)
+		{
+			emit(OpCode::Tree, constant(cell));
+			break;
+		}
+
+		expr(list[1]);
+		size_t const jump_else = emit(OpCode::JumpIfFalse);
+		expr(list[2], tail);
+		size_t const jump_end = emit(OpCode::Jump);
+		chunk->code[jump_else].a = (uint32_t)chunk->code.size();
+		if (list.size() > 3)
+			expr(list[3], tail);
+		else
+			emit(OpCode::Nil);
+		chunk->code[jump_end].a = (uint32_t)chunk->code.size();
+		break;
+	}
+	case Form::While:
+	{
+		if (list.size() < 2)
+		{
+			emit(OpCode::Tree, constant(cell));
+			break;
+		}
+
+		uint32_t const top = (uint32_t)emit(OpCode::Loop);
+		expr(list[1]);
+		size_t const jump_end = emit(OpCode::JumpIfFalse);
+		for (auto const& b : detail::Range(list.begin() + 2, list.end()))
+		{
+			expr(b);
+			emit(OpCode::Pop);
+		}
+		emit(OpCode::Jump, top);
+		chunk->code[jump_end].a = chunk->code[top].a = (uint32_t)chunk->code.size();
+		emit(OpCode::Nil);
+		break;
+	}
+	case Form::Defun:
+	{
+		Lambda* const lambda = static_cast<ListObj*>(cell.object)->lambda;
+		if (!lambda)
+		{
+			emit(OpCode::Tree, constant(cell));
+			break;
+		}
+
+		chunk->lambdas.push_back(lambda);
+		emit(OpCode::Defun, (uint32_t)chunk->lambdas.size() - 1);
+		store(list[1]);
+		break;
+	}
+	case Form::Profile:
+	{
+		if (list.size() < 2)
+		{
+			emit(OpCode::Tree, constant(cell));
+			break;
+		}
+
+		Chunk* const outer = chunk;
+		auto nested = compile_form(list[1]);
+		chunk = outer;
+		chunk->chunks.push_back(std::move(nested));
+		emit(OpCode::Profile, (uint32_t)chunk->chunks.size() - 1, constant(cell));
+		break;
+	}
+	default:
+		call(list, tail);
+		break;
+	}
+}
+
+VM::VM(Interpreter& interp, FramePool& frame_pool) : interp(interp), frame_pool(frame_pool)
+{
+	stack.reserve(stack_size);
+}
+
+VM::~VM() = default;
+
+Cell VM::eval(Cell const& form, Environement& env)
+{
+	auto chunk = Compiler(interp).compile_form(form);
+	return run(*chunk, env);
+}
+
+Chunk const& VM::chunk_of(Lambda& fn)
+{
+	if (Chunk const* chunk = fn.compiled.load(std::memory_order_acquire))
+		return *chunk;
+
+	std::lock_guard<std::mutex> guard(interp.compile_lock);
+	if (!fn.chunk)
+	{
+		fn.chunk = Compiler(interp).compile_lambda(fn);
+		fn.compiled.store(fn.chunk.get(), std::memory_order_release);
+	}
+	return *fn.chunk;
+}
+
+Cell VM::call(Lambda& fn, Environement& frame)
+{
+	return run(chunk_of(fn), frame);
+}
+
+// points the cache at the kernel of proc for these argument types, false when there is none
+bool VM::refill(CallCache& cache, Cell const& proc, Cell const& lhs, Cell const& rhs)
+{
+	if (proc.type != CellType::Proc || !proc.as_proc().kernels)
+		return false;
+
+	bool const lhs_int = lhs.type == CellType::Int, rhs_int = rhs.type == CellType::Int;
+	if ((!lhs_int && lhs.type != CellType::Float) || (!rhs_int && rhs.type != CellType::Float))
+		return false;
+
+	BinaryKernels const& kernels = *proc.as_proc().kernels;
+	cache.proc = proc;
+	cache.lhs = lhs.type;
+	cache.rhs = rhs.type;
+	cache.kernel = lhs_int && rhs_int ? kernels.int_int : !lhs_int && !rhs_int ? kernels.float_float : kernels.mixed;
+	return true;
+}
+
+// the jit runs on the interpreter's thread, parallel tasks share the objects it would assume are theirs
+Jit* VM::jit_ready()
+{
+	if (!interp.jit || !Jit::supported() || detail::concurrent())
+		return nullptr;
+	if (!jit)
+		jit = std::make_unique<Jit>(interp);
+	return jit.get();
+}
+
+Cell VM::run(Chunk const& chunk, Environement& env)
+{
+	if (Profiler* const profiler = interp.active_profiler())
+		return run<true>(chunk, env, profiler);
+	return run<false>(chunk, env, nullptr);
+}
+
+template<bool profiled>
+Cell VM::run(Chunk const& entry_chunk, Environement& entry_env, Profiler* profiler)
+{
+	if (!fits(entry_chunk))
+	{
+		runtime_error("stack overflow !");
+		return Cell();
+	}
+
+	size_t const entry = frames.size();
+	frames.push_back({ &entry_chunk, 0, &entry_env, stack.size(), Cell(), false });
+
+	// registers of the running frame, saved in frames.back() around calls
+	Chunk const* chunk = &entry_chunk;
+	Environement* env = &entry_env;
+	size_t pc = 0;
+
+	for (;;)
+	{
+		Instr const& in = chunk->code[pc++];
+		switch (in.op)
+		{
+		case OpCode::Const:
+			stack.push_back(chunk->consts[in.a]);
+			break;
+		case OpCode::Nil:
+			stack.emplace_back();
+			break;
+		case OpCode::LoadLocal:
+		{
+			Environement* frame = env;
+			for (uint8_t d = 0; d < in.depth && frame; d++)
+				frame = frame->parent;
+
+			// unassigned locals fall back to the global of the same name
+			if (frame && in.a < frame->slots.size() && frame->slots[in.a].type != CellType::Unbound)
+				stack.push_back(frame->slots[in.a]);
+			else
+				stack.push_back(interp.global_env.slots[in.b]);
+			break;
+		}
+		case OpCode::LoadGlobal:
+			stack.push_back(interp.global_env.slots[in.a]);
+			break;
+		case OpCode::LoadName:
+		{
+			Cell symbol{ CellType::Symbol };
+			symbol.sym = in.a;
+			stack.push_back(interp.lookup(symbol, *env));
+			break;
+		}
+		case OpCode::StoreLocal:
+			if (in.a >= env->slots.size())
+				env->slots.resize(in.a + 1, Cell(CellType::Unbound));
+			env->slots[in.a] = stack.back();
+			break;
+		case OpCode::StoreGlobal:
+			if (interp.in_parallel_task("assign a global"))
+				break;
+			interp.sync_globals();
+			interp.global_env.slots[in.a] = stack.back();
+			break;
+		case OpCode::StoreName:
+		{
+			Cell symbol{ CellType::Symbol };
+			symbol.sym = in.a;
+			interp.assign(symbol, stack.back(), *env);
+			break;
+		}
+		case OpCode::Pop:
+			stack.pop_back();
+			break;
+		case OpCode::Jump:
+			pc = in.a;
+			break;
+		case OpCode::JumpIfFalse:
+		{
+			bool const cond = stack.back().is_true();
+			stack.pop_back();
+			if (!cond)
+				pc = in.a;
+			break;
+		}
+		case OpCode::Call:
+		case OpCode::TailCall:
+		{
+			size_t const callee = stack.size() - in.a - 1;
+
+			// numeric natives with two arguments run their kernel without a call
+			// caches are shared by the threads of a parallel job, they only fill when it is over
+			// chunks of a base environement are shared by interpreters, each one has the caches of their call sites
+			if (in.cache)
+			{
+				CallCache& cache = chunk->frozen_caches == Chunk::own_caches ? chunk->caches[in.cache - 1]
+					: interp.base_caches[chunk->frozen_caches + in.cache - 1];
+				Cell const& lhs = stack[callee + 1];
+				Cell const& rhs = stack[callee + 2];
+				bool const hit = stack[callee].type == CellType::Proc && stack[callee].object == cache.proc.object
+					&& lhs.type == cache.lhs && rhs.type == cache.rhs;
+				if (hit || (!detail::concurrent() && refill(cache, stack[callee], lhs, rhs)))
+				{
+					Cell result = cache.kernel(lhs, rhs);
+					stack.resize(callee);
+					stack.push_back(std::move(result));
+					break;
+				}
+			}
+
+			Cell proc = std::move(stack[callee]);
+			if (proc.type != CellType::Proc)
+			{
+				stack.resize(callee);
+				if (in.b != no_symbol)
+				{
+					detail::errors++;
+					interp.output().printf("error : symbol %s undefined\n", interp.symbols.name(in.b).c_str());
+				}
+				else
+					runtime_error("%s is not a procedure !", to_string(proc.type));
+				stack.emplace_back();
+				break;
+			}
+
+			ProcObj& p = proc.as_proc();
+			if (!p.lambda)
+			{
+				// the arguments stay on the stack for the duration of the call
+				Cell result;
+				if constexpr (profiled)
+					profiler->enter(&p, p.name);
+				if (!p.accepts(in.a))
+					arity_error(p, in.a);
+				else if (p.memo)
+					result = interp.call_memo(p, CellSpan_t(stack.data() + callee + 1, in.a));
+				else
+					result = p.fn(interp, CellSpan_t(stack.data() + callee + 1, in.a));
+				if constexpr (profiled)
+					profiler->exit();
+				stack.resize(callee);
+				stack.push_back(std::move(result));
+				break;
+			}
+
+			Chunk const& callee_chunk = chunk_of(*p.lambda);
+			if constexpr (!profiled)
+			{
+				// procs doing arithmetic on their params run compiled, without a frame
+				Cell result;
+				Jit* const compiled = p.memo ? nullptr : jit_ready();
+				if (compiled && compiled->call(*p.lambda, callee_chunk, stack.data() + callee + 1, in.a, result))
+				{
+					stack.resize(callee);
+					stack.push_back(std::move(result));
+					break;
+				}
+			}
+			if (!fits(callee_chunk))
+			{
+				stack.resize(callee);
+				runtime_error("stack overflow in %s !", p.name.c_str());
+				stack.emplace_back();
+				break;
+			}
+
+			// between two calls the cells in use are all on the stack or in the frames
+			interp.heap().poll();
+			Environement* frame = frame_pool.acquire(*p.lambda, stack.data() + callee + 1, in.a, p.env);
+			bool const replaces = in.op == OpCode::TailCall && frames.back().owns_env;
+			if constexpr (profiled)
+			{
+				if (replaces)
+					profiler->exit();
+				profiler->enter(p.lambda.get(), p.name);
+			}
+
+			// a tail call replaces the frame it returns to, the entry frame belongs to our caller
+			if (replaces)
+			{
+				// the proc goes first, a closure referenced only by its own frame lets the frame go
+				CallFrame& current = frames.back();
+				Environement* const finished = current.env;
+				stack.resize(current.base);
+				current.proc = std::move(proc);
+				current.chunk = &callee_chunk;
+				current.env = frame;
+				finished->release();
+			}
+			else
+			{
+				stack.resize(callee);
+				frames.back().pc = pc;
+				frames.push_back({ &callee_chunk, 0, frame, stack.size(), std::move(proc), true });
+			}
+
+			chunk = &callee_chunk;
+			env = frame;
+			pc = 0;
+			break;
+		}
+		case OpCode::Return:
+		{
+			Cell result = std::move(stack.back());
+			CallFrame& current = frames.back();
+			stack.resize(current.base);
+			current.proc = Cell();
+			if (current.owns_env)
+			{
+				current.env->release();
+				if constexpr (profiled)
+					profiler->exit();
+			}
+			frames.pop_back();
+
+			if (frames.size() == entry)
+				return result;
+
+			stack.push_back(std::move(result));
+			CallFrame const& caller = frames.back();
+			chunk = caller.chunk;
+			env = caller.env;
+			pc = caller.pc;
+			break;
+		}
+		case OpCode::Loop:
+			interp.heap().poll();
+			if constexpr (!profiled)
+			{
+				if (Jit* const compiled = jit_ready())
+					compiled->loop(*chunk, pc - 1, *env, stack, pc);
+			}
+			break;
+		case OpCode::Defun:
+			stack.push_back(interp.make_proc(chunk->lambdas[in.a], *env));
+			break;
+		case OpCode::Import:
+			stack.push_back(interp.import_file(std::string(chunk->consts[in.a].as_string())));
+			break;
+		case OpCode::Eval:
+			stack.push_back(interp.evalS(std::string(chunk->consts[in.a].as_string()), *env));
+			break;
+		case OpCode::Tree:
+			stack.push_back(interp.eval(chunk->consts[in.a], *env));
+			break;
+		case OpCode::Profile:
+		{
+			Chunk const& nested = *chunk->chunks[in.a];
+			Environement& frame = *env;
+			Cell result = interp.profile(chunk->consts[in.b].as_list(), [&] { return run(nested, frame); });
+			stack.push_back(std::move(result));
+			break;
+		}
+		}
+	}
+}
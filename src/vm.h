@@ -0,0 +1,127 @@
+#pragma once
+#include "tinyLisp.h"
+
+namespace lsp {
+
+	class Jit;
+
+	enum class OpCode : uint8_t
+	{
+		Const,		 // push consts[a]
+		Nil,		 // push null
+		LoadLocal,	 // push slot a of the frame `depth` levels up, global b when unassigned
+		LoadGlobal,	 // push global slot a
+		LoadName,	 // push the value of symbol a looked up at runtime
+		StoreLocal,	 // slot a of the current frame = top, the value stays on the stack
+		StoreGlobal, // global slot a = top
+		StoreName,	 // symbol a of the current frame = top
+		Pop,
+		Jump,		 // pc = a
+		JumpIfFalse, // pop, pc = a when false or null
+		Call,		 // call the proc below the a arguments, b is the symbol of the callee for errors
+		TailCall,	 // Call in tail position, a user proc replaces the current frame
+		Return,
+		Loop,		 // head of a while loop, a = pc after it, where the jit enters compiled loops
+		Defun,		 // push a proc for lambdas[a]
+		Import,		 // import the file named by consts[a]
+		Eval,		 // evaluate the source in consts[a] in the current environement
+		Tree,		 // evaluate the form consts[a] with the tree walker
+		Profile,	 // run chunks[a] with a profiler, consts[b] is the profile form
+	};
+
+	struct Instr
+	{
+		OpCode op;
+		uint8_t depth = 0;
+		uint16_t cache = 0; // 1 + index of the inline cache of a two argument call, 0 for none
+		uint32_t a = 0;
+		uint32_t b = 0;
+	};
+
+	// last native and argument types seen by a two argument call site, with the kernel they selected
+	struct CallCache
+	{
+		Cell proc; // retained so its address cannot be reused by another proc
+		CellType lhs = CellType::Null;
+		CellType rhs = CellType::Null;
+		BinaryKernel_t kernel = nullptr;
+	};
+
+	struct Chunk
+	{
+		std::vector<Instr> code;
+		std::vector<Cell> consts;
+		std::vector<Lambda*> lambdas; // owned by the arena of the form
+		std::vector<std::shared_ptr<Chunk>> chunks; // expressions of the profile forms, run in the same frame
+		mutable std::vector<CallCache> caches; // filled while running
+		// chunks of a base environement are shared, their call sites use the caches of the interpreter from this index
+		uint32_t frozen_caches = own_caches;
+		uint64_t id = next_id(); // unique for the process, unlike the address of the chunk
+
+		static constexpr uint32_t own_caches = UINT32_MAX;
+		static uint64_t next_id() noexcept;
+	};
+
+	// lowers resolved forms into bytecode
+	class Compiler
+	{
+	public:
+		explicit Compiler(Interpreter& interp) : interp(interp) {}
+
+		std::shared_ptr<Chunk> compile_form(Cell const& form);
+		std::shared_ptr<Chunk> compile_lambda(Lambda const& fn);
+
+	private:
+		void expr(Cell const& cell, bool tail = false);
+		void call(CellSpan_t list, bool tail);
+		void store(Cell const& target);
+		size_t emit(OpCode op, uint32_t a = 0, uint32_t b = 0, uint8_t depth = 0);
+		uint32_t constant(Cell const& value);
+
+		Interpreter& interp;
+		Chunk* chunk = nullptr;
+	};
+
+	// calls between user procs do not recurse on the native stack, only natives calling back into the VM do
+	class VM
+	{
+	public:
+		// in cells, the stack never grows so natives can read their arguments in place while calling back into the VM
+		static constexpr size_t stack_size = 1 << 20;
+
+		// every thread running code of the interpreter has its own VM and frame pool
+		VM(Interpreter& interp, FramePool& frame_pool);
+		~VM();
+
+		Cell eval(Cell const& form, Environement& env);
+		Cell call(Lambda& fn, Environement& frame);
+
+	private:
+		struct CallFrame
+		{
+			Chunk const* chunk;
+			size_t pc;
+			Environement* env;
+			size_t base;	   // stack size when the frame was entered
+			Cell proc;		   // keeps the running lambda alive
+			bool owns_env;	   // acquired by the VM, released on return
+		};
+
+		Cell run(Chunk const& chunk, Environement& env);
+		// the profiled loop is another instantiation so the other one has no check for it
+		template<bool profiled>
+		Cell run(Chunk const& chunk, Environement& env, Profiler* profiler);
+		Chunk const& chunk_of(Lambda& fn);
+		// a chunk pushes at most one cell per instruction
+		bool fits(Chunk const& chunk) const noexcept { return stack.size() + chunk.code.size() <= stack.capacity(); }
+		static bool refill(CallCache& cache, Cell const& proc, Cell const& lhs, Cell const& rhs);
+		// the jit of this thread when Interpreter::jit is set, null when the code must be interpreted
+		Jit* jit_ready();
+
+		Interpreter& interp;
+		FramePool& frame_pool;
+		std::vector<Cell> stack;
+		std::vector<CallFrame> frames;
+		std::unique_ptr<Jit> jit; // created on first use
+	};
+}
@@ -70,6 +70,6 @@
 	)
 
 (defun std_random (prev)
-	(+ (* prev 1664525) 1013904223))
+	(+ (* prev 1664525) 1013904223)
 	)
 
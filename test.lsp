@@ -6,4 +6,71 @@
 
 (println (std_filter (std_transform (list 5 8 9 2) std_sqr) std_is_even))
 (set a (strcat "oui" "nonon"))
-(println a)
\ No newline at end of file
+(println a)
+
+; once compiled, calls reuse pooled frames and argument lists and should not allocate
+(std_pow 3 10)
+(std_sqrt 2)
+(set before (alloc_count))
+(std_pow 3 10)
+(std_sqrt 2)
+(set after (alloc_count))
+(println (strcat "allocations in steady state calls : " (- after before)))
+
+; tail calls reuse the caller's frame on the vm, bench/calls.lsp runs a million of them
+; the tree walker has none so this stays shallow enough for its stack
+(defun count_down (n acc)
+	(if (= n 0)
+		acc
+		(count_down (- n 1) (+ acc 1))))
+(println (count_down 1000 0))
+
+; closures share the frame they are defined in
+(defun make_adder (n)
+	(defun add (x) (+ x n))
+	add)
+(set add2 (make_adder 2))
+(println (add2 40))
+
+; packed vectors, element-wise ops and reductions run on simd kernels
+(set v (to_vector (list 1 2 3 4 5)))
+(println (v* v 2.5))
+(println (v> v 2))
+(println (strcat (sum v) " " (dot v v) " " (min v) " " (max (v- v 10))))
+(println (get (range 10 20) 3))
+
+; parallel builtins split the list across threads, results keep the order of the items
+(println (pmap (list 1 2 3 4) std_sqr))
+(println (pfilter (list 1 2 3 4 5 6) std_is_even))
+(println (preduce (list 1 2 3 4 5) + 0))
+
+; a file is imported once per interpreter, later imports of it do nothing
+(import "stdLib.lsp")
+(println (std_sqr 9))
+
+; memoize caches results by arguments, the recursive calls go through the cache too
+(defun slow_fib (n) (if (< n 2) n (+ (fib_memo (- n 1)) (fib_memo (- n 2)))))
+(set fib_memo (memoize slow_fib 64))
+(println (fib_memo 80))
+(println (memo_stats fib_memo))
+(println (= (list 1 2) (list 1 3)))
+
+; maps are updated in place and keep their keys in insertion order
+(set ages (map "ada" 36 "alan" 41))
+(map_set ages "grace" 85)
+(map_remove ages "alan")
+(println ages)
+(println (strcat (map_get ages "ada") " " (map_has ages "alan") " " (map_get ages "alan" -1)))
+
+; strcat appends to the buffer of its first string in place, building a string in a loop is linear
+(set csv "")
+(set i 0)
+(while (< i 4) (set csv (strcat csv i ";")) (set i (+ i 1)))
+(set head (strcat csv "end"))
+(println csv " " head)
+
+; a map holding itself or a closure kept by the frame it captures is freed by the collections, gc runs one now
+(set node (map "name" "loop"))
+(map_set node "self" node)
+(set node null)
+(println (gc))
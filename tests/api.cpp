@@ -0,0 +1,110 @@
+// regression tests of the embedding api, each case runs in both evaluation modes
+#include "tinyLisp.h"
+#include "output.h"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace lsp;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+// an interpreter whose output is kept to be checked
+struct Fixture
+{
+	explicit Fixture(EvalMode mode) : sink(std::make_shared<StringSink>())
+	{
+		interp.mode = mode;
+		interp.output().set_sink(sink);
+	}
+
+	// what the interpreter printed so far
+	std::string printed()
+	{
+		interp.output().flush();
+		return sink->take();
+	}
+
+	// source evaluates to null and reports an error
+	bool fails(std::string const& source)
+	{
+		Cell const r = interp.evalS(source);
+		return r.type == CellType::Null && printed().find("[lisp error]") != std::string::npos;
+	}
+
+	Interpreter interp;
+	std::shared_ptr<StringSink> sink;
+};
+
+// a closure defined in an environement of the host cannot keep it, its locals are not visible to the body
+static void closure_in_host_environement(EvalMode mode)
+{
+	Fixture f(mode);
+	Environement env;
+	Cell const r = f.interp.evalS("(set n 2) (defun f (x) (+ x n)) (f 40)", env);
+	CHECK(r.type == CellType::Null);
+	CHECK(f.printed().find("[lisp error]") != std::string::npos);
+
+	f.interp.evalS("(set n 2)");
+	Cell const g = f.interp.evalS("(defun g (x) (+ x n)) (g 40)", env);
+	CHECK(g.type == CellType::Int && g.as_int() == 42);
+}
+
+static void malformed_defun(EvalMode mode)
+{
+	Fixture f(mode);
+	CHECK(f.fails("(defun f x 1)"));
+	CHECK(f.fails("(defun f)"));
+	CHECK(f.fails("(defun)"));
+	CHECK(f.fails("(defun 1 (x) x)"));
+	Cell const r = f.interp.evalS("(defun f (x) (+ x 1)) (f 1)");
+	CHECK(r.type == CellType::Int && r.as_int() == 2);
+}
+
+// the VM leaves these to the tree walker, which reports them
+static void malformed_forms(EvalMode mode)
+{
+	Fixture f(mode);
+	std::vector<Cell> const globals = f.interp.global_env.slots;
+	CHECK(f.fails("(if)"));
+	CHECK(f.fails("(if true)"));
+	CHECK(f.fails("(while)"));
+	CHECK(f.fails("(set)"));
+	CHECK(f.fails("(setg)"));
+	CHECK(f.fails("(set 1 2)"));
+	CHECK(f.fails("(setg \"n\" 2)"));
+	// a number as target used to overwrite the global of the slot it reads as
+	for (size_t i = 0; i < globals.size(); i++)
+		CHECK(f.interp.global_env.slots[i].type == globals[i].type);
+}
+
+// the builtins check their first operands like the others
+static void arithmetic_types(EvalMode mode)
+{
+	Fixture f(mode);
+	CHECK(f.fails("(- \"a\")"));
+	CHECK(f.fails("(- \"a\" 1)"));
+	CHECK(f.fails("(% \"a\" 2)"));
+	CHECK(f.fails("(% 7 \"a\")"));
+	Cell const r = f.interp.evalS("(- 7 (% 7 4) 1.5)");
+	CHECK(r.type == CellType::Float && r.as_float() == 2.5);
+}
+
+int main()
+{
+	for (EvalMode mode : { EvalMode::Bytecode, EvalMode::Tree })
+	{
+		closure_in_host_environement(mode);
+		malformed_defun(mode);
+		malformed_forms(mode);
+		arithmetic_types(mode);
+	}
+	if (failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return failures ? 1 : 0;
+}